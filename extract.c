@@ -54,6 +54,10 @@
 
 #include <libwcs/wcs.h>
 #include "wcs_align.h"
+#include "input_cache.h"
+#include "mmap_reader.h"
+#include "threads.h"
+#include "tile_reader.h"
 
 #ifdef DMALLOC
 #include <dmalloc.h>
@@ -93,6 +97,15 @@ long fpixel1[7], lpixel1[7], i, nx, ny;
 float *farray;
 
     if (*status) return *status;
+
+    /* tile-compressed images are read through the tile cache,
+     * uncompressed disk files straight from a memory map */
+    if (tile_read_subset (fptr, datatype, fpixel, lpixel, inc,
+                          nulval, array, anynul, status) ||
+        mmap_read_subset (fptr, datatype, fpixel, lpixel, inc,
+                          nulval, array, anynul, status))
+        return *status;
+
     if (inc[1] == 1) {
          /* just read one big block if we're reading every row */
          return fits_read_subset (fptr, datatype, fpixel, lpixel, inc,
@@ -153,6 +166,8 @@ char filename[512];
         return *status;
     if (naxis < 2 || naxis > 3) {
         /* not 2-D or 3-D -- just skip reading */
+        tile_cache_forget (*dqptr);
+        mmap_forget (*dqptr);
         (void) fits_close_file (*dqptr, status);
         *dqptr = NULL;
         return *status;
@@ -210,65 +225,127 @@ extern int get_qual_info (fitsfile **dqptr, long *nplanes, float *badmin, float
 }
 
 /*
- * Apply data quality array or limits and set bad pixels to NaN.
- * Returns the number of bad pixels that got blanked.
+ * Number of pixels in a subset, or 0 if the subset is not 2-D
  */
-
-extern int apply_qual (fitsfile *dqptr, long nplanes, float badmin, float badmax, float bad_data_value,
-    long fpixel[7], long lpixel[7], long inc[7],
-    float *arrayptr, int anynull, int badvalue,
-    int *status)
+static long
+qual_subset_size (long fpixel[7], long lpixel[7], long inc[7])
 {
-int i, j, *qarrayptr, nbad=0;
-long dim[7], totsize;
-unsigned char *qbadptr;
-
-    if (*status) return 0;
+int i;
+long dim, totsize;
 
-    /* give up if original image is not 2-D */
     totsize = 1;
     for (i=0; i<7; i++) {
-        dim[i] = (lpixel[i]-fpixel[i])/inc[i] + 1;
-        totsize *= dim[i];
+        dim = (lpixel[i]-fpixel[i])/inc[i] + 1;
+        if (i >= 2 && dim != 1) return 0;
+        totsize *= dim;
     }
-    for (i=2; i<7; i++) {
-        if (dim[i] != 1) {
-            return 0;
+    return totsize;
+}
+
+/*
+ * Mark the pixels that quality plane q says are bad: those with any of
+ * the badmask bits set or, with no mask, those equal to badvalue.  The
+ * first plane sets bad[], later ones clear it where they are good, since
+ * a pixel is good if any plane says it is.
+ */
+static void
+qual_plane_bad (int *q, long n, int badvalue, int badmask, unsigned char *bad, int first)
+{
+long i;
+
+    if (badmask) {
+        if (first) {
+            for (i=0; i<n; i++) bad[i] = (q[i] & badmask) != 0;
+        } else {
+            for (i=0; i<n; i++) bad[i] &= (q[i] & badmask) != 0;
+        }
+    } else {
+        if (first) {
+            for (i=0; i<n; i++) bad[i] = q[i] == badvalue;
+        } else {
+            for (i=0; i<n; i++) bad[i] &= q[i] == badvalue;
         }
     }
+}
 
-    if (dqptr != NULL) {
-        qarrayptr = (int *) malloc(totsize*sizeof(int));
-        qbadptr = (unsigned char *) malloc(totsize*sizeof(unsigned char));
-        if (qarrayptr == NULL || qbadptr == NULL) {
-            *status = MEMORY_ALLOCATION;
-            return 0;
-        }
+/*
+ * Read the quality planes for a subset.  A single plane is left in
+ * qarrayptr for apply_qual_plane; several planes are combined into
+ * qbadptr, 1 for bad pixels, for apply_qual_mask.
+ */
+static int read_qual (fitsfile *dqptr, long nplanes,
+    long fpixel[7], long lpixel[7], long inc[7], long totsize,
+    int *qarrayptr, unsigned char *qbadptr, int badvalue, int badmask, int *status)
+{
+int j, anynull;
+
+    if (*status) return *status;
+
+    for (j=1; j<=nplanes; j++) {
+        fpixel[2] = j;
+        lpixel[2] = j;
+        if (fitscut_read_subset (dqptr, TINT, fpixel, lpixel, inc,
+                              0, qarrayptr, &anynull, status))
+            return *status;
+        if (nplanes > 1)
+            qual_plane_bad (qarrayptr, totsize, badvalue, badmask, qbadptr, j == 1);
+    }
+    return *status;
+}
+
+/*
+ * Set pixels that a single quality plane marks bad, and NaN pixels, to
+ * NaN in one pass.  Returns the number of bad pixels.
+ */
+static int apply_qual_plane (int *qarrayptr, int badvalue, int badmask,
+    long totsize, float *arrayptr)
+{
+long i;
+int bad, nbad=0;
+
+    if (badmask) {
         for (i=0; i<totsize; i++) {
-            qbadptr[i] = 1;
+            bad = ((qarrayptr[i] & badmask) != 0) | (arrayptr[i] != arrayptr[i]);
+            nbad += bad;
+            arrayptr[i] = bad ? NAN : arrayptr[i];
         }
-        for (j=1; j<=nplanes; j++) {
-            fpixel[2] = j;
-            lpixel[2] = j;
-            if (fitscut_read_subset (dqptr, TINT, fpixel, lpixel, inc,
-                                  0, qarrayptr, &anynull, status))
-                return 0;
-            /* pixel are good if any plane indicates good data */
-            for (i=0; i<totsize; i++) {
-                if (qarrayptr[i] != badvalue) qbadptr[i] = 0;
-            }
-        }
-        free(qarrayptr);
-
+    } else {
         for (i=0; i<totsize; i++) {
-            if (qbadptr[i] || arrayptr[i] != arrayptr[i]) {
-                nbad++;
-                arrayptr[i] = NAN;
-            }
+            bad = (qarrayptr[i] == badvalue) | (arrayptr[i] != arrayptr[i]);
+            nbad += bad;
+            arrayptr[i] = bad ? NAN : arrayptr[i];
         }
+    }
+    return nbad;
+}
 
-        free(qbadptr);
-    } else if (badmin != bad_data_value) {
+/*
+ * Set pixels flagged in the quality mask, and NaN pixels, to NaN.
+ * Returns the number of bad pixels.
+ */
+static int apply_qual_mask (unsigned char *qbadptr, long totsize, float *arrayptr)
+{
+long i;
+int bad, nbad=0;
+
+    for (i=0; i<totsize; i++) {
+        bad = qbadptr[i] | (arrayptr[i] != arrayptr[i]);
+        nbad += bad;
+        arrayptr[i] = bad ? NAN : arrayptr[i];
+    }
+    return nbad;
+}
+
+/*
+ * Set pixels outside the badpix limits, or equal to bad_data_value, to NaN.
+ * Returns the number of bad pixels.
+ */
+static int apply_qual_limits (float badmin, float badmax, float bad_data_value,
+    long totsize, float *arrayptr)
+{
+int i, nbad=0;
+
+    if (badmin != bad_data_value) {
         if (badmax != bad_data_value) {
             /* set values outside badmin,badmax to zero */
             for (i=0; i<totsize; i++) {
@@ -298,6 +375,50 @@ unsigned char *qbadptr;
             }
         }
     }
+    return nbad;
+}
+
+/*
+ * Apply data quality array or limits and set bad pixels to NaN.
+ * Returns the number of bad pixels that got blanked.
+ */
+
+extern int apply_qual (fitsfile *dqptr, long nplanes, float badmin, float badmax, float bad_data_value,
+    long fpixel[7], long lpixel[7], long inc[7],
+    float *arrayptr, int badvalue, int badmask,
+    int *status)
+{
+int *qarrayptr, nbad=0;
+long totsize;
+unsigned char *qbadptr;
+
+    if (*status) return 0;
+
+    /* give up if original image is not 2-D */
+    totsize = qual_subset_size (fpixel, lpixel, inc);
+    if (totsize == 0) return 0;
+
+    if (dqptr != NULL) {
+        qarrayptr = (int *) malloc(totsize*sizeof(int));
+        qbadptr = (unsigned char *) malloc(totsize*sizeof(unsigned char));
+        if (qarrayptr == NULL || qbadptr == NULL) {
+            free(qarrayptr);
+            free(qbadptr);
+            *status = MEMORY_ALLOCATION;
+            return 0;
+        }
+        if (read_qual (dqptr, nplanes, fpixel, lpixel, inc, totsize,
+                qarrayptr, qbadptr, badvalue, badmask, status))
+            nbad = 0;
+        else if (nplanes > 1)
+            nbad = apply_qual_mask (qbadptr, totsize, arrayptr);
+        else
+            nbad = apply_qual_plane (qarrayptr, badvalue, badmask, totsize, arrayptr);
+        free(qarrayptr);
+        free(qbadptr);
+    } else {
+        nbad = apply_qual_limits (badmin, badmax, bad_data_value, totsize, arrayptr);
+    }
 
     return nbad;
 }
@@ -386,43 +507,115 @@ fits_get_bsoften (FitsCutImage *Image, int k, int *useBsoften, double *bsoften,
     }
 }
 
-void
-extract_fits (FitsCutImage *Image)
+/*
+ * Number of input rows to read at a time: as many as fit in the memory
+ * budget, a whole number of output rows when shrinking by pixfac, and no
+ * more than the cutout needs
+ */
+static int
+get_block_rows (long max_memory, int ncols, int nrows, int pixfac, int use_qual)
 {
-    fitsfile *fptr;          /* pointer to the FITS file; defined in fitsio.h */
-    fitsfile *dqptr = NULL;  /* pointer to the data quality extension */
+    long rowbytes, rows, maxrows;
+
+    /* read buffer plus the quality arrays apply_qual allocates per block */
+    rowbytes = ncols * (sizeof(float) + (use_qual ? sizeof(int) + 1 : 0));
+    if (rowbytes < 1) rowbytes = 1;
+    rows = max_memory / rowbytes;
+
+    rows = (rows / pixfac) * pixfac;
+    if (rows < pixfac) rows = pixfac;
+    maxrows = ((nrows-1)/pixfac + 1) * pixfac;
+    if (rows > maxrows) rows = maxrows;
+
+    fitscut_message (2, "\tReading %ld rows at a time\n", rows);
+    return rows;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* blocks in the ring read ahead of binning, including the one being binned */
+#define EXTRACT_RING 3
+#else
+#define EXTRACT_RING 1
+#endif
+
+/* one block of input rows on its way from the file to the output */
+typedef struct extract_block {
+    float *buffer;          /* read buffer, NULL when reading straight into the output */
+    int *qarray;            /* quality plane being read */
+    unsigned char *qbad;    /* planes combined, 1 for bad pixels; only for several planes */
+    long j0;
+    long fpixel[7], lpixel[7];
+    int blockrows, rows_read, pstart, anynull;
     int status;
+} ExtractBlock;
+
+/* one input channel being extracted block by block */
+typedef struct extract_channel {
+    int k;
+    fitsfile *fptr;
+    fitsfile *dqptr;
+    long nplanes;
     /* allow room for trailing dimensions */
-    long fpixel[7] = {1,1,1,1,1,1,1};
-    long lpixel[7] = {1,1,1,1,1,1,1};
-    long inc[7] = {1,1,1,1,1,1,1};
-    float *arrayptr;
-    float *bufferptr;
-    int datatype, anynull;
-    float nullval = NAN;
-    int pixfac, doshrink, pstart, bufrows;
-    int nrows, rows_read = 0, zoomrows;
-    int ncols, cols_read = 0, zoomcols;
-    int xoffset = 0;
-    int yoffset = 0;
-
-    int naxis;
-    long naxes[2], nplanes;
-    long x1, y1, x0, y0;
-    double xsky, ysky, xpix, ypix;
-    int offscl;
+    long fpixel[7], lpixel[7], inc[7];
+    long x0, y0, y1;
+    int ncols, nrows, cols_read;
+    int pixfac, doshrink, zoomcols, zoomrows;
+    double zoom;            /* fractional zoom resampled while reading, 0 for none */
+    AreaResampler *area;    /* that resampling, while the channel is read */
+    int bufrows;            /* input rows read per block */
+    int nring;              /* blocks read ahead, 1 for no reader thread */
+    ExtractBlock ring[EXTRACT_RING];
     int useBsoften;
     double boffset, bsoften;
+    int nbad;
+    int good;               /* cutout overlaps the image */
+} ExtractChannel;
+
+/* cutout being read a strip of output rows at a time */
+struct extract_stream {
+    FitsCutImage *Image;
+    ExtractChannel channel[MAX_CHANNELS];
+    int present[MAX_CHANNELS];
+    float *strip[MAX_CHANNELS];     /* output rows of the block last read */
+    int strip_rows[MAX_CHANNELS];   /* output rows per block */
+    long strip_block[MAX_CHANNELS]; /* index of that block, -1 for none */
+};
 
-    int k, i, j, j0, j1, nbad = 0, ngoodimages = 0;
-    int num_keys, more_keys;
-    char *header;
+/*
+ * --output-size with no WCS alignment is resampled to the exact size as
+ * the blocks are read, rather than binned by a whole pixfac into an
+ * intermediate array that is then resized
+ */
+static int
+extract_single_pass (FitsCutImage *Image)
+{
+    return Image->output_size > 0 && Image->output_alignment == ALIGN_NONE;
+}
 
-    struct WorldCoor *save_wcs = NULL;
+/* true if the blocks of ch are read into a buffer and resampled into the output */
+static int
+extract_resamples (ExtractChannel *ch)
+{
+    return ch->pixfac > 1 || ch->zoom > 0;
+}
+
+/*
+ * Set up the reference image info shared by all channels
+ */
+static void
+extract_reference (FitsCutImage *Image, struct WorldCoor **save_wcs)
+{
+    long naxes[2];
+    long x0, y0;
+    int nrows, ncols, pixfac, doshrink, zoomrows, zoomcols;
+    double xsky, ysky, xpix, ypix, zoom;
+    int offscl;
 
     /* initialize to silence compiler warnings */
     float zoom_factor = 1.0;
 
+    *save_wcs = NULL;
+
     /*
      * set up reference image info
      * all cutout positions are initially the same, so copy channel zero
@@ -505,6 +698,21 @@ extract_fits (FitsCutImage *Image)
     fitscut_message (2, "Calculated zoom factor of %f from %f\n",
              zoom_factor, Image->output_zoomref);
 
+    if (extract_single_pass (Image)) {
+        /* straight to the exact output size, as the channels */
+        get_exact_zoom_size (ncols, nrows, Image->output_size, &zoomcols, &zoomrows, &zoom);
+        fitscut_message (1, "\tZoomed output size is %d x %d\n", zoomcols, zoomrows);
+        Image->ncolsref = zoomcols;
+        Image->nrowsref = zoomrows;
+        Image->output_zoomref = zoom;
+        wcs_update_ref(Image);
+
+        fitscut_message (1, "\tReference %s[%ld:%ld,%ld:%ld]...\n",
+                 Image->reference_filename,
+                 (long) x0+1, (long) x0+ncols, (long) y0+1, (long) y0+nrows);
+        return;
+    }
+
     get_zoom_size_channel (ncols, nrows, zoom_factor, Image->output_size,
         &pixfac, &zoomcols, &zoomrows, &doshrink);
     fitscut_message (1, "\tZoomed output size is %d x %d\n", zoomcols, zoomrows);
@@ -534,8 +742,8 @@ extract_fits (FitsCutImage *Image)
              *
              * Save the original reference WCS for later restoration.
              */
-            save_wcs = (struct WorldCoor *) malloc(sizeof(struct WorldCoor));
-            memcpy(save_wcs, Image->wcsref, sizeof(struct WorldCoor));
+            *save_wcs = (struct WorldCoor *) malloc(sizeof(struct WorldCoor));
+            memcpy(*save_wcs, Image->wcsref, sizeof(struct WorldCoor));
         } else {
             exact_resize_reference (Image, Image->output_size);
         }
@@ -546,318 +754,755 @@ extract_fits (FitsCutImage *Image)
     fitscut_message (1, "\tReference %s[%ld:%ld,%ld:%ld]...\n",
              Image->reference_filename,
              (long) x0+1, (long) x0+ncols, (long) y0+1, (long) y0+nrows);
+}
 
-    for (k = 0; k < Image->channels; k++) {
+/*
+ * Work out the section of channel k to extract, open its quality data and
+ * allocate the read buffer.  The zoomed size and zoom factor are stored
+ * back in Image.  Returns true if the cutout overlaps the image.
+ */
+static int
+extract_channel_open (FitsCutImage *Image, int k, ExtractChannel *ch, int nring)
+{
+    fitsfile *fptr;
+    FitsCutInput *input;
+    int status = 0;
+    int naxis, datatype, rows_read, i;
+    long naxes[2], x0, y0, x1, y1;
+    double xsky, ysky, xpix, ypix;
+    int offscl;
+    int num_keys, more_keys;
+    int rowfac;
+    long bufsize;
 
-        status = 0;
-    
-        fitscut_message (1, "\tExamining FITS channel %d...\n", k);
-    
-        /* reset data pointer */
-        Image->data[k] = NULL;
+    /* initialize to silence compiler warnings */
+    float zoom_factor = 1.0;
 
-        if (Image->input_filename[k] == NULL)
-            continue;
+    ch->k = k;
+    ch->dqptr = NULL;
+    ch->nplanes = 1;
+    ch->nring = 1;
+    ch->zoom = 0;
+    ch->area = NULL;
+    for (i = 0; i < EXTRACT_RING; i++) {
+        ch->ring[i].buffer = NULL;
+        ch->ring[i].qarray = NULL;
+        ch->ring[i].qbad = NULL;
+    }
+    ch->nbad = 0;
+    ch->good = 0;
+    for (i = 0; i < 7; i++) {
+        ch->fpixel[i] = ch->lpixel[i] = ch->inc[i] = 1;
+    }
 
-        if (fits_open_image (&fptr, Image->input_filename[k], READONLY, &status)) 
-            printerror (status);
+    /* file and header stay open in the input cache until the cutout is written */
+    input = input_cache_open (Image->input_filename[k]);
+    fptr = ch->fptr = input->fptr;
 
-        /* let cfitsio extract the entire header as a string */
-        if (fits_get_image_wcs_keys (fptr, &header, &status))
-            printerror (status);
+    Image->header_cards[k] = input->header_cards;
+    Image->header[k] = input->header;
 
-        Image->header_cards[k] = strlen(header)/(FLEN_CARD-1);
-        Image->header[k] = header;
+    /* get world coordinate system info from header */
+    wcs_initialize_channel(Image, k);
 
-        /* get world coordinate system info from header */
-        wcs_initialize_channel(Image, k);
+    if (Image->input_wcscoords[k]) {
+        if (nowcs(Image->wcs[k])) {
+            fitscut_message (1,
+                "fitscut: warning: no WCS info for channel %d\n", k);
+        } else {
 
-        if (Image->input_wcscoords[k]) {
-            if (nowcs(Image->wcs[k])) {
-                fitscut_message (1,
-                    "fitscut: warning: no WCS info for channel %d\n", k);
-            } else {
+            /* convert coordinates from sky to pixels */
 
-                /* convert coordinates from sky to pixels */
-
-                xsky = Image->input_x[k];
-                ysky = Image->input_y[k];
-                wcs2pix(Image->wcs[k], xsky, ysky, &xpix, &ypix, &offscl);
-                if (offscl == 1) {
-                    /* way off image center -- just use huge numbers */
-                    Image->input_x[k] = 1.e10;
-                    Image->input_y[k] = 1.e10;
-                } else {
-                    /* convert to zero-based pixel numbers for x0, y0 */
-                    xpix = xpix-1;
-                    ypix = ypix-1;
-                    Image->input_x[k] = xpix;
-                    Image->input_y[k] = ypix;
-                }
+            xsky = Image->input_x[k];
+            ysky = Image->input_y[k];
+            wcs2pix(Image->wcs[k], xsky, ysky, &xpix, &ypix, &offscl);
+            if (offscl == 1) {
+                /* way off image center -- just use huge numbers */
+                Image->input_x[k] = 1.e10;
+                Image->input_y[k] = 1.e10;
+            } else {
+                /* convert to zero-based pixel numbers for x0, y0 */
+                xpix = xpix-1;
+                ypix = ypix-1;
+                Image->input_x[k] = xpix;
+                Image->input_y[k] = ypix;
             }
         }
+    }
 
-        if (Image->output_alignment == ALIGN_REF) {
-            /* image section to extract is determined by reference image */
-            wcs_match_channel (Image, k);
-        }
+    if (Image->output_alignment == ALIGN_REF) {
+        /* image section to extract is determined by reference image */
+        wcs_match_channel (Image, k);
+    }
 
-        if (Image->input_x_corner[k] == 0) {
-            Image->x0[k] = Image->input_x[k] - Image->ncols[k] / 2;
-        } else {
-            Image->x0[k] = Image->input_x[k];
-        }
-        if (Image->input_y_corner[k] == 0) {
-            Image->y0[k] = Image->input_y[k] - Image->nrows[k] / 2;
-        } else {
-            Image->y0[k] = Image->input_y[k];
+    if (Image->input_x_corner[k] == 0) {
+        Image->x0[k] = Image->input_x[k] - Image->ncols[k] / 2;
+    } else {
+        Image->x0[k] = Image->input_x[k];
+    }
+    if (Image->input_y_corner[k] == 0) {
+        Image->y0[k] = Image->input_y[k] - Image->nrows[k] / 2;
+    } else {
+        Image->y0[k] = Image->input_y[k];
+    }
+
+    if (fits_get_img_dim (fptr, &naxis, &status))
+        printerror (status);
+
+    if (fits_get_img_size (fptr, 2, naxes, &status))
+        printerror (status);
+
+    if (Image->ncols[k] == MAGIC_SIZE_ALL_NUMBER) {
+        Image->ncols[k] = naxes[0];
+        Image->x0[k] = 0;
+    }
+    if (Image->nrows[k] == MAGIC_SIZE_ALL_NUMBER) {
+        Image->nrows[k] = naxes[1];
+        Image->y0[k] = 0;
+    }
+
+    /* check that cutout is within image dimensions */
+    ch->nrows = Image->nrows[k];
+    ch->ncols = Image->ncols[k];
+
+    x0 = floor(Image->x0[k]+0.5);
+    y0 = floor(Image->y0[k]+0.5);
+
+    /* propagate exact corner used back into Image structure */
+    Image->x0[k] = x0;
+    Image->y0[k] = y0;
+
+    if (x0<0)
+        fitscut_message (1, "fitscut: warning: cutout x0 < 0 for channel %d\n", k);
+    if (y0<0)
+        fitscut_message (1, "fitscut: warning: cutout y0 < 0 for channel %d\n", k);
+
+    /* determine zoomed image size */
+
+    if (Image->output_zoom[k] > 0) {
+        zoom_factor = Image->output_zoom[k];
+    }
+    else {
+        zoom_factor = 1.0;
+    }
+    fitscut_message (2, "Calculated zoom factor of %f from %f\n",
+             zoom_factor, Image->output_zoom[k]);
+
+    if (extract_single_pass (Image)) {
+        ch->pixfac = 1;
+        ch->doshrink = 0;
+        if (get_exact_zoom_size (ch->ncols, ch->nrows, Image->output_size,
+                &ch->zoomcols, &ch->zoomrows, &ch->zoom) == Image->output_size)
+            ch->zoom = 0;
+    } else {
+        get_zoom_size_channel (ch->ncols, ch->nrows, zoom_factor, Image->output_size,
+            &ch->pixfac, &ch->zoomcols, &ch->zoomrows, &ch->doshrink);
+    }
+    fitscut_message (1, "\tZoomed output size is %d x %d\n", ch->zoomcols, ch->zoomrows);
+
+    /* CFITSIO starts indexing at 1 */
+    x0 += 1;
+    y0 += 1;
+    x1 = x0 + ch->ncols - 1;
+    y1 = y0 + ch->nrows - 1;
+    ch->fpixel[0] = MAX (1,x0);
+    ch->fpixel[1] = MAX (1,y0);
+    ch->lpixel[0] = MIN (naxes[0],x1);
+    ch->lpixel[1] = MIN (naxes[1],y1);
+    ch->x0 = x0;
+    ch->y0 = y0;
+    ch->y1 = ch->lpixel[1];
+
+    if (fits_get_img_type (fptr, &datatype, &status))
+        printerror (status);
+    /*
+     * force datatype to single precision if input is double (since all the code
+     * below reads the image as single precision)
+     */
+    if (datatype == DOUBLE_IMG) datatype = FLOAT_IMG;
+    Image->input_datatype[k] = datatype;
+
+    rows_read = ch->lpixel[1] - ch->fpixel[1] + 1;
+    ch->cols_read = ch->lpixel[0] - ch->fpixel[0] + 1;
+    if (rows_read <= 0 || ch->cols_read <= 0) {
+        /* create empty image for this band
+         * will print error at end of loop if dimensions are negative for all bands
+         */
+        fitscut_message (1, "Some image dimensions are negative (%d x %d)\n",
+                 ch->cols_read, rows_read);
+    } else {
+        ch->good = 1;
+
+        /* setup for data quality flagging */
+
+        /*
+         * get info for data quality flagging (if it is used)
+         * don't apply flagging for JSON (pixel value) output or
+         * for FITS output (unless the FITS image is being rebinned)
+         */
+        if (ch->doshrink || (ch->zoom > 0 && ch->zoom < 1) ||
+            (Image->output_type != OUTPUT_JSON && Image->output_type != OUTPUT_FITS)) {
+            if (get_qual_info (&ch->dqptr, &ch->nplanes, &Image->badmin[k], &Image->badmax[k], &Image->bad_data_value[k],
+                fptr, Image->header[k], Image->header_cards[k],
+                Image->qext_set, Image->qext[k], Image->useBadpix,
+                &status))
+                printerror (status);
         }
 
-        if (fits_get_img_dim (fptr, &naxis, &status))
+        if (fits_get_hdrspace (fptr, &num_keys, &more_keys, &status))
             printerror (status);
 
-        if (fits_get_img_size (fptr, 2, naxes, &status))
-            printerror (status);
+        fitscut_message (3, "\t\theader has %d keys with space for %d more\n",
+                 num_keys, more_keys);
+    }
 
-        if (Image->ncols[k] == MAGIC_SIZE_ALL_NUMBER) {
-            Image->ncols[k] = naxes[0];
-            Image->x0[k] = 0;
-        }
-        if (Image->nrows[k] == MAGIC_SIZE_ALL_NUMBER) {
-            Image->nrows[k] = naxes[1];
-            Image->y0[k] = 0;
+    /*
+     * allocate partial buffer and bin in blocks
+     */
+    if (ch->doshrink && (ch->zoomcols < ch->ncols || ch->zoomrows < ch->nrows)) {
+        /* determine number of rows to read for buffer */
+        rowfac = ch->pixfac;
+    } else {
+        rowfac = 1;
+    }
+    ch->bufrows = get_block_rows (Image->max_memory, ch->ncols, ch->nrows, rowfac, ch->dqptr != NULL);
+
+    /*
+     * when binning more than one block, a reader thread fills the next
+     * buffers of a ring while one is binned; the buffers share the budget
+     */
+    if (nring > 1 && ch->good && extract_resamples (ch) && ch->y1 - ch->y0 >= ch->bufrows) {
+        ch->nring = nring;
+        ch->bufrows = get_block_rows (Image->max_memory / nring, ch->ncols, ch->nrows, rowfac, ch->dqptr != NULL);
+    }
+
+    if (ch->good) {
+        bufsize = (long) ch->ncols * ch->bufrows;
+        for (i = 0; i < ch->nring; i++) {
+            if (extract_resamples (ch)) {
+                fitscut_message (2, "\tAllocating space for %d x %d buffer\n",
+                         ch->ncols, ch->bufrows);
+                ch->ring[i].buffer = cutout_alloc (ch->ncols, ch->bufrows, NAN);
+            }
+            if (ch->dqptr != NULL) {
+                ch->ring[i].qarray = (int *) malloc (bufsize * sizeof (int));
+                if (ch->nplanes > 1)
+                    ch->ring[i].qbad = (unsigned char *) malloc (bufsize);
+                if (ch->ring[i].qarray == NULL ||
+                    (ch->nplanes > 1 && ch->ring[i].qbad == NULL)) {
+                    fitscut_message (0, "Unable to allocate memory for %d x %d quality mask\n",
+                             ch->ncols, ch->bufrows);
+                    do_exit (1);
+                }
+            }
         }
 
-        /* check that cutout is within image dimensions */
-        nrows = Image->nrows[k];
-        ncols = Image->ncols[k];
+        fitscut_message (1, "\tExtracting %s[%ld:%ld,%ld:%ld]...\n",
+                 Image->input_filename[k],
+                 ch->fpixel[0], ch->lpixel[0], ch->fpixel[1], ch->lpixel[1]);
 
-        x0 = floor(Image->x0[k]+0.5);
-        y0 = floor(Image->y0[k]+0.5);
+        /* get asinh parameters from header if requested */
+        fits_get_bsoften (Image, k, &ch->useBsoften, &ch->bsoften, &ch->boffset);
+    }
 
-        /* propagate exact corner used back into Image structure */
-        Image->x0[k] = x0;
-        Image->y0[k] = y0;
+    Image->ncols[k] = ch->zoomcols;
+    Image->nrows[k] = ch->zoomrows;
+    if (ch->zoom > 0) {
+        Image->output_zoom[k] = ch->zoom;
+    } else if (ch->doshrink) {
+        Image->output_zoom[k] = 1.0/ch->pixfac;
+    } else if (ch->pixfac > 1) {
+        Image->output_zoom[k] = ch->pixfac;
+    } else {
+        Image->output_zoom[k] = 1.0;
+    }
+    return ch->good;
+}
 
-        if (x0<0)
-            fitscut_message (1, "fitscut: warning: cutout x0 < 0 for channel %d\n", k);
-        if (y0<0)
-            fitscut_message (1, "fitscut: warning: cutout y0 < 0 for channel %d\n", k);
+/* offset in the output array of the rows made from the block starting at j0 */
+static long
+extract_block_offset (ExtractChannel *ch, long j0)
+{
+    /* an area resampling adds each block into the whole array */
+    if (ch->area != NULL)
+        return 0;
+    if (ch->doshrink)
+        return (j0 - ch->y0) / ch->pixfac * ch->zoomcols;
+    return (j0 - ch->y0) * ch->pixfac * ch->zoomcols;
+}
 
-        /* determine zoomed image size */
+/*
+ * Read the block of input rows starting at j0 into bufferptr, with its
+ * quality mask.  Runs in the reader thread when prefetching, so it only
+ * touches blk and returns a cfitsio status rather than reporting errors.
+ */
+static int
+extract_block_read (FitsCutImage *Image, ExtractChannel *ch, long j0,
+    ExtractBlock *blk, float *bufferptr)
+{
+    int status = 0;
+    float nullval = NAN;
+    long j1, totsize;
+    int i;
 
-        if (Image->output_zoom[k] > 0) {
-            zoom_factor = Image->output_zoom[k];
-        }
-        else {
-            zoom_factor = 1.0;
+    blk->j0 = j0;
+    /* the last block stops at the end of the output array */
+    if (ch->doshrink) {
+        blk->blockrows = MIN (ch->bufrows, (ch->zoomrows - (j0-ch->y0)/ch->pixfac)*ch->pixfac);
+    } else {
+        blk->blockrows = MIN (ch->bufrows, ch->nrows - (j0-ch->y0));
+    }
+
+    for (i = 0; i < 7; i++) {
+        blk->fpixel[i] = ch->fpixel[i];
+        blk->lpixel[i] = ch->lpixel[i];
+    }
+    j1 = j0 + blk->blockrows - 1;
+    blk->fpixel[1] = MAX (1,j0);
+    blk->lpixel[1] = MIN (ch->y1,j1);
+    blk->rows_read = blk->lpixel[1] - blk->fpixel[1] + 1;
+    if (blk->rows_read <= 0)
+        return 0;
+
+    /* put data at the end of the buffer to make shifting easier */
+    blk->pstart = ch->ncols*blk->blockrows - ch->cols_read*blk->rows_read;
+
+    if (fitscut_read_subset (ch->fptr, TFLOAT, blk->fpixel, blk->lpixel, ch->inc,
+                  &nullval, &bufferptr[blk->pstart], &blk->anynull, &status))
+        return status;
+
+    if (ch->dqptr != NULL) {
+        totsize = qual_subset_size (blk->fpixel, blk->lpixel, ch->inc);
+        read_qual (ch->dqptr, ch->nplanes, blk->fpixel, blk->lpixel, ch->inc,
+            totsize, blk->qarray, blk->qbad, Image->qext_bad_value[ch->k], Image->qext_mask, &status);
+    }
+    return status;
+}
+
+/*
+ * Apply DQ flagging to a block that has been read, invert asinh scaling,
+ * and rebin using the zoom factor into the output rows at outptr, or add
+ * it into the channel's area resampling.  Returns a cfitsio status.
+ */
+static int
+extract_block_finish (FitsCutImage *Image, ExtractChannel *ch,
+    ExtractBlock *blk, float *bufferptr, float *outptr)
+{
+    int k = ch->k;
+    int ncols = ch->ncols;
+    int blockrows = blk->blockrows;
+    int rows_read = blk->rows_read;
+    int pstart = blk->pstart;
+    int xoffset, yoffset;
+    long totsize;
+    int i, j;
+
+    if (rows_read <= 0) {
+
+        /* off edge, mark data as missing */
+        for (j = 0; j < blockrows; j++) {
+            for (i = 0; i < ncols; i++) bufferptr[i+j*ncols] = NAN;
         }
-        fitscut_message (2, "Calculated zoom factor of %f from %f\n",
-                 zoom_factor, Image->output_zoom[k]);
 
-        get_zoom_size_channel (ncols, nrows, zoom_factor, Image->output_size,
-            &pixfac, &zoomcols, &zoomrows, &doshrink);
-        fitscut_message (1, "\tZoomed output size is %d x %d\n", zoomcols, zoomrows);
+    } else {
 
-        /* CFITSIO starts indexing at 1 */
-        x0 += 1;
-        y0 += 1;
-        x1 = x0 + ncols - 1;
-        y1 = y0 + nrows - 1;
-        fpixel[0] = MAX (1,x0);
-        fpixel[1] = MAX (1,y0);
-    
-        inc[0] = 1;
-        inc[1] = 1;
-        lpixel[0] = MIN (naxes[0],x1);
-        lpixel[1] = MIN (naxes[1],y1);
-        y1 = lpixel[1];
+        /* apply data quality flagging to zero bad pixels */
+
+        totsize = (long) ch->cols_read * rows_read;
+        if (ch->dqptr != NULL && ch->nplanes > 1)
+            ch->nbad += apply_qual_mask (blk->qbad, totsize, &bufferptr[pstart]);
+        else if (ch->dqptr != NULL)
+            ch->nbad += apply_qual_plane (blk->qarray, Image->qext_bad_value[k], Image->qext_mask,
+                totsize, &bufferptr[pstart]);
+        else
+            ch->nbad += apply_qual_limits (Image->badmin[k], Image->badmax[k], Image->bad_data_value[k],
+                totsize, &bufferptr[pstart]);
+
+        if (ch->useBsoften) {
+            /* invert asinh scaling */
+            invert_bsoften(ch->bsoften, ch->boffset, blk->fpixel, blk->lpixel, ch->inc,
+                &bufferptr[pstart], Image->bad_data_value[k]);
+        }
 
-        if (fits_get_img_type (fptr, &datatype, &status))
-            printerror (status);
-        /*
-         * force datatype to single precision if input is double (since all the code
-         * below reads the image as single precision)
-         */
-        if (datatype == DOUBLE_IMG) datatype = FLOAT_IMG;
-        Image->input_datatype[k] = datatype;
-
-        rows_read = lpixel[1] - fpixel[1] + 1;
-        cols_read = lpixel[0] - fpixel[0] + 1;
-        if (rows_read <= 0 || cols_read <= 0) {
-            /* create empty image for this band
-             * will print error at end of loop if dimensions are negative for all bands
+        if (pstart != 0) {
+            /* move the subset read from the fits file so it is embedded in
+             * an array of size ncols x blockrows
+             * This is done as an in-place move from the end of the buffer
+             * toward the beginning.
              */
-            fitscut_message (1, "Some image dimensions are negative (%d x %d)\n",
-                     cols_read, rows_read);
-        } else {
-            ngoodimages += 1;
 
-            /* setup for data quality flagging */
+            xoffset = blk->fpixel[0] - ch->x0;
+            yoffset = blk->fpixel[1] - blk->j0;
+            pstart = pstart - xoffset - ch->cols_read*yoffset;
 
-            /*
-             * get info for data quality flagging (if it is used)
-             * don't apply flagging for JSON (pixel value) output or
-             * for FITS output (unless the FITS image is being rebinned)
-             */
-            if (doshrink || (Image->output_type != OUTPUT_JSON && Image->output_type != OUTPUT_FITS)) {
-                if (get_qual_info (&dqptr, &nplanes, &Image->badmin[k], &Image->badmax[k], &Image->bad_data_value[k],
-                    fptr, Image->header[k], Image->header_cards[k],
-                    Image->qext_set, Image->qext[k], Image->useBadpix,
-                    &status))
-                    printerror (status);
+            /* leading empty rows */
+            for (j = 0; j < yoffset; j++) {
+                for (i = 0; i < ncols; i++) bufferptr[i + j*ncols] = NAN;
             }
+            for (j = yoffset; j < yoffset+rows_read; j++) {
+                /* leading empty columns */
+                for (i = 0; i < xoffset; i++) {
+                    bufferptr[i+j*ncols] = NAN;
+                }
+                /* copy block of pixels */
+                for (i = xoffset; i < xoffset+ch->cols_read; i++) {
+                    bufferptr[i+j*ncols] = bufferptr[pstart + i + ch->cols_read*j];
+                }
+                /* trailing empty columns */
+                for (i = xoffset+ch->cols_read; i < ncols; i++) {
+                    bufferptr[i+j*ncols] = NAN;
+                }
+            }
+            /* trailing empty rows */
+            for (j = yoffset+rows_read; j < blockrows; j++) {
+                for (i = 0; i < ncols; i++) bufferptr[i + j*ncols] = NAN;
+            }
+        }
+    }
 
-            if (fits_get_hdrspace (fptr, &num_keys, &more_keys, &status))
-                printerror (status);
+    if (ch->area != NULL) {
+        return area_resampler_add_rows (ch->area, bufferptr, blk->j0 - ch->y0, blockrows);
+    } else if (ch->doshrink) {
+        reduce_array(bufferptr, outptr, ncols, blockrows, ch->pixfac, Image->bad_data_value[k]);
+    } else if (ch->pixfac > 1) {
+        enlarge_array(bufferptr, outptr, ncols, blockrows, ch->pixfac);
+    }
+    return 0;
+}
 
-            fitscut_message (3, "\t\theader has %d keys with space for %d more\n",
-                     num_keys, more_keys);
-        }
+/*
+ * Read the block of input rows starting at j0, apply DQ flagging,
+ * and rebin using the zoom factor into the output rows at outptr.
+ * May run in a worker thread, so errors are returned as a cfitsio
+ * status rather than reported here.
+ */
+static int
+extract_channel_block (FitsCutImage *Image, ExtractChannel *ch, long j0, float *outptr)
+{
+    ExtractBlock *blk = &ch->ring[0];
+    float *bufferptr;
+    int status;
 
-        /*
-         * allocate partial buffer and bin in blocks
-         */
-        if (doshrink && (zoomcols < ncols || zoomrows < nrows)) {
-            /* determine number of rows to read for buffer */
-            bufrows = pixfac; /* TEST: ultimately make this bigger based on memory usage */
-        } else {
-            bufrows = nrows;
-        }
+    /* with no resizing, read straight into the output array */
+    bufferptr = extract_resamples (ch) ? blk->buffer : outptr;
 
-        /* create array for output image */
+    status = extract_block_read (Image, ch, j0, blk, bufferptr);
+    if (! status)
+        status = extract_block_finish (Image, ch, blk, bufferptr, outptr);
+    return status;
+}
 
-        fitscut_message (1, "\tAllocating space for %d x %d output array\n",
-                 zoomcols, zoomrows);
-        arrayptr = cutout_alloc (zoomcols, zoomrows, NAN);
+#ifdef HAVE_PTHREAD_H
+
+/* a reader thread filling the ring of blocks of one channel */
+typedef struct {
+    FitsCutImage *Image;
+    ExtractChannel *ch;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long nblocks;
+    long nread;             /* blocks read so far */
+    long nbinned;           /* blocks binned so far, whose buffers are free */
+    int stop;               /* binning gave up, stop reading */
+} ExtractPrefetch;
+
+static void *
+extract_prefetch_reader (void *arg)
+{
+    ExtractPrefetch *pf = (ExtractPrefetch *) arg;
+    ExtractChannel *ch = pf->ch;
+    ExtractBlock *blk;
+    long m;
+    int stop;
+
+    for (m = 0; m < pf->nblocks; m++) {
+        /* wait for the buffer of block m - nring to be binned */
+        pthread_mutex_lock (&pf->lock);
+        while (m - pf->nbinned >= ch->nring && ! pf->stop)
+            pthread_cond_wait (&pf->cond, &pf->lock);
+        stop = pf->stop;
+        pthread_mutex_unlock (&pf->lock);
+        if (stop)
+            break;
+
+        blk = &ch->ring[m % ch->nring];
+        blk->status = extract_block_read (pf->Image, ch, ch->y0 + m*ch->bufrows,
+            blk, blk->buffer);
+
+        pthread_mutex_lock (&pf->lock);
+        pf->nread = m + 1;
+        pthread_cond_broadcast (&pf->cond);
+        pthread_mutex_unlock (&pf->lock);
+        if (blk->status)
+            break;
+    }
+    return NULL;
+}
 
-        if (cols_read > 0 && rows_read > 0) {
-            if (pixfac > 1) {
-                fitscut_message (2, "\tAllocating space for %d x %d buffer\n",
-                         ncols, bufrows);
-                bufferptr = cutout_alloc (ncols, bufrows, NAN);
-            } else {
-                /* no resizing, so make buffer same as output array */
-                bufferptr = arrayptr;
-            }
+/*
+ * Bin the blocks of a channel while a reader thread reads the next ones
+ * into the other buffers of the ring.  Returns false if the reader could
+ * not be started, and otherwise sets *status.
+ */
+static int
+extract_channel_prefetch (FitsCutImage *Image, ExtractChannel *ch, float *arrayptr, int *status)
+{
+    ExtractPrefetch pf;
+    ExtractBlock *blk;
+    pthread_t reader;
+    long m;
+
+    pf.Image = Image;
+    pf.ch = ch;
+    pf.nblocks = (ch->y1 - ch->y0) / ch->bufrows + 1;
+    pf.nread = 0;
+    pf.nbinned = 0;
+    pf.stop = 0;
+    pthread_mutex_init (&pf.lock, NULL);
+    pthread_cond_init (&pf.cond, NULL);
+    if (pthread_create (&reader, NULL, extract_prefetch_reader, &pf) != 0) {
+        pthread_mutex_destroy (&pf.lock);
+        pthread_cond_destroy (&pf.cond);
+        return 0;
+    }
 
-            fitscut_message (1, "\tExtracting %s[%ld:%ld,%ld:%ld]...\n",
-                     Image->input_filename[k],
-                     fpixel[0], lpixel[0], fpixel[1], lpixel[1]);
+    *status = 0;
+    for (m = 0; m < pf.nblocks && ! *status; m++) {
+        pthread_mutex_lock (&pf.lock);
+        while (pf.nread <= m)
+            pthread_cond_wait (&pf.cond, &pf.lock);
+        pthread_mutex_unlock (&pf.lock);
+
+        blk = &ch->ring[m % ch->nring];
+        *status = blk->status;
+        if (! *status)
+            *status = extract_block_finish (Image, ch, blk, blk->buffer,
+                &arrayptr[extract_block_offset (ch, blk->j0)]);
+
+        pthread_mutex_lock (&pf.lock);
+        pf.nbinned = m + 1;
+        if (*status)
+            pf.stop = 1;
+        pthread_cond_broadcast (&pf.cond);
+        pthread_mutex_unlock (&pf.lock);
+    }
 
-            /* get asinh parameters from header if requested */
-            fits_get_bsoften (Image, k, &useBsoften, &bsoften, &boffset);
+    pthread_join (reader, NULL);
+    pthread_mutex_destroy (&pf.lock);
+    pthread_cond_destroy (&pf.cond);
+    return 1;
+}
 
-            /*
-             * read block of pixels into buffer
-             * apply DQ flagging for the block
-             * rebin using zoom factor and insert into zoomed array locations
-             */
+#endif /* HAVE_PTHREAD_H */
 
-            for (j0=y0; j0 <= y1; j0 += bufrows) {
-                j1 = j0 + bufrows - 1;
-                fpixel[1] = MAX (1,j0);
-                lpixel[1] = MIN (y1,j1);
-                rows_read = lpixel[1] - fpixel[1] + 1;
-
-                if (rows_read <= 0) {
-
-                    /* off edge, mark data as missing */
-                    for (j = 0; j < bufrows; j++) {
-                        for (i = 0; i < ncols; i++) bufferptr[i+j*ncols] = NAN;
-                    }
-
-                } else {
-
-                    /* put data at the end of the buffer to make shifting easier */
-                    pstart = ncols*bufrows - cols_read*rows_read;
-
-                    if (fitscut_read_subset (fptr, TFLOAT, fpixel, lpixel, inc,
-                                  &nullval, &bufferptr[pstart], &anynull, &status))
-                        printerror (status);
-
-                    /* apply data quality flagging to zero bad pixels */
-
-                    nbad += apply_qual (dqptr, nplanes, Image->badmin[k], Image->badmax[k], Image->bad_data_value[k],
-                        fpixel, lpixel, inc,
-                        &bufferptr[pstart], anynull, Image->qext_bad_value[k], &status);
-                    if (status)
-                        printerror (status);
-
-                    if (useBsoften) {
-                        /* invert asinh scaling */
-                        invert_bsoften(bsoften, boffset, fpixel, lpixel, inc,
-                            &bufferptr[pstart], Image->bad_data_value[k]);
-                    }
-
-                    if (pstart != 0) {
-                        /* move the subset read from the fits file so it is embedded in
-                         * an array of size ncols x bufrows
-                         * This is done as an in-place move from the end of the buffer
-                         * toward the beginning.
-                         */
-
-                        xoffset = fpixel[0] - x0;
-                        yoffset = fpixel[1] - j0;
-                        pstart = pstart - xoffset - cols_read*yoffset;
-
-                        /* leading empty rows */
-                        for (j = 0; j < yoffset; j++) {
-                            for (i = 0; i < ncols; i++) bufferptr[i + j*ncols] = NAN;
-                        }
-                        for (j = yoffset; j < yoffset+rows_read; j++) {
-                            /* leading empty columns */
-                            for (i = 0; i < xoffset; i++) {
-                                bufferptr[i+j*ncols] = NAN;
-                            }
-                            /* copy block of pixels */
-                            for (i = xoffset; i < xoffset+cols_read; i++) {
-                                bufferptr[i+j*ncols] = bufferptr[pstart + i + cols_read*j];
-                            }
-                            /* trailing empty columns */
-                            for (i = xoffset+cols_read; i < ncols; i++) {
-                                bufferptr[i+j*ncols] = NAN;
-                            }
-                        }
-                        /* trailing empty rows */
-                        for (j = yoffset+rows_read; j < bufrows; j++) {
-                            for (i = 0; i < ncols; i++) bufferptr[i + j*ncols] = NAN;
-                        }
-                    }
-                }
+/* channels of extract_fits read by the worker threads */
+typedef struct {
+    FitsCutImage *Image;
+    ExtractChannel *channel;
+    int status[MAX_CHANNELS];
+} ExtractWork;
 
-                if (doshrink) {
-                    reduce_array(bufferptr, &arrayptr[(j0-y0)/pixfac*zoomcols], ncols, bufrows, pixfac, Image->bad_data_value[k]);
-                } else if (pixfac > 1) {
-                    enlarge_array(bufferptr, &arrayptr[(j0-y0)*pixfac*zoomcols], ncols, bufrows, pixfac);
-                }
-            }
+/*
+ * Read all the blocks of one channel into its output array
+ */
+static void
+extract_channel_read (ExtractWork *work, int k)
+{
+    ExtractChannel *ch = &work->channel[k];
+    float *arrayptr = work->Image->data[k];
+    long j0;
+
+#ifdef HAVE_PTHREAD_H
+    if (ch->nring > 1 &&
+        extract_channel_prefetch (work->Image, ch, arrayptr, &work->status[k]))
+        return;
+#endif
+
+    /*
+     * read block of pixels into buffer
+     * apply DQ flagging for the block
+     * rebin using zoom factor and insert into zoomed array locations
+     */
+    for (j0 = ch->y0; j0 <= ch->y1; j0 += ch->bufrows) {
+        work->status[k] = extract_channel_block (work->Image, ch, j0,
+            &arrayptr[extract_block_offset (ch, j0)]);
+        if (work->status[k])
+            return;
+    }
+}
+
+static void
+extract_channel_task (void *arg, int k)
+{
+    ExtractWork *work = (ExtractWork *) arg;
+    ExtractChannel *ch = &work->channel[k];
+    FitsCutImage *Image = work->Image;
+
+    work->status[k] = 0;
+    if (Image->data[k] == NULL || ! ch->good)
+        return;
+
+    if (ch->zoom > 0) {
+        ch->area = area_resampler_new (Image->data[k], ch->ncols, ch->nrows,
+            ch->zoomcols, ch->zoomrows, ch->zoom, Image->bad_data_value[k]);
+        if (ch->area == NULL) {
+            work->status[k] = MEMORY_ALLOCATION;
+            return;
         }
+    }
+    extract_channel_read (work, k);
+    area_resampler_finish (ch->area);
+    ch->area = NULL;
+}
 
-        Image->data[k] = arrayptr;
-        Image->ncols[k] = zoomcols;
-        Image->nrows[k] = zoomrows;
-        if (doshrink) {
-            Image->output_zoom[k] = 1.0/pixfac;
-        } else if (pixfac > 1) {
-            Image->output_zoom[k] = pixfac;
-        } else {
-            Image->output_zoom[k] = 1.0;
+/*
+ * True if channels k and l read the same file.  Every open of a file,
+ * at whatever HDU, has its own fitsfile but they share the FITSfile.
+ */
+static int
+extract_channels_share_file (ExtractChannel *chk, ExtractChannel *chl)
+{
+    void *filek[2], *filel[2];
+    int i, j;
+
+    filek[0] = chk->fptr->Fptr;
+    filek[1] = (chk->dqptr != NULL) ? chk->dqptr->Fptr : NULL;
+    filel[0] = chl->fptr->Fptr;
+    filel[1] = (chl->dqptr != NULL) ? chl->dqptr->Fptr : NULL;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (filek[i] != NULL && filek[i] == filel[j])
+                return 1;
         }
+    }
+    return 0;
+}
+
+/*
+ * The channels can be read at the same time if cfitsio is thread safe
+ * and no two channels share a file
+ */
+static int
+extract_channels_parallel (FitsCutImage *Image, ExtractChannel *channel)
+{
+    int k, l, nread = 0;
 
-        if (pixfac > 1) {
-            free(bufferptr);
+    if (threads_get_count () < 2 || ! fits_is_reentrant ())
+        return 0;
+    for (k = 0; k < Image->channels; k++) {
+        if (Image->data[k] == NULL || ! channel[k].good)
+            continue;
+        nread++;
+        for (l = 0; l < k; l++) {
+            if (Image->data[l] != NULL && channel[l].good &&
+                extract_channels_share_file (&channel[k], &channel[l]))
+                return 0;
         }
+    }
+    return nread > 1;
+}
 
-        if (nbad) fitscut_message (2, "\tZeroed %d bad pixels\n", nbad);
+/*
+ * Release the read buffer and quality extension of a channel
+ */
+static void
+extract_channel_close (ExtractChannel *ch)
+{
+    int status = 0;
+    int i;
 
-        if (fits_close_file (fptr, &status)) 
+    for (i = 0; i < EXTRACT_RING; i++) {
+        free(ch->ring[i].buffer);
+        free(ch->ring[i].qarray);
+        free(ch->ring[i].qbad);
+        ch->ring[i].buffer = NULL;
+        ch->ring[i].qarray = NULL;
+        ch->ring[i].qbad = NULL;
+    }
+
+    if (ch->nbad) fitscut_message (2, "\tZeroed %d bad pixels\n", ch->nbad);
+
+    if (ch->dqptr != NULL) {
+       tile_cache_forget (ch->dqptr);
+       mmap_forget (ch->dqptr);
+       if (fits_close_file (ch->dqptr, &status)) 
             printerror (status);
+       ch->dqptr = NULL;
+    }
+}
 
-        if (dqptr != NULL) {
-           if (fits_close_file (dqptr, &status)) 
-                printerror (status);
-        }
+/* error if the zoomed channel does not match the reference size */
+static void
+check_channel_size (FitsCutImage *Image, int k)
+{
+    if (Image->nrows[k] != Image->nrowsref || Image->ncols[k] != Image->ncolsref) {
+        fitscut_message(0, "Error: color band %d is not the same size as reference band\n", k);
+        fitscut_message(0, "Band ref size %d %d\nBand %d   size %d %d\n",
+                Image->nrowsref, Image->ncolsref, k, Image->nrows[k], Image->ncols[k]);
+        do_exit (1);
+    }
+}
+
+void
+extract_fits (FitsCutImage *Image)
+{
+    ExtractChannel channel[MAX_CHANNELS];
+    ExtractWork work;
+    int k, ngoodimages = 0;
+
+    struct WorldCoor *save_wcs;
+
+    extract_reference (Image, &save_wcs);
+
+    /*
+     * headers, WCS and quality extensions are set up one channel at a
+     * time, since they share the input cache and libwcs state
+     */
+    for (k = 0; k < Image->channels; k++) {
+
+        fitscut_message (1, "\tExamining FITS channel %d...\n", k);
+    
+        /* reset data pointer */
+        Image->data[k] = NULL;
+
+        if (Image->input_filename[k] == NULL)
+            continue;
+
+        if (extract_channel_open (Image, k, &channel[k], EXTRACT_RING))
+            ngoodimages += 1;
+
+        /* create array for output image */
+
+        fitscut_message (1, "\tAllocating space for %d x %d output array\n",
+                 channel[k].zoomcols, channel[k].zoomrows);
+        Image->data[k] = cutout_alloc (channel[k].zoomcols, channel[k].zoomrows, NAN);
+    }
+
+    /* then the pixels of all the channels are read, one thread per channel */
+    work.Image = Image;
+    work.channel = channel;
+    if (extract_channels_parallel (Image, channel)) {
+        fitscut_message (1, "\tReading channels in parallel...\n");
+        threads_parallel_for (Image->channels, extract_channel_task, &work);
+    } else {
+        for (k = 0; k < Image->channels; k++)
+            extract_channel_task (&work, k);
+    }
+
+    /* close every channel's quality file before reporting a failed read */
+    for (k = 0; k < Image->channels; k++) {
+        if (Image->data[k] != NULL)
+            extract_channel_close (&channel[k]);
+    }
+    for (k = 0; k < Image->channels; k++) {
+        if (Image->data[k] != NULL)
+            printerror (work.status[k]);
+    }
+
+    for (k = 0; k < Image->channels; k++) {
+
+        if (Image->data[k] == NULL)
+            continue;
 
         /*
          * exact output size resampling and size test are skipped if WCS resampling is
@@ -868,7 +1513,10 @@ extract_fits (FitsCutImage *Image)
 
             if (Image->output_size > 0) {
 
-                /* do final resize to exact output size */
+                /*
+                 * do final resize to exact output size; the channel was
+                 * resampled to it while reading, so this is a no-op
+                 */
 
                 fitscut_message (2, "Forcing output size %d\n", Image->output_size);
                 fitscut_message (2, "\tresizing channel %d\n", k);
@@ -876,12 +1524,7 @@ extract_fits (FitsCutImage *Image)
             }
 
             /* check for size consistency */
-            if (Image->nrows[k] != Image->nrowsref || Image->ncols[k] != Image->ncolsref) {
-                fitscut_message(0, "Error: color band %d is not the same size as reference band\n", k);
-                fitscut_message(0, "Band ref size %d %d\nBand %d   size %d %d\n",
-                        Image->nrowsref, Image->ncolsref, k, Image->nrows[k], Image->ncols[k]);
-                do_exit (1);
-            }
+            check_channel_size (Image, k);
         }
         /* update world coordinate systems if cutout or zoom was used */
         wcs_update_channel(Image, k);
@@ -906,6 +1549,110 @@ extract_fits (FitsCutImage *Image)
 
 }
 
+/*
+ * Set up to read the cutout a strip of rows at a time instead of into
+ * Image->data, so the output writer never holds more than one block per
+ * channel.  Only for cutouts that need no resampling after extraction
+ * (no --output-size, no WCS alignment).
+ */
+ExtractStream *
+extract_stream_open (FitsCutImage *Image)
+{
+    ExtractStream *stream;
+    ExtractChannel *ch;
+    struct WorldCoor *save_wcs;
+    int k, ngoodimages = 0;
+
+    stream = (ExtractStream *) calloc (1, sizeof (ExtractStream));
+    if (stream == NULL) {
+        fitscut_message (0, "Unable to allocate memory for output stream\n");
+        do_exit (1);
+    }
+    stream->Image = Image;
+
+    extract_reference (Image, &save_wcs);
+
+    for (k = 0; k < Image->channels; k++) {
+
+        fitscut_message (1, "\tExamining FITS channel %d...\n", k);
+
+        Image->data[k] = NULL;
+        stream->strip_block[k] = -1;
+
+        if (Image->input_filename[k] == NULL)
+            continue;
+
+        ch = &stream->channel[k];
+        if (extract_channel_open (Image, k, ch, 1))
+            ngoodimages += 1;
+        stream->present[k] = 1;
+
+        if (ch->doshrink)
+            stream->strip_rows[k] = ch->bufrows / ch->pixfac;
+        else
+            stream->strip_rows[k] = ch->bufrows * ch->pixfac;
+        fitscut_message (2, "\tAllocating space for %d x %d output strip\n",
+                 ch->zoomcols, stream->strip_rows[k]);
+        stream->strip[k] = cutout_alloc (ch->zoomcols, stream->strip_rows[k], NAN);
+
+        check_channel_size (Image, k);
+        wcs_update_channel(Image, k);
+    }
+
+    if (ngoodimages == 0) {
+        /* error if cutout is off edge for all planes */
+        fitscut_message (0, "Some image dimensions are negative for all planes\n");
+        do_exit (1);
+    }
+    return stream;
+}
+
+/*
+ * Return a row of output channel k, or NULL if the channel has no input.
+ * The pointer is good until the next call for the same channel.
+ */
+float *
+extract_stream_row (ExtractStream *stream, int k, long row)
+{
+    ExtractChannel *ch;
+    long block, j0, i, n;
+    float *strip;
+
+    if (! stream->present[k])
+        return NULL;
+
+    ch = &stream->channel[k];
+    strip = stream->strip[k];
+    block = row / stream->strip_rows[k];
+    if (block != stream->strip_block[k]) {
+        n = (long) ch->zoomcols * stream->strip_rows[k];
+        for (i = 0; i < n; i++) strip[i] = NAN;
+
+        /* blocks past the end of the image stay blank, as in extract_fits */
+        j0 = ch->y0 + block * ch->bufrows;
+        if (ch->good && j0 <= ch->y1)
+            printerror (extract_channel_block (stream->Image, ch, j0, strip));
+        stream->strip_block[k] = block;
+    }
+    return strip + (row - block * stream->strip_rows[k]) * ch->zoomcols;
+}
+
+void
+extract_stream_close (ExtractStream *stream)
+{
+    int k;
+
+    if (stream == NULL)
+        return;
+    for (k = 0; k < MAX_CHANNELS; k++) {
+        if (! stream->present[k])
+            continue;
+        extract_channel_close (&stream->channel[k]);
+        free (stream->strip[k]);
+    }
+    free (stream);
+}
+
 /*
  * Allocate memory for cutout
  */
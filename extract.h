@@ -19,6 +19,9 @@
  */
 
 void   extract_fits (FitsCutImage *);
+ExtractStream *extract_stream_open (FitsCutImage *);
+float *extract_stream_row (ExtractStream *, int k, long row);
+void   extract_stream_close (ExtractStream *);
 void   printerror (int);
 double fits_get_exposure_time (char *, int);
 void fits_get_badpix (char *, int, float *, float *, float *);
@@ -31,7 +34,7 @@ extern int get_qual_info (fitsfile **dqptr, long *nplanes, float *badmin, float
 
 extern int apply_qual (fitsfile *dqptr, long nplanes, float badmin, float badmax, float bad_data_value,
 	long fpixel[7], long lpixel[7], long inc[7],
-	float *arrayptr, int anynull, int badvalue,
+	float *arrayptr, int badvalue, int badmask,
 	int *status);
 
 extern int fitscut_read_subset(fitsfile *fptr, int datatype, long *fpixel, long *lpixel, long *inc,
@@ -104,6 +104,8 @@ extern char *alloca ();
 #include <png.h>        /* includes zlib.h and setjmp.h */
 #endif
 
+#include <setjmp.h>
+
 #include <libwcs/wcs.h>
 
 #include "tailor.h"
@@ -116,10 +118,15 @@ extern char *alloca ();
 #include "extract.h"
 #include "file_check.h"
 #include "image_scale.h"
+#include "input_cache.h"
 #include "output_graphic.h"
 #include "output_fits.h"
 #include "output_json.h"
 #include "output_range.h"
+#include "resize.h"
+#include "server.h"
+#include "threads.h"
+#include "transfer.h"
 
 #ifdef DMALLOC
 #include <dmalloc.h>
@@ -174,6 +181,15 @@ struct option longopts[] = {
     { "badvalue", required_argument, 0, 28 },
     { "nobsoften", 0, 0, 29 },
     { "reference", required_argument, 0, 30 },
+    { "batch", required_argument, 0, 31 },
+    { "server", required_argument, 0, 32 },
+    { "max-memory", required_argument, 0, 33 },
+    { "threads", required_argument, 0, 34 },
+    { "qmask", required_argument, 0, 35 },
+    { "exact-percentile", 0, 0, 36 },
+    { "scale-cache", required_argument, 0, 37 },
+    { "zscale", optional_argument, 0, 38 },
+    { "align-tolerance", required_argument, 0, 39 },
     { 0, 0, 0, 0 }
 };
 
@@ -190,6 +206,14 @@ int verbose = 0;      /* be verbose (-v) */
 int quiet = 0;        /* be very quiet (-q) */
 int exit_code = OK;   /* program exit code */
 
+static char *batch_filename = NULL;  /* --batch request list */
+static char *server_socket = NULL;   /* --server socket path */
+static int in_request = 0;           /* serving a --server request */
+static jmp_buf request_env;          /* where do_exit returns to in a request */
+#ifdef HAVE_PTHREAD_H
+static pthread_t request_thread;     /* the thread that may jump there */
+#endif
+
 
 void
 fitscut_message (int level, const char *format, ...)
@@ -211,6 +235,19 @@ do_exit (int exitcode)
 {
         static int in_exit = 0;
 
+        /* a failed server request must not take down the server */
+        if (in_request) {
+#ifdef HAVE_PTHREAD_H
+                /*
+                 * worker threads return errors as status codes; jumping
+                 * across threads is undefined, so exit if one got here
+                 */
+                if (! pthread_equal (pthread_self (), request_thread))
+                        exit (exitcode);
+#endif
+                longjmp (request_env, 1);
+        }
+
         if (in_exit)
                 exit (exitcode);
         in_exit = 1;
@@ -270,7 +307,13 @@ show_usage ()
         fputs ("      --y0=N\t\tY corner coordinate\n", stderr);
         fputs ("  -r, --rows=N\t\tnumber of rows (height)\n", stderr);
         fputs ("  -c, --columns=N\tnumber of columns (width)\n", stderr);
-        fputs ("      --all\t\textract a cutout of the same size as the input image\n\n", stderr);
+        fputs ("      --all\t\textract a cutout of the same size as the input image\n", stderr);
+        fputs ("      --batch=file\tmake one cutout for each line of file, keeping the input open\n", stderr);
+        fputs ("\t\t\tEach line is \"x y size outfile\" or \"x y columns rows outfile\"\n", stderr);
+        fputs ("\t\t\twith x,y the cutout center (sky coordinates with --wcs)\n", stderr);
+        fputs ("      --server=socket\tserve requests on a UNIX domain socket, keeping inputs open\n", stderr);
+        fputs ("\t\t\tEach request is one line of arguments (no output file);\n", stderr);
+        fputs ("\t\t\tthe cutout is written back on the connection\n\n", stderr);
 
         fputs ("      --linear-scale\toutput in linear scale [default]\n", stderr);
         fputs ("  -l, --log-scale\toutput in log scale\n", stderr);
@@ -292,6 +335,9 @@ show_usage ()
         fputs ("      --autoscale-min=percent\tlower bound percentage of histogram to include\n", stderr);
         fputs ("      --autoscale-max=percent\tupper bound percentage of histogram to include\n", stderr);
         fputs ("      --full-scale\tuse samples from entire image for autoscale\n", stderr);
+        fputs ("      --exact-percentile\tautoscale from exact percentiles instead of a histogram\n", stderr);
+        fputs ("      --scale-cache=dir\tkeep --full-scale statistics in dir for later cutouts\n", stderr);
+        fputs ("      --zscale[=contrast]\tscale to IRAF zscale limits (default contrast 0.25)\n", stderr);
         fputs ("      --min=value\timage value to use for scale minimum\n", stderr);
         fputs ("      --max=value\timage value to use for scale maximum\n\n", stderr);
         fputs ("\t\t\tThe value for --min or --max may be either one value to\n", stderr);
@@ -302,25 +348,50 @@ show_usage ()
         fputs ("      --green=file\tfilename to be used in green channel of color image\n", stderr);
         fputs ("      --blue=file\tfilename to be used in blue channel of color image\n", stderr);
         fputs ("      --qext=number\textension for data quality array\n", stderr);
-        fputs ("\t\t\tqext may be an integer or a comma-separated list of integers\n\n", stderr);
+        fputs ("\t\t\tqext may be an integer or a comma-separated list of integers\n", stderr);
+        fputs ("      --qmask=bits\tquality flag bits that mark bad pixels, e.g. 0x2ff\n", stderr);
+        fputs ("\t\t\t(default: pixels with quality value 0 are bad)\n\n", stderr);
         fputs ("      --badpix\t\tignore pixels as specified in header values BADPIX/GOODMIN/GOODMAX\n", stderr);
         fputs ("      --badvalue=value\tignore pixels with this value (default 0.0)\n", stderr);
         fputs ("      --nobsoften\tdo NOT apply inverse asinh scaling using BSOFTEN/BOFFSET keywords (default=apply)\n", stderr);
 
         fputs ("      --zoom=factor\tzoom input image by positive multiplicative factor\n\n", stderr);
         fputs ("      --output-size=value\tforce image output size to given value\n\n", stderr);
+        fputs ("      --max-memory=MB\tmemory to use for input read buffers (default 256)\n", stderr);
+        fputs ("      --threads=N\tnumber of threads to use (default: number of processors)\n", stderr);
         fputs ("      --add_blurb=\tfilename containing text to be added as HISTORY cards to the output header\n", stderr);
 
         fputs ("      --wcs\t\tconvert input X,Y from degrees to pixels using WCS information in header\n", stderr);
         fputs ("      --align\t\tuse WCS information in header to align images\n", stderr);
         fputs ("      --reference=file\tfilename to use for WCS reference when aligning images\n", stderr);
-        fputs ("\t\t\tMay be red, green or blue to select one of the input files (default=red)\n\n", stderr);
+        fputs ("\t\t\tMay be red, green or blue to select one of the input files (default=red)\n", stderr);
+        fputs ("      --align-tolerance=pixels\tpositional error allowed when aligning (default 0.01, 0 for exact)\n\n", stderr);
         fputs ("      --compass\t\tadd a WCS compass to the image\n", stderr);
         fputs ("      --marker\t\tadd a crosshair marker around the image center\n", stderr);
   
         show_supported_palettes ();
 }
 
+/*
+ * Log, sqrt and histeq stretches can be left to the PNG/JPEG writer, which
+ * maps raw pixels straight to bytes, unless something else needs the
+ * stretched pixels: a histogram autoscale of them, or the compass and
+ * marker drawn into them.
+ */
+static int
+can_defer_transfer (FitsCutImage *Image)
+{
+        if (Image->output_type != OUTPUT_PNG && Image->output_type != OUTPUT_JPG)
+                return FALSE;
+        if (Image->output_scale != SCALE_LOG && Image->output_scale != SCALE_SQRT &&
+            Image->output_scale != SCALE_HISTEQ)
+                return FALSE;
+        if (Image->output_compass || Image->output_marker)
+                return FALSE;
+        return Image->output_scale_mode != SCALE_MODE_AUTO &&
+               Image->output_scale_mode != SCALE_MODE_ZSCALE;
+}
+
 static void
 scale_image (FitsCutImage *Image)
 {
@@ -330,6 +401,8 @@ scale_image (FitsCutImage *Image)
         if (Image->output_scale_mode != SCALE_MODE_USER)
             scan_min_max (Image);
 
+        Image->transfer_deferred = can_defer_transfer (Image);
+
         if (Image->output_type != OUTPUT_RANGE) {
             /* pre-scale pixel values unless simple range output is requested */
             switch (Image->output_scale) {
@@ -360,6 +433,7 @@ scale_image (FitsCutImage *Image)
         switch (Image->output_scale_mode) {
         case SCALE_MODE_AUTO:
         case SCALE_MODE_FULL:
+        case SCALE_MODE_ZSCALE:
                 autoscale_image (Image);
                 break;
         default:
@@ -454,30 +528,180 @@ release_data (FitsCutImage *Image)
 {
         int k;
 
+        if (Image->stream != NULL) {
+            extract_stream_close (Image->stream);
+            Image->stream = NULL;
+        }
         for (k = 0; k < Image->channels; k++) {
             if (Image->data[k] != NULL) {
                 free (Image->data[k]);
-                if (Image->header[k] != NULL)
-                        free (Image->header[k]);
+                Image->data[k] = NULL;
             }
+            transfer_free (Image->transfer[k]);
+            Image->transfer[k] = NULL;
+            /* header belongs to the input cache */
+            Image->header[k] = NULL;
+        }
+}
+
+/*
+ * Linear PNG/JPEG output can be written strip by strip as the cutout is
+ * read, without holding the whole cutout, when the scaling is known
+ * before any cutout pixel is seen and nothing else needs the full array.
+ */
+static int
+can_stream (FitsCutImage *Image)
+{
+        if (Image->output_type != OUTPUT_PNG && Image->output_type != OUTPUT_JPG)
+                return FALSE;
+        if (Image->output_scale != SCALE_LINEAR)
+                return FALSE;
+        if (Image->output_alignment != ALIGN_NONE || Image->output_size > 0)
+                return FALSE;
+        if (Image->output_compass || Image->output_marker)
+                return FALSE;
+
+        switch (Image->output_scale_mode) {
+        case SCALE_MODE_USER:
+                return Image->user_min_set && Image->user_max_set;
+        case SCALE_MODE_FULL:
+                /* sampled from the whole image, not the cutout */
+                return TRUE;
+        default:
+                return FALSE;
         }
 }
 
 static void
-treat_input (FitsCutImage *Image)
+treat_stream (FitsCutImage *Image)
 {
+        int k;
 
-        extract_fits (Image);
-        align_image (Image);
-        scale_image (Image);
-        if (Image->output_type != OUTPUT_RANGE) {
-            if (Image->output_compass)
-                    render_compass (Image);
-            if (Image->output_marker)
-                    draw_center_marker (Image);
+        Image->stream = extract_stream_open (Image);
+        if (Image->output_scale_mode == SCALE_MODE_FULL && ! Image->autoscale_performed) {
+                for (k = 0; k < Image->channels; k++) {
+                        if (Image->input_filename[k] != NULL)
+                                autoscale_full_channel (Image, k);
+                }
+                Image->autoscale_performed = TRUE;
         }
         write_image (Image);
+}
+
+static void
+treat_input (FitsCutImage *Image)
+{
+
+        threads_set_count (Image->threads);
+        input_cache_begin ();
+        if (can_stream (Image)) {
+                fitscut_message (1, "Streaming cutout to output...\n");
+                treat_stream (Image);
+        } else {
+                extract_fits (Image);
+                align_image (Image);
+                scale_image (Image);
+                if (Image->output_type != OUTPUT_RANGE) {
+                    if (Image->output_compass)
+                            render_compass (Image);
+                    if (Image->output_marker)
+                            draw_center_marker (Image);
+                }
+                write_image (Image);
+        }
         release_data (Image);
+        area_resize_release ();
+        input_cache_end ();
+}
+
+/*
+ * Make one cutout for each line of the batch file.  Lines have the form
+ *
+ *   x y size outfile
+ *   x y columns rows outfile
+ *
+ * Blank lines and lines starting with '#' are skipped.  All other options
+ * are taken from the command line.  The input files, headers and WCS are
+ * kept open across all the cutouts.
+ */
+static void
+treat_batch (FitsCutImage *Image, char *batch_filename)
+{
+        FILE *batchfile;
+        FitsCutImage Request;
+        char line[MAX_PATH_LEN+256];
+        char ofname[MAX_PATH_LEN];
+        char *field[5];
+        char *sptr;
+        int nfields, lineno = 0;
+        long ncols, nrows;
+        double x, y;
+        int k;
+
+        if ((batchfile = fopen (batch_filename, "r")) == NULL) {
+                fitscut_message (0, "%s: cannot open batch file %s\n",
+                                 progname, batch_filename);
+                do_exit (1);
+        }
+
+        to_stdout = 0;
+        input_cache_keep (1);
+
+        while (fgets (line, sizeof (line), batchfile) != NULL) {
+                lineno++;
+                nfields = 0;
+                for (sptr = strtok (line, " \t\r\n"); sptr != NULL && nfields < 5;
+                     sptr = strtok (NULL, " \t\r\n"))
+                        field[nfields++] = sptr;
+                if (nfields == 0 || field[0][0] == '#')
+                        continue;
+
+                if (nfields == 4) {
+                        ncols = nrows = strtol (field[2], (char **)NULL, 0);
+                } else if (nfields == 5) {
+                        ncols = strtol (field[2], (char **)NULL, 0);
+                        nrows = strtol (field[3], (char **)NULL, 0);
+                } else {
+                        fitscut_message (0, "%s: %s line %d: expected x y size outfile\n",
+                                         progname, batch_filename, lineno);
+                        exit_code = WARNING;
+                        continue;
+                }
+                x = strtod (field[0], (char **)NULL);
+                y = strtod (field[1], (char **)NULL);
+                if (ncols <= 0 || nrows <= 0) {
+                        fitscut_message (0, "%s: %s line %d: cutout size must be > 0\n",
+                                         progname, batch_filename, lineno);
+                        exit_code = WARNING;
+                        continue;
+                }
+
+                make_output_name (ofname, field[nfields-1]);
+                if (check_output_file (ofname, Image->input_filename[0]) != OK)
+                        continue;
+
+                /* every cutout starts from the command line settings */
+                Request = *Image;
+                for (k = 0; k < MAX_CHANNELS; k++) {
+                        Request.input_x[k] = x;
+                        Request.input_y[k] = y;
+                        /* x y is the centre even if --x0/--y0 was given */
+                        Request.input_x_corner[k] = 0;
+                        Request.input_y_corner[k] = 0;
+                        Request.ncols[k] = ncols;
+                        Request.nrows[k] = nrows;
+                }
+                Request.ncolsref = ncols;
+                Request.nrowsref = nrows;
+                Request.output_filename = ofname;
+
+                fitscut_message (1, "Batch cutout %d: %s\n", lineno, ofname);
+                treat_input (&Request);
+        }
+        fclose (batchfile);
+
+        input_cache_keep (0);
+        input_cache_flush ();
 }
 
 static int
@@ -487,6 +711,7 @@ check_input (FitsCutImage *Image)
         int k;
         int fcount = 0;
         int findex[3];
+        char *ref;
 
         for (k = 0; k < Image->channels; k++) {
                 if (Image->input_filename[k] != NULL) {
@@ -509,27 +734,30 @@ check_input (FitsCutImage *Image)
                 }
         }
 
-        if (Image->reference_filename == NULL) {
-            Image->reference_filename = "red";
-        }
-        if (strequ(Image->reference_filename, "red")) {
-            Image->reference_filename = Image->input_filename[findex[0]];
+        /* the reference is always a copy of its own, for release_names */
+        ref = NULL;
+        if (Image->reference_filename == NULL || strequ(Image->reference_filename, "red")) {
+            ref = Image->input_filename[findex[0]];
         } else if (strequ(Image->reference_filename, "green")) {
             /* treat green as 2nd (if at least 2 files) */
             if (fcount > 1) {
-                Image->reference_filename = Image->input_filename[findex[1]];
+                ref = Image->input_filename[findex[1]];
             } else {
-                Image->reference_filename = Image->input_filename[findex[0]];
+                ref = Image->input_filename[findex[0]];
             }
         } else if (strequ(Image->reference_filename, "blue")) {
             /* treat blue as last */
-            Image->reference_filename = Image->input_filename[findex[fcount-1]];
+            ref = Image->input_filename[findex[fcount-1]];
         } else {
             fitscut_message (1, "Checking reference file: %s\n",
                              Image->reference_filename);
             if ((retval = check_input_file (Image->reference_filename)) != OK)
                     return ERROR;
         }
+        if (ref != NULL) {
+            free (Image->reference_filename);
+            Image->reference_filename = strdup (ref);
+        }
 
         return OK;
 }
@@ -562,13 +790,19 @@ fitscut_initialize (FitsCutImage *Image)
         Image->jpeg_quality = 75;
         Image->useBadpix = 0;
         Image->useBsoften = 1;
+        Image->max_memory = MAX_MEMORY_DEFAULT;
+        Image->threads = threads_default_count ();
+        Image->scale_cache_dir = NULL;
         Image->channels = 0;
         Image->user_min_set = FALSE;
         Image->user_max_set = FALSE;
         Image->user_scale_factor_set = FALSE;
         Image->qext_set = FALSE;
+        Image->qext_mask = 0;
         Image->input_filename[0] = Image->input_filename[1] = Image->input_filename[2] = NULL;
         Image->input_blurbfile = NULL;
+        Image->autoscale_exact = FALSE;
+        Image->zscale_contrast = ZSCALE_CONTRAST;
         Image->autoscale_performed = FALSE;
 
         for (k = 0; k < MAX_CHANNELS; k++) {
@@ -589,25 +823,29 @@ fitscut_initialize (FitsCutImage *Image)
                 Image->input_y_corner[k] = 0;
                 Image->wcs[k] = NULL;
                 Image->data[k] = NULL;
+                Image->transfer[k] = NULL;
                 Image->input_x[k] = Image->input_y[k] = Image->ncols[k] = Image->nrows[k] = -1;
         }
         Image->nrowsref = Image->ncolsref = -1;
         Image->output_alignment = ALIGN_NONE;
         Image->wcsref = NULL;
-        Image->reference_filename = "red";
+        Image->align_tolerance = ALIGN_TOLERANCE;
+        Image->stream = NULL;
+        Image->transfer_deferred = FALSE;
+        Image->reference_filename = NULL;       /* red */
 }
 
-int 
-main (int argc, char *argv[])
+/*
+ * Parse the command line options into Image
+ */
+static void
+parse_options (int argc, char *argv[], FitsCutImage *Image)
 {
         int optc;
         int h = 0;
         int V = 0;
         int lose = 0;
-        int proglen;        /* length of progname */
-        char ofname[MAX_PATH_LEN];
-        int arg_count, k;
-        FitsCutImage Image;
+        int k;
         char *cmap_name = NULL;
         char *tmpstr = NULL;
         char *sptr = NULL;
@@ -618,27 +856,6 @@ main (int argc, char *argv[])
         int i;
         float bad_data_value;
 
-#ifdef DEBUGGING
-        mtrace ();
-#endif
-
-        fitscut_initialize (&Image);
-
-        /* set up globals */
-  
-        EXPAND (argc, argv); /* wild card expansion if necessary */
-
-        progname = (char *) basename (argv[0]);
-        proglen = strlen (progname);
-  
-        /* Suppress .exe for MSDOS, OS/2 and VMS: */
-        if (proglen > 4 && strequ (progname + proglen - 4, ".exe"))
-                progname[proglen-4] = '\0';
-
-        foreground = signal (SIGINT, SIG_IGN) != SIG_IGN;
-        if (foreground)
-                (void) signal (SIGINT, (sig_type)abort_fitscut);
-
         while ((optc = getopt_long (argc, argv, "hviVfpjlsex:y:r:c:a:t:",
                                     longopts, (int *) 0)) != EOF)
                 {
@@ -657,70 +874,83 @@ main (int argc, char *argv[])
                                         force = 1;
                                         break;
                                 case 'i':
-                                        Image.output_invert = 1;
+                                        Image->output_invert = 1;
                                         break;
                                 case 'l':
-                                        Image.output_scale = SCALE_LOG;
+                                        Image->output_scale = SCALE_LOG;
                                         break;
                                 case 'e':
-                                        Image.output_scale = SCALE_HISTEQ;
+                                        Image->output_scale = SCALE_HISTEQ;
                                         break;
                                 case 's':
-                                        Image.output_scale = SCALE_SQRT;
+                                        Image->output_scale = SCALE_SQRT;
                                         break;
                                 case 'p':
-                                        Image.output_type = OUTPUT_PNG;
+                                        Image->output_type = OUTPUT_PNG;
                                         break;
                                 case 'j':
-                                        Image.output_type = OUTPUT_JPG;
+                                        Image->output_type = OUTPUT_JPG;
                                         break;
                                 case 25:
-                                        Image.output_type = OUTPUT_JSON;
+                                        Image->output_type = OUTPUT_JSON;
                                         break;
                                 case 27:
-                                        Image.output_type = OUTPUT_RANGE;
+                                        Image->output_type = OUTPUT_RANGE;
                                         break;
                                 case 21:
-                                        Image.jpeg_quality = strtod (optarg, (char **)NULL);
+                                        Image->jpeg_quality = strtod (optarg, (char **)NULL);
                                         break;
                                 case 24:
-                                        Image.useBadpix = 1;
+                                        Image->useBadpix = 1;
                                         break;
                                 case 28: /* badvalue */
                                         /* using strtod because strtof is not always declared */
                                         bad_data_value = (float) strtod (optarg, (char **)NULL);
                                         for (k = 0; k < MAX_CHANNELS; k++) {
-                                                Image.bad_data_value[k] = bad_data_value;
-                                                Image.badmin[k] = bad_data_value;
-                                                Image.badmax[k] = bad_data_value;
+                                                Image->bad_data_value[k] = bad_data_value;
+                                                Image->badmin[k] = bad_data_value;
+                                                Image->badmax[k] = bad_data_value;
                                         }
                                         break;
                                 case 29:
-                                        Image.useBsoften = 0;
+                                        Image->useBsoften = 0;
+                                        break;
+                                case 33: /* max-memory */
+                                        Image->max_memory = (long) (strtod (optarg, (char **)NULL) * 1024 * 1024);
+                                        if (Image->max_memory <= 0)
+                                                Image->max_memory = MAX_MEMORY_DEFAULT;
+                                        break;
+                                case 34: /* threads */
+                                        Image->threads = strtol (optarg, (char **)NULL, 0);
+                                        if (Image->threads < 1)
+                                                Image->threads = 1;
+                                        break;
+                                case 35: /* qmask */
+                                        Image->qext_mask = strtoul (optarg, (char **)NULL, 0);
                                         break;
                                 case 'x':
-                                        Image.input_x[0] = strtod (optarg, (char **)NULL);
+                                        Image->input_x[0] = strtod (optarg, (char **)NULL);
                                         for (i = 1; i < MAX_CHANNELS; i++)
-                                                Image.input_x[i] = Image.input_x[0];
+                                                Image->input_x[i] = Image->input_x[0];
                                         for (i = 0; i < MAX_CHANNELS; i++)
-                                            Image.input_x_corner[i] = 0;
+                                            Image->input_x_corner[i] = 0;
                                         break;
                                 case 'y':
-                                        Image.input_y[0] = strtod (optarg, (char **)NULL);
+                                        Image->input_y[0] = strtod (optarg, (char **)NULL);
                                         for (i = 1; i < MAX_CHANNELS; i++)
-                                                Image.input_y[i] = Image.input_y[0];
+                                                Image->input_y[i] = Image->input_y[0];
                                         for (i = 0; i < MAX_CHANNELS; i++)
-                                            Image.input_y_corner[i] = 0;
+                                            Image->input_y_corner[i] = 0;
                                         break;
                                 case 'r':
-                                        Image.nrowsref = strtol (optarg, (char **)NULL, 0);
+                                        Image->nrowsref = strtol (optarg, (char **)NULL, 0);
                                         for (i = 0; i < MAX_CHANNELS; i++)
-                                                Image.nrows[i] = Image.nrowsref;
+                                                Image->nrows[i] = Image->nrowsref;
                                         break;
                                 case 'c':
-                                        Image.ncolsref = strtol (optarg, (char **)NULL, 0);
+                                        Image->ncolsref = strtol (optarg, (char **)NULL, 0);
                                         for (i = 0; i < MAX_CHANNELS; i++)
-                                                Image.ncols[i] = Image.ncolsref;
+                                                Image->ncols[i] = Image->ncolsref;
                                         break;
                                 case 't': /* palette */
                                         cmap_name = strdup (optarg);
@@ -731,26 +961,46 @@ main (int argc, char *argv[])
                                                 tmpstr = strdup (optarg);
                                                 sptr = strtok (tmpstr, ",");
                                                 if (sptr != NULL) {
-                                                        Image.autoscale_percent_low[0] = strtod (sptr, (char **)NULL);
+                                                        Image->autoscale_percent_low[0] = strtod (sptr, (char **)NULL);
                                                         sptr = strtok (NULL, ",");
                                                         if (sptr != NULL)
-                                                                Image.autoscale_percent_high[0] = strtod (sptr, (char **)NULL);
+                                                                Image->autoscale_percent_high[0] = strtod (sptr, (char **)NULL);
                                                 }
                                                 free (tmpstr);
                                         }
                                         else {
-                                                Image.autoscale_percent_high[0] = strtod (optarg, (char **)NULL);
-                                                Image.autoscale_percent_low[0] = 100.0 - Image.autoscale_percent_high[0];
+                                                Image->autoscale_percent_high[0] = strtod (optarg, (char **)NULL);
+                                                Image->autoscale_percent_low[0] = 100.0 - Image->autoscale_percent_high[0];
                                         }
 
-                                        if ((Image.autoscale_percent_high[0] < 100) &&
-                                            (Image.autoscale_percent_high[0] > 0)) {
-                                                if (Image.output_scale_mode != SCALE_MODE_FULL)
-                                                    Image.output_scale_mode = SCALE_MODE_AUTO;
+                                        if ((Image->autoscale_percent_high[0] < 100) &&
+                                            (Image->autoscale_percent_high[0] > 0)) {
+                                                if (Image->output_scale_mode != SCALE_MODE_FULL)
+                                                    Image->output_scale_mode = SCALE_MODE_AUTO;
                                         }
                                         break;
                                 case 19:
-                                        Image.output_scale_mode = SCALE_MODE_FULL;
+                                        Image->output_scale_mode = SCALE_MODE_FULL;
+                                        break;
+                                case 36: /* exact-percentile */
+                                        Image->autoscale_exact = TRUE;
+                                        break;
+                                case 37: /* scale-cache */
+                                        if (in_request) {
+                                                fitscut_message (0, "%s: --scale-cache is not allowed in a request\n",
+                                                                 progname);
+                                                do_exit (1);
+                                        }
+                                        free (Image->scale_cache_dir);
+                                        Image->scale_cache_dir = strdup (optarg);
+                                        break;
+                                case 38: /* zscale */
+                                        Image->output_scale_mode = SCALE_MODE_ZSCALE;
+                                        if (optarg != NULL)
+                                                Image->zscale_contrast = strtod (optarg, (char **)NULL);
+                                        break;
+                                case 39: /* align-tolerance */
+                                        Image->align_tolerance = strtod (optarg, (char **)NULL);
                                         break;
                                 case 1: /* min */
                                         if (strchr (optarg, ',') != NULL) {
@@ -758,14 +1008,14 @@ main (int argc, char *argv[])
                                                 tmpstr = strdup (optarg);
                                                 sptr = strtok (tmpstr, ",");
                                                 if (sptr != NULL) {
-                                                        Image.user_min[0] = strtod (sptr, (char **)NULL);
+                                                        Image->user_min[0] = strtod (sptr, (char **)NULL);
                                                         sptr = strtok (NULL, ",");
                                                         if (sptr != NULL) {
-                                                                Image.user_min[1] = strtod (sptr, (char **)NULL);
+                                                                Image->user_min[1] = strtod (sptr, (char **)NULL);
                                                                 user_min_count = 2;
                                                                 sptr = strtok (NULL, ",");
                                                                 if (sptr != NULL) {
-                                                                        Image.user_min[2] = strtod (sptr, (char **)NULL);
+                                                                        Image->user_min[2] = strtod (sptr, (char **)NULL);
                                                                         user_min_count = 3;
                                                                 }
                                                         }
@@ -773,9 +1023,9 @@ main (int argc, char *argv[])
                                                 free (tmpstr);
                                         }
                                         else {
-                                                Image.user_min[0] = strtod (optarg, (char **)NULL);
+                                                Image->user_min[0] = strtod (optarg, (char **)NULL);
                                         }
-                                        Image.user_min_set = TRUE;
+                                        Image->user_min_set = TRUE;
                                         break;
                                 case 2: /* max */
                                         /* we have a value for each channel */
@@ -783,14 +1033,14 @@ main (int argc, char *argv[])
                                                 tmpstr = strdup (optarg);
                                                 sptr = strtok (tmpstr, ",");
                                                 if (sptr != NULL) {
-                                                        Image.user_max[0] = strtod (sptr, (char **)NULL);
+                                                        Image->user_max[0] = strtod (sptr, (char **)NULL);
                                                         sptr = strtok (NULL, ",");
                                                         if (sptr != NULL) {
-                                                                Image.user_max[1] = strtod (sptr, (char **)NULL);
+                                                                Image->user_max[1] = strtod (sptr, (char **)NULL);
                                                                 user_max_count = 2;
                                                                 sptr = strtok (NULL, ",");
                                                                 if (sptr != NULL) {
-                                                                        Image.user_max[2] = strtod (sptr, (char **)NULL);
+                                                                        Image->user_max[2] = strtod (sptr, (char **)NULL);
                                                                         user_max_count = 3;
                                                                 }
                                                         }
@@ -798,32 +1048,32 @@ main (int argc, char *argv[])
                                                 free (tmpstr);
                                         }
                                         else {
-                                                Image.user_max[0] = strtod (optarg, (char **)NULL);
+                                                Image->user_max[0] = strtod (optarg, (char **)NULL);
                                         }
-                                        Image.user_max_set = TRUE;
+                                        Image->user_max_set = TRUE;
                                         break;
                                 case 3: /* x0 */
-                                        Image.input_x[0] = strtod (optarg, (char **)NULL);
+                                        Image->input_x[0] = strtod (optarg, (char **)NULL);
                                         for (i = 1; i < MAX_CHANNELS; i++)
-                                            Image.input_x[i] = Image.input_x[0];
+                                            Image->input_x[i] = Image->input_x[0];
                                         for (i = 0; i < MAX_CHANNELS; i++)
-                                            Image.input_x_corner[i] = 1;
+                                            Image->input_x_corner[i] = 1;
                                         break;
                                 case 4: /* y0 */
-                                        Image.input_y[0] = strtod (optarg, (char **)NULL);
+                                        Image->input_y[0] = strtod (optarg, (char **)NULL);
                                         for (i = 1; i < MAX_CHANNELS; i++)
-                                            Image.input_y[i] = Image.input_y[0];
+                                            Image->input_y[i] = Image->input_y[0];
                                         for (i = 0; i < MAX_CHANNELS; i++)
-                                            Image.input_y_corner[i] = 1;
+                                            Image->input_y_corner[i] = 1;
                                         break;
                                 case 5: /* align */
-                                        Image.output_alignment = ALIGN_REF;
+                                        Image->output_alignment = ALIGN_REF;
                                         break;
                                 case 6: /* compass */
-                                        Image.output_compass = 1;
+                                        Image->output_compass = 1;
                                         break;
                                 case 7: /* rate */
-                                        Image.output_scale = SCALE_RATE;
+                                        Image->output_scale = SCALE_RATE;
                                         break;
                                 case 8: /* factor */
                                         if (strchr (optarg,',') != NULL) {
@@ -831,38 +1081,39 @@ main (int argc, char *argv[])
                                                 tmpstr = strdup (optarg);
                                                 sptr = strtok(tmpstr, ",");
                                                 if (sptr != NULL) {
-                                                        Image.user_scale_factor[0] = strtod (sptr, (char **)NULL);
+                                                        Image->user_scale_factor[0] = strtod (sptr, (char **)NULL);
                                                         sptr = strtok (NULL, ",");
                                                         if ( sptr != NULL) {
-                                                                Image.user_scale_factor[1] = strtod (sptr, (char **)NULL);
+                                                                Image->user_scale_factor[1] = strtod (sptr, (char **)NULL);
                                                                 sptr = strtok (NULL, ",");
                                                                 if ( sptr != NULL) {
-                                                                        Image.user_scale_factor[2] = strtod (sptr, (char **)NULL);
+                                                                        Image->user_scale_factor[2] = strtod (sptr, (char **)NULL);
                                                                 }
                                                         }
                                                 }
                                                 free (tmpstr);
                                         }
                                         else {
-                                                Image.user_scale_factor[0] = strtod (optarg, (char **)NULL);
+                                                Image->user_scale_factor[0] = strtod (optarg, (char **)NULL);
                                         }
-                                        Image.user_scale_factor_set = TRUE;
-                                        Image.output_scale = SCALE_FACTOR;
+                                        Image->user_scale_factor_set = TRUE;
+                                        Image->output_scale = SCALE_FACTOR;
                                         break;
                                 case 9:  /* red */
-                                        Image.input_filename[0] = strdup (optarg);
-                                        Image.channels = 3;
+                                        Image->input_filename[0] = strdup (optarg);
+                                        Image->channels = 3;
                                         break;
                                 case 10: /* green */
-                                        Image.input_filename[1] = strdup (optarg);
-                                        Image.channels = 3;
+                                        Image->input_filename[1] = strdup (optarg);
+                                        Image->channels = 3;
                                         break;
                                 case 11: /* blue */
-                                        Image.input_filename[2] = strdup (optarg);
-                                        Image.channels = 3;
+                                        Image->input_filename[2] = strdup (optarg);
+                                        Image->channels = 3;
                                         break;
                                 case 30:  /* reference */
-                                        Image.reference_filename = strdup (optarg);
+                                        free (Image->reference_filename);
+                                        Image->reference_filename = strdup (optarg);
                                         break;
                                 case 23: /* quality/weight extension */
                                         if (strchr(optarg,',') != NULL) {
@@ -870,57 +1121,57 @@ main (int argc, char *argv[])
                                             tmpstr = strdup(optarg);
                                             sptr = strtok(tmpstr, ",");
                                             if (sptr != NULL) {
-                                                Image.qext[0] = strtol(sptr, (char **)NULL, 0);
+                                                Image->qext[0] = strtol(sptr, (char **)NULL, 0);
                                                 sptr = strtok(NULL, ",");
                                                 if (sptr != NULL) {
-                                                    Image.qext[1] = strtol(sptr, (char **)NULL, 0);
+                                                    Image->qext[1] = strtol(sptr, (char **)NULL, 0);
                                                     sptr = strtok(NULL, ",");
                                                     if (sptr != NULL) {
-                                                        Image.qext[2] = strtol(sptr, (char **)NULL, 0);
+                                                        Image->qext[2] = strtol(sptr, (char **)NULL, 0);
                                                     } else {
-                                                        Image.qext[2] = Image.qext[1];
+                                                        Image->qext[2] = Image->qext[1];
                                                     }
                                                 } else {
-                                                    Image.qext[1] = Image.qext[0];
-                                                    Image.qext[2] = Image.qext[0];
+                                                    Image->qext[1] = Image->qext[0];
+                                                    Image->qext[2] = Image->qext[0];
                                                 }
                                             }
                                             free(tmpstr);
                                         } else {
-                                            Image.qext[0] = strtol(optarg, (char **)NULL, 0);
-                                            Image.qext[1] = Image.qext[0];
-                                            Image.qext[2] = Image.qext[0];
+                                            Image->qext[0] = strtol(optarg, (char **)NULL, 0);
+                                            Image->qext[1] = Image->qext[0];
+                                            Image->qext[2] = Image->qext[0];
                                         }
-                                        Image.qext_set = TRUE;
+                                        Image->qext_set = TRUE;
                                         break;
 
                                 case 12: /* all */
                                         for (i = 0; i < MAX_CHANNELS; i++) {
-                                                Image.input_x[i] = 0;
-                                                Image.input_y[i] = 0;
-                                                Image.nrows[i] = MAGIC_SIZE_ALL_NUMBER;
-                                                Image.ncols[i] = MAGIC_SIZE_ALL_NUMBER;
+                                                Image->input_x[i] = 0;
+                                                Image->input_y[i] = 0;
+                                                Image->nrows[i] = MAGIC_SIZE_ALL_NUMBER;
+                                                Image->ncols[i] = MAGIC_SIZE_ALL_NUMBER;
                                         }
-                                        Image.nrowsref = MAGIC_SIZE_ALL_NUMBER;
-                                        Image.ncolsref = MAGIC_SIZE_ALL_NUMBER;
+                                        Image->nrowsref = MAGIC_SIZE_ALL_NUMBER;
+                                        Image->ncolsref = MAGIC_SIZE_ALL_NUMBER;
                                         break;
                                 case 13: /* zoom */
-                                        Image.output_zoom[0] = strtod (optarg, (char **)NULL);
+                                        Image->output_zoom[0] = strtod (optarg, (char **)NULL);
                                         /* HACK - FIXME */
-                                        if (Image.output_zoom[0] > 1) {
-                                                Image.output_zoom[0] = floor (Image.output_zoom[0]);
+                                        if (Image->output_zoom[0] > 1) {
+                                                Image->output_zoom[0] = floor (Image->output_zoom[0]);
                                         }
-                                        Image.output_zoom[1] = Image.output_zoom[0];
-                                        Image.output_zoom[2] = Image.output_zoom[0];
+                                        Image->output_zoom[1] = Image->output_zoom[0];
+                                        Image->output_zoom[2] = Image->output_zoom[0];
                                         break;
                                 case 20: /* output-size  */
-                                        Image.output_size = strtol (optarg, (char **)NULL, 0);
+                                        Image->output_size = strtol (optarg, (char **)NULL, 0);
                                         break;
                                 case 14:
-                                        Image.output_scale = SCALE_ASINH;
+                                        Image->output_scale = SCALE_ASINH;
                                         break;
                                 case 15:
-                                        Image.output_scale = SCALE_LINEAR;
+                                        Image->output_scale = SCALE_LINEAR;
                                         break;
                                 case 16: /* autoscale min */
                                         if (strchr (optarg, ',') != NULL) {
@@ -928,14 +1179,14 @@ main (int argc, char *argv[])
                                                 tmpstr = strdup (optarg);
                                                 sptr = strtok (tmpstr, ",");
                                                 if (sptr != NULL) {
-                                                        Image.autoscale_percent_low[0] = strtod (sptr, (char **)NULL);
+                                                        Image->autoscale_percent_low[0] = strtod (sptr, (char **)NULL);
                                                         sptr = strtok (NULL, ",");
                                                         if (sptr != NULL) {
-                                                                Image.autoscale_percent_low[1] = strtod (sptr, (char **)NULL);
+                                                                Image->autoscale_percent_low[1] = strtod (sptr, (char **)NULL);
                                                                 autoscale_min_count = 2;
                                                                 sptr = strtok (NULL, ",");
                                                                 if (sptr != NULL) {
-                                                                        Image.autoscale_percent_low[2] = strtod (sptr, (char **)NULL);
+                                                                        Image->autoscale_percent_low[2] = strtod (sptr, (char **)NULL);
                                                                         autoscale_min_count = 3;
                                                                 }
                                                         }
@@ -943,11 +1194,11 @@ main (int argc, char *argv[])
                                                 free (tmpstr);
                                         }
                                         else {
-                                                Image.autoscale_percent_low[0] = strtod (optarg, (char **)NULL);
+                                                Image->autoscale_percent_low[0] = strtod (optarg, (char **)NULL);
                                         }
 
-                                        if (Image.output_scale_mode != SCALE_MODE_FULL)
-                                            Image.output_scale_mode = SCALE_MODE_AUTO;
+                                        if (Image->output_scale_mode != SCALE_MODE_FULL)
+                                            Image->output_scale_mode = SCALE_MODE_AUTO;
                                         break;
                                 case 17: /* autoscale max */
                                         if (strchr (optarg, ',') != NULL) {
@@ -955,14 +1206,14 @@ main (int argc, char *argv[])
                                                 tmpstr = strdup (optarg);
                                                 sptr = strtok (tmpstr, ",");
                                                 if (sptr != NULL) {
-                                                        Image.autoscale_percent_high[0] = strtod (sptr, (char **)NULL);
+                                                        Image->autoscale_percent_high[0] = strtod (sptr, (char **)NULL);
                                                         sptr = strtok (NULL, ",");
                                                         if (sptr != NULL) {
-                                                                Image.autoscale_percent_high[1] = strtod (sptr, (char **)NULL);
+                                                                Image->autoscale_percent_high[1] = strtod (sptr, (char **)NULL);
                                                                 autoscale_max_count = 2;
                                                                 sptr = strtok (NULL, ",");
                                                                 if (sptr != NULL) {
-                                                                        Image.autoscale_percent_high[2] = strtod (sptr, (char **)NULL);
+                                                                        Image->autoscale_percent_high[2] = strtod (sptr, (char **)NULL);
                                                                         autoscale_max_count = 3;
                                                                 }
                                                         }
@@ -970,24 +1221,37 @@ main (int argc, char *argv[])
                                                 free (tmpstr);
                                         }
                                         else {
-                                                Image.autoscale_percent_high[0] = strtod (optarg, (char **)NULL);
+                                                Image->autoscale_percent_high[0] = strtod (optarg, (char **)NULL);
                                         }
 
-                                        if (Image.output_scale_mode != SCALE_MODE_FULL)
-                                            Image.output_scale_mode = SCALE_MODE_AUTO;
+                                        if (Image->output_scale_mode != SCALE_MODE_FULL)
+                                            Image->output_scale_mode = SCALE_MODE_AUTO;
                                         break;
                                 case 18: /* WCS input coordinates */
                                         for (i = 0; i < MAX_CHANNELS; i++) {
-                                            Image.input_wcscoords[i] = 1;
+                                            Image->input_wcscoords[i] = 1;
                                         }
                                         break;
                                 case 22: /* add HISTORY blurb to header */
-                                        Image.input_blurbfile = strdup (optarg);
-                                        Image.output_add_blurb = 1;
+                                        Image->input_blurbfile = strdup (optarg);
+                                        Image->output_add_blurb = 1;
                                         break;
 
                                 case 26: /* marker */
-                                        Image.output_marker = 1;
+                                        Image->output_marker = 1;
+                                        break;
+
+                                case 31: /* batch */
+                                case 32: /* server */
+                                        if (in_request) {
+                                                fitscut_message (0, "%s: --batch and --server are not allowed in a request\n",
+                                                                 progname);
+                                                do_exit (1);
+                                        }
+                                        if (optc == 31)
+                                                batch_filename = strdup (optarg);
+                                        else
+                                                server_socket = strdup (optarg);
                                         break;
 
                                 default:
@@ -1000,72 +1264,84 @@ main (int argc, char *argv[])
                 /* Print version number.  */
                 show_version ();
                 if (! h)
-                        exit (0);
+                        do_exit (0);
         }
 
         if (h) {
                 /* Print help info and exit.  */
                 show_usage ();
-                exit (0);
+                do_exit (0);
         }
 
         if (cmap_name != NULL) {
                 /* translate name into a code */
                 if (! strcasecmp (cmap_name, "heat"))
-                        Image.output_colormap = CMAP_HEAT;
+                        Image->output_colormap = CMAP_HEAT;
                 else if (!strcasecmp (cmap_name, "cool"))
-                        Image.output_colormap = CMAP_COOL;
+                        Image->output_colormap = CMAP_COOL;
                 else if (!strcasecmp (cmap_name, "rainbow"))
-                        Image.output_colormap = CMAP_RAINBOW;
+                        Image->output_colormap = CMAP_RAINBOW;
                 else if (!strcasecmp (cmap_name, "gray"))
-                        Image.output_colormap = CMAP_GRAY;
+                        Image->output_colormap = CMAP_GRAY;
                 else if (!strcasecmp (cmap_name, "red"))
-                        Image.output_colormap = CMAP_RED;
+                        Image->output_colormap = CMAP_RED;
                 else if (!strcasecmp (cmap_name, "green"))
-                        Image.output_colormap = CMAP_GREEN;
+                        Image->output_colormap = CMAP_GREEN;
                 else if (!strcasecmp (cmap_name, "blue"))
-                        Image.output_colormap = CMAP_BLUE;
+                        Image->output_colormap = CMAP_BLUE;
                 else {
                         fprintf (stderr, "Warning: palette %s unknown, using grayscale.\n", cmap_name);
-                        Image.output_colormap = CMAP_GRAY;
+                        Image->output_colormap = CMAP_GRAY;
                 }
         }
         else {
-                Image.output_colormap = CMAP_GRAY;
+                Image->output_colormap = CMAP_GRAY;
         }
 
         /* if the user didn't specify enough min/max values */
         for (k = user_min_count; k < MAX_CHANNELS; k++)
-                Image.user_min[k] = Image.user_min[k-1];
+                Image->user_min[k] = Image->user_min[k-1];
 
         for (k = user_max_count; k < MAX_CHANNELS; k++)
-                Image.user_max[k] = Image.user_max[k-1];
+                Image->user_max[k] = Image->user_max[k-1];
 
         for (k = autoscale_min_count; k < MAX_CHANNELS; k++)
-                Image.autoscale_percent_low[k] = Image.autoscale_percent_low[k-1];
+                Image->autoscale_percent_low[k] = Image->autoscale_percent_low[k-1];
 
         for (k = autoscale_max_count; k < MAX_CHANNELS; k++)
-                Image.autoscale_percent_high[k] = Image.autoscale_percent_high[k-1];
+                Image->autoscale_percent_high[k] = Image->autoscale_percent_high[k-1];
 
-        if (Image.user_min_set && Image.user_max_set)
-            Image.output_scale_mode = SCALE_MODE_USER;
+        if (Image->user_min_set && Image->user_max_set)
+            Image->output_scale_mode = SCALE_MODE_USER;
 
-        if (Image.output_add_blurb) {
-            if (check_input_file(Image.input_blurbfile) != OK) {
+        if (Image->output_add_blurb) {
+            if (check_input_file(Image->input_blurbfile) != OK) {
                 do_exit(1);
             }
         }
 
+        if (cmap_name != NULL)
+                free (cmap_name);
+}
+
+/*
+ * Take the input and output file names from the remaining arguments
+ */
+static void
+parse_files (int argc, char *argv[], FitsCutImage *Image, char *ofname)
+{
+        int arg_count;
+
         arg_count = argc - optind;
-        if ( (Image.input_filename[0] != NULL) || 
-             (Image.input_filename[1] != NULL) || 
-             (Image.input_filename[2] != NULL)) {
-                if (check_input (&Image) != OK)
+        if ( (Image->input_filename[0] != NULL) || 
+             (Image->input_filename[1] != NULL) || 
+             (Image->input_filename[2] != NULL)) {
+                if (check_input (Image) != OK)
                         do_exit (1);
                 if (arg_count >= 1) {
                         to_stdout = 0;
                         make_output_name (ofname, argv[optind++]);
-                        check_output (ofname, Image.input_filename[0]);
+                        check_output (ofname, Image->input_filename[0]);
                 }
                 else {
                         strcpy (ofname, "-");
@@ -1073,55 +1349,209 @@ main (int argc, char *argv[])
         }
         else {
                 if (arg_count >= 1) {
-                        Image.input_filename[0] = strdup (argv[optind++]);
+                        Image->input_filename[0] = strdup (argv[optind++]);
                         if (arg_count == 1) {
-                                Image.channels = 1;
-                                if (check_input (&Image) == ERROR)
+                                Image->channels = 1;
+                                if (check_input (Image) == ERROR)
                                         do_exit (1);
                                 strcpy (ofname, "-");
                         }
                         else if (arg_count == 2) {
                                 to_stdout = 0;
-                                Image.channels = 1;
-                                if (check_input (&Image) == ERROR)
+                                Image->channels = 1;
+                                if (check_input (Image) == ERROR)
                                         do_exit (1);
                                 make_output_name (ofname, argv[optind++]);
-                                check_output (ofname,Image.input_filename[0]);
+                                check_output (ofname,Image->input_filename[0]);
                         }
                         else if (arg_count == 3) {
-                                Image.input_filename[1] = strdup (argv[optind++]);
-                                Image.input_filename[2] = strdup (argv[optind++]);
-                                Image.channels = 3;
-                                if (check_input (&Image) == ERROR)
+                                Image->input_filename[1] = strdup (argv[optind++]);
+                                Image->input_filename[2] = strdup (argv[optind++]);
+                                Image->channels = 3;
+                                if (check_input (Image) == ERROR)
                                         do_exit (1);
                                 strcpy (ofname,"-");
                         }
                         else if (arg_count == 4) {
-                                Image.input_filename[1] = strdup (argv[optind++]);
-                                Image.input_filename[2] = strdup (argv[optind++]);
+                                Image->input_filename[1] = strdup (argv[optind++]);
+                                Image->input_filename[2] = strdup (argv[optind++]);
                                 to_stdout = 0;
-                                Image.channels = 3;
-                                if (check_input (&Image) == ERROR)
+                                Image->channels = 3;
+                                if (check_input (Image) == ERROR)
                                         do_exit(1);
                                 make_output_name (ofname, argv[optind++]);
-                                check_output (ofname, Image.input_filename[0]);
-                                check_output (ofname, Image.input_filename[1]);
-                                check_output (ofname, Image.input_filename[2]);
+                                check_output (ofname, Image->input_filename[0]);
+                                check_output (ofname, Image->input_filename[1]);
+                                check_output (ofname, Image->input_filename[2]);
                         }
                         else {
                                 show_usage ();
-                                exit (0);
+                                do_exit (0);
                         }
 
                 } else {
                         show_usage ();
-                        exit (1);
+                        do_exit (1);
                 }
         }
+}
+
+static void
+release_names (FitsCutImage *Image)
+{
+        int k;
+
+        for (k = 0; k < MAX_CHANNELS; k++) {
+                if (Image->input_filename[k] != NULL)
+                        free (Image->input_filename[k]);
+                Image->input_filename[k] = NULL;
+        }
+        if (Image->input_blurbfile != NULL)
+                free (Image->input_blurbfile);
+        Image->input_blurbfile = NULL;
+        if (Image->output_filename != NULL)
+                free (Image->output_filename);
+        Image->output_filename = NULL;
+        if (Image->reference_filename != NULL)
+                free (Image->reference_filename);
+        Image->reference_filename = NULL;
+        if (Image->scale_cache_dir != NULL)
+                free (Image->scale_cache_dir);
+        Image->scale_cache_dir = NULL;
+}
+
+/*
+ * Handle one --server request.  argv holds the request arguments as they
+ * would appear on the command line; the output goes to stdout, which the
+ * server has pointed at the client connection.
+ */
+static int
+treat_request (int argc, char *argv[])
+{
+        /* static so they keep their values across longjmp */
+        static FitsCutImage Request;
+        static char ofname[MAX_PATH_LEN];
+        static int server_verbose = -1, server_force, server_quiet;
+        int arg_count, has_output;
+
+        /* every request starts from the server's own flags */
+        if (server_verbose < 0) {
+                server_verbose = verbose;
+                server_force = force;
+                server_quiet = quiet;
+        }
+        verbose = server_verbose;
+        force = server_force;
+        quiet = server_quiet;
+        to_stdout = 1;
+        exit_code = OK;
+
+        fitscut_initialize (&Request);
+        Request.output_filename = NULL;
+
+        if (setjmp (request_env) != 0) {
+                in_request = 0;
+                fitscut_message (0, "%s: request failed\n", progname);
+                release_data (&Request);
+                release_names (&Request);
+                area_resize_release ();
+                /* the failure may have left an input in a bad state */
+                input_cache_flush ();
+                return ERROR;
+        }
+#ifdef HAVE_PTHREAD_H
+        request_thread = pthread_self ();
+#endif
+        in_request = 1;
+
+        optind = 0;   /* restart getopt */
+        parse_options (argc, argv, &Request);
+
+        /* the output goes back on the connection, never to a file */
+        arg_count = argc - optind;
+        if (Request.input_filename[0] != NULL || Request.input_filename[1] != NULL ||
+            Request.input_filename[2] != NULL)
+                has_output = arg_count >= 1;
+        else
+                has_output = arg_count == 2 || arg_count == 4;
+        if (has_output) {
+                fitscut_message (0, "%s: a request may not name an output file\n", progname);
+                do_exit (1);
+        }
+        parse_files (argc, argv, &Request, ofname);
+        Request.output_filename = strdup (ofname);
+        treat_input (&Request);
+        release_names (&Request);
+
+        in_request = 0;
+        return exit_code;
+}
+
+/*
+ * Run as a server on a UNIX domain socket.  Inputs stay open between
+ * requests; see input_cache.c.
+ */
+static int
+treat_server (char *socket_path)
+{
+        int retval;
+
+        input_cache_keep (1);
+        retval = server_run (socket_path, treat_request);
+        input_cache_keep (0);
+        input_cache_flush ();
+
+        return retval;
+}
+
+int 
+main (int argc, char *argv[])
+{
+        int proglen;        /* length of progname */
+        char ofname[MAX_PATH_LEN];
+        FitsCutImage Image;
+
+#ifdef DEBUGGING
+        mtrace ();
+#endif
+
+        fitscut_initialize (&Image);
+
+        /* set up globals */
+  
+        EXPAND (argc, argv); /* wild card expansion if necessary */
+
+        progname = (char *) basename (argv[0]);
+        proglen = strlen (progname);
+  
+        /* Suppress .exe for MSDOS, OS/2 and VMS: */
+        if (proglen > 4 && strequ (progname + proglen - 4, ".exe"))
+                progname[proglen-4] = '\0';
+
+        foreground = signal (SIGINT, SIG_IGN) != SIG_IGN;
+        if (foreground)
+                (void) signal (SIGINT, (sig_type)abort_fitscut);
+
+        parse_options (argc, argv, &Image);
+
+        if (server_socket != NULL) {
+                if (argc - optind > 0) {
+                        show_usage ();
+                        do_exit (1);
+                }
+                return treat_server (server_socket);
+        }
+
+        parse_files (argc, argv, &Image, ofname);
 
         if (to_stdout) {
                 SET_BINARY_MODE (fileno (stdout));
         }
+        if (batch_filename != NULL) {
+                treat_batch (&Image, batch_filename);
+                return exit_code;
+        }
+
         Image.output_filename = strdup (ofname);
         treat_input (&Image);
 
@@ -117,6 +117,7 @@ typedef enum {
         SCALE_MODE_MINMAX = 0,
         SCALE_MODE_AUTO,
         SCALE_MODE_FULL,
+        SCALE_MODE_ZSCALE,
         SCALE_MODE_USER
 } FitscutScaleMode;
 
@@ -145,6 +146,10 @@ void       fitscut_message (int level, const char *format, ...);
 #define NBINS 50000
 #define NSAMPLE 250000
 #define MINSAMPLEROWS 10
+#define ZSCALE_NSAMPLE 1000
+#define ZSCALE_CONTRAST 0.25
+/* output pixels the WCS remap may be off by between exact points */
+#define ALIGN_TOLERANCE 0.01
 
 extern int foreground;            /* set if program run in foreground */
 extern int force;        /* don't ask questions, overwrite (-f) */
@@ -157,6 +162,13 @@ extern int exit_code;   /* program exit code */
 
 #define MAGIC_SIZE_ALL_NUMBER 999999
 
+/* default memory budget for the extract read buffers (--max-memory) */
+#define MAX_MEMORY_DEFAULT (256L*1024*1024)
+
+typedef struct extract_stream ExtractStream;
+typedef struct transfer Transfer;
+typedef struct area_resampler AreaResampler;
+
 typedef struct fitscut_image {
         int output_type;
         int output_scale;
@@ -189,24 +201,36 @@ typedef struct fitscut_image {
         int qext[MAX_CHANNELS];
         int qext_set;
         int qext_bad_value[MAX_CHANNELS];
+        int qext_mask;          /* DQ bits that flag bad pixels, 0 to test qext_bad_value */
         int useBadpix;
         int useBsoften;
+        long max_memory;
+        int threads;
+        char *scale_cache_dir;  /* where to keep --full-scale statistics */
         float bad_data_value[MAX_CHANNELS];
         float badmin[MAX_CHANNELS];
         float badmax[MAX_CHANNELS];
         double autoscale_percent_low[MAX_CHANNELS];
         double autoscale_percent_high[MAX_CHANNELS];
         double autoscale_min[MAX_CHANNELS], autoscale_max[MAX_CHANNELS];
+        int autoscale_exact;    /* exact percentiles rather than histogram bins */
+        float zscale_contrast;
         int autoscale_performed;
         double data_min[MAX_CHANNELS], data_max[MAX_CHANNELS];
         float *histogram[MAX_CHANNELS];
         float *data[MAX_CHANNELS];
+        /* when set, output rows are read from here instead of data */
+        ExtractStream *stream;
+        /* stretches left for the PNG/JPEG writer to apply to data */
+        int transfer_deferred;
+        Transfer *transfer[MAX_CHANNELS];
         char *header[MAX_CHANNELS];
         int header_cards[MAX_CHANNELS];
         struct WorldCoor *wcs[MAX_CHANNELS];
         /* reference coordinates for resampling image */
         char *reference_filename;
         struct WorldCoor *wcsref;
+        double align_tolerance;  /* --align-tolerance, 0 for exact per pixel */
         double x0ref, y0ref;
         double output_zoomref;
         long ncolsref, nrowsref;
@@ -46,6 +46,7 @@ extern char *malloc ();
                                                                                 
 #include "fitscut.h"
 #include "histogram.h"
+#include "stats.h"
 
 #ifdef DMALLOC
 #include <dmalloc.h>
@@ -60,58 +61,20 @@ extern char *malloc ();
 float *
 compute_histogram (float *arrayp, int length, double dmin, double dmax, long npix, float bad_data_value, long *pixcount, float *inmin, float *inmax)
 {
+        StatsHist *sh;
         float *hist;
-        double binsize;
-        long   i, ind;
-        float  value;
-        float  fmin, fmax;
-        long   lpixcount;
-
-        /* allocate histogram */
-        hist = (float*) malloc (sizeof (float) * (length + 1));
-
-        /* Initialize histogram */
-        for (i = 0; i <= length; i++)
-                hist[i] = 0;
-
-        /* Build histogram */
-        fitscut_message (3, "\tbuilding histogram...\n");
-
-        binsize = (dmax - dmin) / (length - 1);
-        fitscut_message (4, "\tdmax: %lf dmin: %lf length: %d binsize: %lf npix: %ld...\n",
-                         dmax, dmin, length, binsize, npix);
-
-        lpixcount = 0;
-        fmin = FLT_MAX;
-        fmax = -FLT_MAX;
-        for (i = 0; i < npix; i++) {
-            value = arrayp[i];
-            /* exclude blanked values */
-            if (finite(value) && (value != bad_data_value)) {
-                if (value < dmin) {
-                    ind = 0;
-                } else if (value > dmax) {
-                    ind = length-1;
-                } else {
-                    ind = ceil ((value-dmin) / binsize);
-                    if (value > fmax) fmax = value;
-                    if (value < fmin) fmin = value;
-                }
-                hist[ind] += 1.0;
-                lpixcount++;
-            }
-        }
+
+        sh = stats_hist_new (arrayp, npix, bad_data_value, length, dmin, dmax);
+
         /* return total number of pixels excluding blanks in pixcount */
-        *pixcount = lpixcount;
+        *pixcount = sh->pixcount;
         /* return min/max range for pixels within histogram bounds to allow refinement */
-        if (fmin > fmax) {
-            /* no pixels in bounds */
-            *inmin = 0.5*(dmin+dmax);
-            *inmax = *inmin;
-        } else {
-            *inmin = fmin;
-            *inmax = fmax;
-        }
+        *inmin = sh->inmin;
+        *inmax = sh->inmax;
+
+        hist = sh->hist;
+        sh->hist = NULL;
+        stats_hist_free (sh);
         return (hist);
 }
 
@@ -21,6 +21,7 @@
 void autoscale_image   (FitsCutImage *);
 void autoscale_channel (FitsCutImage *, int);
 void autoscale_full_channel (FitsCutImage *, int);
+void autoscale_zscale_channel (FitsCutImage *, int);
 void histeq_image      (FitsCutImage *);
 void log_image         (FitsCutImage *);
 void sqrt_image        (FitsCutImage *);
@@ -0,0 +1,330 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Cache of open input files, headers and WCS structures
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Every cutout needs the open fitsfile, the header string and the
+ * parsed WCS for each input (and for the reference image).  Opening
+ * the file and parsing the header dominate the cost of small cutouts,
+ * so when several cutouts are made from the same files in one process
+ * (--batch) the entries are kept open between cutouts.
+ *
+ * A long running server (--server) sees many different files, so the
+ * list is kept in most recently used order and the oldest entries are
+ * closed once INPUT_CACHE_MAX_OPEN files are open.  An entry is reopened
+ * if the file on disk has been modified since it was cached.
+ *
+ * libwcs modifies a WorldCoor in place when the cutout offset and zoom
+ * are applied, so each WCS handed out is restored from a pristine copy
+ * at the start of every cutout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#ifdef  HAVE_STRING_H
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#ifdef HAVE_CFITSIO_FITSIO_H
+#include <cfitsio/fitsio.h>
+#else
+#include <fitsio.h>
+#endif
+
+#include "fitscut.h"
+#include "extract.h"
+#include <libwcs/wcs.h>
+#include "input_cache.h"
+#include "mmap_reader.h"
+#include "tile_reader.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+static FitsCutInput *input_list = NULL;
+static int keep_open = 0;
+
+/*
+ * Keep input files open between cutouts (batch mode)
+ */
+void
+input_cache_keep (int keep)
+{
+        keep_open = keep;
+}
+
+/*
+ * Start a new cutout: all cached WCS structures become available again
+ */
+void
+input_cache_begin (void)
+{
+        FitsCutInput *input;
+
+        for (input = input_list; input != NULL; input = input->next) {
+                input->nwcs_used = 0;
+                input->in_use = 0;
+        }
+}
+
+/*
+ * Finish a cutout, closing the inputs unless they are being kept
+ */
+void
+input_cache_end (void)
+{
+        if (! keep_open)
+                input_cache_flush ();
+}
+
+static void
+input_close (FitsCutInput *input)
+{
+        int status = 0;
+        int i;
+
+        for (i = 0; i < INPUT_CACHE_NWCS; i++) {
+                if (input->wcs[i] != NULL) {
+                        /* put back the original so wcsfree sees its own allocations */
+                        memcpy (input->wcs[i], input->wcs_save[i], sizeof (struct WorldCoor));
+                        wcsfree (input->wcs[i]);
+                        free (input->wcs_save[i]);
+                }
+        }
+        tile_cache_forget (input->fptr);
+        mmap_forget (input->fptr);
+        if (fits_close_file (input->fptr, &status))
+                printerror (status);
+        free (input->header);
+        free (input->filename);
+        free (input);
+}
+
+/*
+ * Close all cached inputs
+ */
+void
+input_cache_flush (void)
+{
+        FitsCutInput *input;
+
+        while (input_list != NULL) {
+                input = input_list;
+                input_list = input->next;
+                fitscut_message (3, "\tClosing cached input %s\n", input->filename);
+                input_close (input);
+        }
+}
+
+/*
+ * Get the modification time and size of the disk file behind a cfitsio
+ * file name (which may carry an extension or filter specification).
+ * Returns ERROR for names that are not plain disk files.
+ */
+static int
+input_stat (char *filename, time_t *mtime, off_t *size)
+{
+        char rootname[FLEN_FILENAME];
+        struct stat sbuf;
+        int status = 0;
+
+        *mtime = 0;
+        *size = 0;
+        if (fits_parse_rootname (filename, rootname, &status))
+                return ERROR;
+        if (stat (rootname, &sbuf) != 0)
+                return ERROR;
+        *mtime = sbuf.st_mtime;
+        *size = sbuf.st_size;
+        return OK;
+}
+
+/*
+ * Unlink the entry from the cache list and close it
+ */
+static void
+input_remove (FitsCutInput *input)
+{
+        FitsCutInput **pp;
+
+        for (pp = &input_list; *pp != NULL; pp = &(*pp)->next) {
+                if (*pp == input) {
+                        *pp = input->next;
+                        break;
+                }
+        }
+        input_close (input);
+}
+
+/*
+ * Close the least recently used entries not needed by the current cutout
+ * until there is room for one more
+ */
+static void
+input_evict (void)
+{
+        FitsCutInput *input, *victim;
+        int count;
+
+        for (;;) {
+                count = 0;
+                victim = NULL;
+                for (input = input_list; input != NULL; input = input->next) {
+                        count++;
+                        if (! input->in_use)
+                                victim = input;
+                }
+                if (count < INPUT_CACHE_MAX_OPEN || victim == NULL)
+                        return;
+                fitscut_message (3, "\tClosing least recently used input %s\n",
+                                 victim->filename);
+                input_remove (victim);
+        }
+}
+
+/*
+ * Give up on an input that was opened but could not be read, which is
+ * not yet in the cache, and report the cfitsio status
+ */
+static void
+input_open_failed (FitsCutInput *input, int status)
+{
+        int close_status = 0;
+
+        fits_close_file (input->fptr, &close_status);
+        free (input->header);
+        free (input);
+        printerror (status);
+}
+
+/*
+ * Return the cache entry for filename, opening the file and reading the
+ * header if it is not already cached
+ */
+FitsCutInput *
+input_cache_open (char *filename)
+{
+        FitsCutInput *input, **pp;
+        time_t mtime;
+        off_t size;
+        int status = 0;
+        int i;
+
+        for (pp = &input_list; *pp != NULL; pp = &(*pp)->next) {
+                input = *pp;
+                if (! strequ (input->filename, filename))
+                        continue;
+
+                if (! input->in_use &&
+                    input_stat (filename, &mtime, &size) == OK &&
+                    (mtime != input->mtime || size != input->size)) {
+                        fitscut_message (2, "\tInput %s changed on disk, reopening\n",
+                                         filename);
+                        input_remove (input);
+                        break;
+                }
+
+                /* move to the front of the list */
+                *pp = input->next;
+                input->next = input_list;
+                input_list = input;
+                input->in_use = 1;
+                fitscut_message (3, "\tUsing cached input %s\n", filename);
+                return input;
+        }
+
+        input_evict ();
+
+        input = (FitsCutInput *) malloc (sizeof (FitsCutInput));
+        if (input == NULL)
+                fitscut_error ("out of memory allocating input cache");
+
+        if (fits_open_image (&input->fptr, filename, READONLY, &status)) {
+                free (input);
+                printerror (status);
+        }
+
+        /* let cfitsio extract the entire header as a string */
+        input->header = NULL;
+        input->naxes[0] = input->naxes[1] = 0;
+        if (fits_get_image_wcs_keys (input->fptr, &input->header, &status) ||
+            fits_get_img_size (input->fptr, 2, input->naxes, &status))
+                input_open_failed (input, status);
+        input->header_cards = strlen (input->header)/(FLEN_CARD-1);
+
+        input->filename = strdup (filename);
+        input_stat (filename, &input->mtime, &input->size);
+        input->in_use = 1;
+        input->nwcs_used = 0;
+        for (i = 0; i < INPUT_CACHE_NWCS; i++) {
+                input->wcs[i] = NULL;
+                input->wcs_save[i] = NULL;
+        }
+        input->next = input_list;
+        input_list = input;
+
+        return input;
+}
+
+/*
+ * Return a WCS structure for the input that has not yet been used in this
+ * cutout, parsing the header only the first time the slot is needed.
+ * May return NULL if the header has no WCS.
+ */
+struct WorldCoor *
+input_cache_wcs (FitsCutInput *input)
+{
+        struct WorldCoor *wcs;
+        int n;
+
+        if (input->nwcs_used >= INPUT_CACHE_NWCS)
+                fitscut_error ("too many WCS structures requested for one input");
+        n = input->nwcs_used++;
+
+        wcs = input->wcs[n];
+        if (wcs == NULL) {
+                wcs = wcsninit (input->header, input->header_cards*80);
+                if (wcs == NULL)
+                        return NULL;
+                input->wcs_save[n] = (struct WorldCoor *) malloc (sizeof (struct WorldCoor));
+                if (input->wcs_save[n] == NULL)
+                        fitscut_error ("out of memory allocating input cache");
+                memcpy (input->wcs_save[n], wcs, sizeof (struct WorldCoor));
+                input->wcs[n] = wcs;
+        } else {
+                /* undo any cutout offset or zoom applied by the last cutout */
+                memcpy (wcs, input->wcs_save[n], sizeof (struct WorldCoor));
+        }
+        return wcs;
+}
@@ -0,0 +1,46 @@
+/* declarations for input_cache.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* one WCS per channel plus one for the reference image */
+#define INPUT_CACHE_NWCS (MAX_CHANNELS+1)
+
+/* most inputs kept open at once; the least recently used is closed first */
+#define INPUT_CACHE_MAX_OPEN 32
+
+typedef struct fitscut_input {
+        char *filename;
+        fitsfile *fptr;
+        char *header;
+        int header_cards;
+        long naxes[2];
+        /* file state when opened, to notice files replaced on disk */
+        time_t mtime;
+        off_t size;
+        int in_use;
+        /* WCS structures handed out during the current cutout */
+        int nwcs_used;
+        struct WorldCoor *wcs[INPUT_CACHE_NWCS];
+        struct WorldCoor *wcs_save[INPUT_CACHE_NWCS];
+        struct fitscut_input *next;
+} FitsCutInput;
+
+void              input_cache_keep  (int keep);
+void              input_cache_begin (void);
+void              input_cache_end   (void);
+void              input_cache_flush (void);
+FitsCutInput     *input_cache_open  (char *filename);
+struct WorldCoor *input_cache_wcs   (FitsCutInput *input);
@@ -0,0 +1,525 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Memory-mapped reader for uncompressed images
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * The data unit of an uncompressed image HDU in a disk file is a plain
+ * big-endian array at a known offset.  The data unit is mapped into
+ * memory and the requested pixels are converted straight into the
+ * caller's buffer, doing the byteswap and BSCALE/BZERO scaling in simple
+ * loops the compiler can vectorize.  Hot files then cost little more
+ * than a memcpy per cutout.
+ *
+ * The conversions follow cfitsio: values are scaled in double precision,
+ * and when nulval is given and nonzero, BLANK (integer images) or NaN
+ * (floating point images) pixels are replaced by *nulval and anynul is
+ * set.  Anything else (compressed or gzipped files, BITPIX 64, scaled
+ * integer output, files not on disk) falls back to cfitsio.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <fcntl.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#ifdef  HAVE_STRING_H
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_CFITSIO_FITSIO_H
+#include <cfitsio/fitsio.h>
+#else
+#include <fitsio.h>
+#endif
+
+#include "fitscut.h"
+#include "mmap_reader.h"
+#include "threads.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+#if defined (HAVE_SYS_MMAN_H) && defined (HAVE_UNISTD_H)
+
+/* one mapped image HDU */
+typedef struct mmap_image {
+        fitsfile *fptr;
+        int hdunum;
+        int usable;             /* false: leave reads to cfitsio */
+        int bitpix;
+        long naxes[3];
+        double bscale, bzero;
+        int scaled;
+        int has_blank;
+        long blank;
+        unsigned char *map;     /* page aligned mapping */
+        size_t maplen;
+        unsigned char *data;    /* first byte of the data unit */
+        struct mmap_image *next;
+} MmapImage;
+
+static MmapImage *image_list = NULL;
+/* image_list is shared by the extraction threads */
+THREADS_MUTEX (image_list_lock);
+
+/* big-endian loads; compilers turn these into byteswap instructions */
+#define GET16(p) ((int16_t) (((uint16_t) (p)[0] << 8) | (uint16_t) (p)[1]))
+#define GET32(p) ((int32_t) (((uint32_t) (p)[0] << 24) | ((uint32_t) (p)[1] << 16) | \
+                             ((uint32_t) (p)[2] << 8) | (uint32_t) (p)[3]))
+#define GET64(p) (((uint64_t) (uint32_t) GET32 (p) << 32) | (uint64_t) (uint32_t) GET32 ((p)+4))
+
+static float
+get_float (const unsigned char *p)
+{
+        uint32_t u = (uint32_t) GET32 (p);
+        float f;
+
+        memcpy (&f, &u, sizeof (f));
+        return f;
+}
+
+static double
+get_double (const unsigned char *p)
+{
+        uint64_t u = GET64 (p);
+        double d;
+
+        memcpy (&d, &u, sizeof (d));
+        return d;
+}
+
+/*
+ * Check that the HDU is an uncompressed image in a plain disk file and
+ * map its data unit
+ */
+static void
+mmap_setup (MmapImage *image, int *status)
+{
+        char filename[FLEN_FILENAME], rootname[FLEN_FILENAME];
+        char card[8];
+        LONGLONG headstart, datastart, dataend;
+        struct stat sbuf;
+        off_t mapstart;
+        long pagesize, bytepix, npix;
+        int naxis, fd, keystat;
+
+        if (fits_is_compressed_image (image->fptr, status) || *status)
+                return;
+        if (fits_get_img_type (image->fptr, &image->bitpix, status) ||
+            fits_get_img_dim (image->fptr, &naxis, status))
+                return;
+        if (naxis < 2 || naxis > 3)
+                return;
+        if (fits_get_img_size (image->fptr, naxis, image->naxes, status))
+                return;
+        switch (image->bitpix) {
+        case BYTE_IMG:   bytepix = 1; break;
+        case SHORT_IMG:  bytepix = 2; break;
+        case LONG_IMG:   bytepix = 4; break;
+        case FLOAT_IMG:  bytepix = 4; break;
+        case DOUBLE_IMG: bytepix = 8; break;
+        default:
+                return;
+        }
+
+        keystat = 0;
+        if (fits_read_key (image->fptr, TDOUBLE, "BSCALE", &image->bscale, NULL, &keystat))
+                image->bscale = 1.0;
+        keystat = 0;
+        if (fits_read_key (image->fptr, TDOUBLE, "BZERO", &image->bzero, NULL, &keystat))
+                image->bzero = 0.0;
+        image->scaled = (image->bscale != 1.0 || image->bzero != 0.0);
+        keystat = 0;
+        image->has_blank = 0;
+        if (image->bitpix > 0 &&
+            ! fits_read_key (image->fptr, TLONG, "BLANK", &image->blank, NULL, &keystat))
+                image->has_blank = 1;
+
+        if (fits_get_hduaddrll (image->fptr, &headstart, &datastart, &dataend, status))
+                return;
+
+        /* the name must refer to the disk file cfitsio is reading */
+        if (fits_file_name (image->fptr, filename, status) ||
+            fits_parse_rootname (filename, rootname, status))
+                return;
+        if (stat (rootname, &sbuf) != 0 || ! S_ISREG (sbuf.st_mode))
+                return;
+
+        npix = image->naxes[0] * image->naxes[1] * image->naxes[2];
+        if (datastart + (LONGLONG) npix*bytepix > (LONGLONG) sbuf.st_size)
+                return;
+
+        if ((fd = open (rootname, O_RDONLY)) < 0)
+                return;
+
+        /* the header of this HDU must be where cfitsio says it is, which
+         * rules out gzipped files and other files cfitsio uncompresses */
+        if (pread (fd, card, sizeof (card), (off_t) headstart) != sizeof (card) ||
+            (strncmp (card, "SIMPLE  ", 8) != 0 && strncmp (card, "XTENSION", 8) != 0)) {
+                close (fd);
+                return;
+        }
+
+        pagesize = sysconf (_SC_PAGESIZE);
+        mapstart = (off_t) (datastart - datastart % pagesize);
+        image->maplen = (size_t) (datastart - mapstart) + (size_t) npix*bytepix;
+        image->map = (unsigned char *) mmap (NULL, image->maplen, PROT_READ, MAP_SHARED, fd, mapstart);
+        close (fd);
+        if (image->map == (unsigned char *) MAP_FAILED) {
+                image->map = NULL;
+                return;
+        }
+        image->data = image->map + (datastart - mapstart);
+        image->usable = 1;
+        fitscut_message (2, "\tMapped %ld bytes of image data from %s\n",
+                         (long) (npix*bytepix), rootname);
+}
+
+static MmapImage *
+mmap_image_info (fitsfile *fptr, int *status)
+{
+        MmapImage *image;
+        int hdunum;
+
+        fits_get_hdu_num (fptr, &hdunum);
+        for (image = image_list; image != NULL; image = image->next) {
+                if (image->fptr == fptr && image->hdunum == hdunum)
+                        return image;
+        }
+
+        image = (MmapImage *) malloc (sizeof (MmapImage));
+        if (image == NULL) {
+                *status = MEMORY_ALLOCATION;
+                return NULL;
+        }
+        image->fptr = fptr;
+        image->hdunum = hdunum;
+        image->usable = 0;
+        image->map = NULL;
+        image->naxes[0] = image->naxes[1] = image->naxes[2] = 1;
+
+        mmap_setup (image, status);
+        if (*status) {
+                if (image->map != NULL)
+                        munmap (image->map, image->maplen);
+                free (image);
+                return NULL;
+        }
+
+        image->next = image_list;
+        image_list = image;
+        return image;
+}
+
+/*
+ * Convert n pixels, stride bytes apart, to float
+ */
+static int
+convert_float (MmapImage *image, const unsigned char *src, long stride, long n,
+               float *out, int nullcheck, float nullval)
+{
+        double scale = image->bscale, zero = image->bzero;
+        int check_blank = nullcheck && image->has_blank;
+        long blank = image->blank;
+        long i;
+        int anynul = 0;
+
+        switch (image->bitpix) {
+        case BYTE_IMG:
+                if (check_blank) {
+                        for (i = 0; i < n; i++, src += stride) {
+                                if (src[0] == blank) {
+                                        out[i] = nullval;
+                                        anynul = 1;
+                                } else
+                                        out[i] = (float) (src[0]*scale + zero);
+                        }
+                } else if (image->scaled) {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) (src[0]*scale + zero);
+                } else {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) src[0];
+                }
+                break;
+        case SHORT_IMG:
+                if (check_blank) {
+                        for (i = 0; i < n; i++, src += stride) {
+                                int16_t v = GET16 (src);
+                                if (v == blank) {
+                                        out[i] = nullval;
+                                        anynul = 1;
+                                } else
+                                        out[i] = (float) (v*scale + zero);
+                        }
+                } else if (image->scaled) {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) (GET16 (src)*scale + zero);
+                } else {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) GET16 (src);
+                }
+                break;
+        case LONG_IMG:
+                if (check_blank) {
+                        for (i = 0; i < n; i++, src += stride) {
+                                int32_t v = GET32 (src);
+                                if (v == blank) {
+                                        out[i] = nullval;
+                                        anynul = 1;
+                                } else
+                                        out[i] = (float) (v*scale + zero);
+                        }
+                } else if (image->scaled) {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) (GET32 (src)*scale + zero);
+                } else {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) GET32 (src);
+                }
+                break;
+        case FLOAT_IMG:
+                if (image->scaled) {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) (get_float (src)*scale + zero);
+                } else {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = get_float (src);
+                }
+                if (nullcheck) {
+                        for (i = 0; i < n; i++) {
+                                if (out[i] != out[i]) {
+                                        out[i] = nullval;
+                                        anynul = 1;
+                                }
+                        }
+                }
+                break;
+        case DOUBLE_IMG:
+                if (image->scaled) {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) (get_double (src)*scale + zero);
+                } else {
+                        for (i = 0; i < n; i++, src += stride)
+                                out[i] = (float) get_double (src);
+                }
+                if (nullcheck) {
+                        for (i = 0; i < n; i++) {
+                                if (out[i] != out[i]) {
+                                        out[i] = nullval;
+                                        anynul = 1;
+                                }
+                        }
+                }
+                break;
+        }
+        return anynul;
+}
+
+/*
+ * Convert n pixels of an unscaled integer image to int
+ */
+static int
+convert_int (MmapImage *image, const unsigned char *src, long stride, long n,
+             int *out, int nullcheck, int nullval)
+{
+        int check_blank = nullcheck && image->has_blank;
+        long blank = image->blank;
+        long i;
+        int anynul = 0;
+
+        switch (image->bitpix) {
+        case BYTE_IMG:
+                for (i = 0; i < n; i++, src += stride)
+                        out[i] = src[0];
+                break;
+        case SHORT_IMG:
+                for (i = 0; i < n; i++, src += stride)
+                        out[i] = GET16 (src);
+                break;
+        case LONG_IMG:
+                for (i = 0; i < n; i++, src += stride)
+                        out[i] = GET32 (src);
+                break;
+        }
+        if (check_blank) {
+                for (i = 0; i < n; i++) {
+                        if (out[i] == blank) {
+                                out[i] = nullval;
+                                anynul = 1;
+                        }
+                }
+        }
+        return anynul;
+}
+
+/*
+ * Read a subset of an uncompressed image from the mapped data unit.
+ * Arguments are as for fits_read_subset.  Returns true if the read was
+ * handled here (check status for errors), false if cfitsio should do it.
+ */
+int
+mmap_read_subset (fitsfile *fptr, int datatype, long *fpixel, long *lpixel, long *inc,
+                  void *nulval, void *array, int *anynul, int *status)
+{
+        MmapImage *image;
+        const unsigned char *row;
+        long nx, ny, r, bytepix, stride;
+        int nullcheck, any = 0;
+        int i;
+
+        if (*status)
+                return 1;
+        if (datatype != TFLOAT && datatype != TINT)
+                return 0;
+
+        threads_lock (image_list_lock);
+        image = mmap_image_info (fptr, status);
+        threads_unlock (image_list_lock);
+        if (image == NULL)
+                return *status != 0;
+        if (! image->usable)
+                return 0;
+
+        /* integer output only for unscaled integer images */
+        if (datatype == TINT && (image->bitpix < 0 || image->scaled))
+                return 0;
+
+        if (fpixel[2] != lpixel[2])
+                return 0;
+        for (i = 3; i < 7; i++) {
+                if (fpixel[i] != 1 || lpixel[i] != 1)
+                        return 0;
+        }
+        if (fpixel[0] < 1 || lpixel[0] > image->naxes[0] ||
+            fpixel[1] < 1 || lpixel[1] > image->naxes[1] ||
+            fpixel[2] < 1 || fpixel[2] > image->naxes[2])
+                return 0;
+
+        bytepix = abs (image->bitpix) / 8;
+        stride = inc[0]*bytepix;
+        nx = (lpixel[0]-fpixel[0])/inc[0] + 1;
+        ny = (lpixel[1]-fpixel[1])/inc[1] + 1;
+
+        if (datatype == TFLOAT)
+                nullcheck = (nulval != NULL && *(float *) nulval != 0.0);
+        else
+                nullcheck = (nulval != NULL && *(int *) nulval != 0);
+
+        for (r = 0; r < ny; r++) {
+                row = image->data +
+                        (((fpixel[2]-1)*image->naxes[1] + fpixel[1]-1 + r*inc[1]) * image->naxes[0] +
+                         fpixel[0]-1) * bytepix;
+                if (datatype == TFLOAT)
+                        any |= convert_float (image, row, stride, nx, (float *) array + r*nx,
+                                              nullcheck, nullcheck ? *(float *) nulval : 0.0);
+                else
+                        any |= convert_int (image, row, stride, nx, (int *) array + r*nx,
+                                            nullcheck, nullcheck ? *(int *) nulval : 0);
+        }
+        if (anynul != NULL)
+                *anynul = any;
+        return 1;
+}
+
+/*
+ * True if reads of datatype from the current HDU of fptr are served from
+ * the memory map, and so can be made from several threads at once
+ */
+int
+mmap_can_read (fitsfile *fptr, int datatype)
+{
+        MmapImage *image;
+        int status = 0;
+
+        threads_lock (image_list_lock);
+        image = mmap_image_info (fptr, &status);
+        threads_unlock (image_list_lock);
+        if (image == NULL || ! image->usable)
+                return 0;
+        if (datatype == TINT)
+                return image->bitpix > 0 && ! image->scaled;
+        return datatype == TFLOAT;
+}
+
+/*
+ * Unmap everything for fptr; call before the file is closed
+ */
+void
+mmap_forget (fitsfile *fptr)
+{
+        MmapImage **pp, *image;
+
+        threads_lock (image_list_lock);
+        for (pp = &image_list; *pp != NULL; ) {
+                image = *pp;
+                if (image->fptr != fptr) {
+                        pp = &image->next;
+                        continue;
+                }
+                if (image->map != NULL)
+                        munmap (image->map, image->maplen);
+                *pp = image->next;
+                free (image);
+        }
+        threads_unlock (image_list_lock);
+}
+
+#else /* ! HAVE_SYS_MMAN_H */
+
+int
+mmap_read_subset (fitsfile *fptr, int datatype, long *fpixel, long *lpixel, long *inc,
+                  void *nulval, void *array, int *anynul, int *status)
+{
+        return 0;
+}
+
+int
+mmap_can_read (fitsfile *fptr, int datatype)
+{
+        return 0;
+}
+
+void
+mmap_forget (fitsfile *fptr)
+{
+}
+
+#endif /* HAVE_SYS_MMAN_H */
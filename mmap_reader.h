@@ -0,0 +1,21 @@
+/* declarations for mmap_reader.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+int  mmap_read_subset (fitsfile *fptr, int datatype, long *fpixel, long *lpixel, long *inc,
+                       void *nulval, void *array, int *anynul, int *status);
+int  mmap_can_read    (fitsfile *fptr, int datatype);
+void mmap_forget      (fitsfile *fptr);
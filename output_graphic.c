@@ -39,6 +39,10 @@
 #include <math.h>
 #include "colormap.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define PNG_NUM_TEXT 1
 
 #ifdef  STDC_HEADERS
@@ -64,6 +68,7 @@ extern char *malloc ();
 #include "output_graphic.h"
 #include "image_scale.h"
 #include "extract.h"
+#include "transfer.h"
 #include "revision.h"
 
 #ifdef DMALLOC
@@ -79,10 +84,17 @@ typedef struct {
         png_info *png_info_ptr;
 } GraphicsInfo;
 
+/* scale a row of floats to bytes, written one after another */
+typedef void (*QuantizeRow) (const float *arrayp, unsigned char *out, long ncols,
+                             float scale, float minval, float clip_val);
+
+static int image_has_channel (FitsCutImage *Image, int k);
+static float *image_row (FitsCutImage *Image, int k, int row, long ncols);
 static void create_mean_green (unsigned char *line, int ncols);
-static void scale_row_linear (float *arrayp, unsigned char *line, int skip,
-                  int stride, long ncols, float scale, float minval,
-                  float maxval, float clip_val, int invert);
+static QuantizeRow select_quantize_row (float minval, float maxval, float clip_val,
+                  int invert);
+static void interleave_planes (unsigned char *plane, int nplanes, long ncols,
+                  unsigned char *line);
 static void write_rgb_image (GraphicsInfo *info, FitsCutImage *Image);
 static void write_simple_image (GraphicsInfo *info, FitsCutImage *Image);
 
@@ -162,42 +174,135 @@ create_mean_green (unsigned char *line, int ncols)
         }
 }
 
-static void
-scale_row_linear (float *arrayp,
-                  unsigned char *line,
-                  int skip,
-                  int stride,
-                  long ncols,
-                  float scale,
-                  float minval,
-                  float maxval,
-                  float clip_val,
-                  int invert)
+/*
+ * The linear scaling of rows to bytes.  With clip_val the largest byte,
+ * each pixel becomes
+ *
+ *     t = MAX (0, MIN (scale * (value - minval), clip_val))
+ *
+ * or just its value if minval is 0 and maxval is clip_val, then
+ * clip_val - t if the output is inverted, truncated to a byte.  Rather
+ * than test for those cases on every pixel there is a kernel for each,
+ * picked once per channel, and the rows of an RGB image are scaled into
+ * planes of bytes and interleaved after.
+ */
+
+#ifdef __SSE2__
+/* four pixels, as the bytes of the low 8 bits of each 32-bit lane */
+static __m128i
+quantize_four (const float *arrayp, int do_scale, int invert,
+               __m128 vscale, __m128 vmin, __m128 vclip)
 {
-        long col;
-        float t,tx;
-        unsigned char *pp;
-        int do_scale = 1;
+        __m128 t = _mm_loadu_ps (arrayp);
+
+        if (do_scale) {
+                t = _mm_mul_ps (vscale, _mm_sub_ps (t, vmin));
+                /* NaN gives clip_val here, as it does with MIN */
+                t = _mm_min_ps (t, vclip);
+                t = _mm_max_ps (t, _mm_setzero_ps ());
+        }
+        if (invert)
+                t = _mm_sub_ps (vclip, t);
+        /* truncate, keeping the low byte as the cast to unsigned char does */
+        return _mm_and_si128 (_mm_cvttps_epi32 (t), _mm_set1_epi32 (0xff));
+}
+
+#define QUANTIZE_ROW_SSE2(do_scale, invert)                                  \
+        {                                                                    \
+                __m128 vscale = _mm_set1_ps (scale);                         \
+                __m128 vmin = _mm_set1_ps (minval);                          \
+                __m128 vclip = _mm_set1_ps (clip_val);                       \
+                __m128i q0, q1, q2, q3;                                      \
+                                                                             \
+                for (; col + 16 <= ncols; col += 16) {                       \
+                        q0 = quantize_four (arrayp + col, do_scale, invert, vscale, vmin, vclip); \
+                        q1 = quantize_four (arrayp + col + 4, do_scale, invert, vscale, vmin, vclip); \
+                        q2 = quantize_four (arrayp + col + 8, do_scale, invert, vscale, vmin, vclip); \
+                        q3 = quantize_four (arrayp + col + 12, do_scale, invert, vscale, vmin, vclip); \
+                        _mm_storeu_si128 ((__m128i *) (out + col),           \
+                                          _mm_packus_epi16 (_mm_packs_epi32 (q0, q1), \
+                                                            _mm_packs_epi32 (q2, q3))); \
+                }                                                            \
+        }
+#else
+#define QUANTIZE_ROW_SSE2(do_scale, invert)
+#endif /* __SSE2__ */
+
+#define QUANTIZE_ROW(name, do_scale, invert)                                 \
+static void                                                                  \
+name (const float *arrayp, unsigned char *out, long ncols,                   \
+      float scale, float minval, float clip_val)                             \
+{                                                                            \
+        long col = 0;                                                        \
+        float t, tx;                                                         \
+                                                                             \
+        QUANTIZE_ROW_SSE2 (do_scale, invert)                                 \
+        for (; col < ncols; col++) {                                         \
+                t = arrayp[col];                                             \
+                if (do_scale) {                                              \
+                        t = scale * (t - minval);                            \
+                        tx = MIN (t, clip_val);                              \
+                        t = MAX (0, tx);                                     \
+                }                                                            \
+                if (invert)                                                  \
+                        t = clip_val - t;                                    \
+                out[col] = (unsigned char) t;                                \
+        }                                                                    \
+}
+
+QUANTIZE_ROW (quantize_row_scaled, 1, 0)
+QUANTIZE_ROW (quantize_row_scaled_invert, 1, 1)
+QUANTIZE_ROW (quantize_row_copy, 0, 0)
+QUANTIZE_ROW (quantize_row_copy_invert, 0, 1)
 
+static QuantizeRow
+select_quantize_row (float minval, float maxval, float clip_val, int invert)
+{
         if ((minval == 0) && (maxval == clip_val))
-                do_scale = 0;
+                return invert ? quantize_row_copy_invert : quantize_row_copy;
+        return invert ? quantize_row_scaled_invert : quantize_row_scaled;
+}
 
-        pp = line + skip;
-        for (col = 0; col < ncols; col++) {
-                if (do_scale) {
-                        t = scale * (arrayp[col] - minval);
-                        tx = MIN (t, clip_val);
-                        t = MAX (0, tx);
-                }
-                else {
-                        t = arrayp[col];
-                }
-                if (invert) {
-                        t = clip_val - t;
+/* interleave nplanes rows of ncols bytes into pixels */
+static void
+interleave_planes (unsigned char *plane, int nplanes, long ncols, unsigned char *line)
+{
+        const unsigned char *r = plane;
+        const unsigned char *g = plane + ncols;
+        const unsigned char *b = plane + 2 * ncols;
+        long col;
+        int k;
+
+        if (nplanes == 3) {
+                for (col = 0; col < ncols; col++) {
+                        line[0] = r[col];
+                        line[1] = g[col];
+                        line[2] = b[col];
+                        line += 3;
                 }
-                *pp = (unsigned char) t;
-                pp += stride;
+                return;
         }
+        for (k = 0; k < nplanes; k++)
+                for (col = 0; col < ncols; col++)
+                        line[col * nplanes + k] = plane[k * ncols + col];
+}
+
+/* true if channel k has data, whether extracted already or streamed */
+static int
+image_has_channel (FitsCutImage *Image, int k)
+{
+        if (Image->stream != NULL)
+                return Image->input_filename[k] != NULL;
+        return Image->data[k] != NULL;
+}
+
+/* a row of channel k, from the cutout array or read through the stream */
+static float *
+image_row (FitsCutImage *Image, int k, int row, long ncols)
+{
+        if (Image->stream != NULL)
+                return extract_stream_row (Image->stream, k, row);
+        return Image->data[k] + row * ncols;
 }
 
 static void
@@ -208,8 +313,9 @@ write_rgb_image (GraphicsInfo *info, FitsCutImage *Image)
         float scale[MAX_CHANNELS];
         int row, k;
         double *datamin, *datamax, clip_val;
+        QuantizeRow quantize[MAX_CHANNELS];
         int line_len;
-        unsigned char *line;
+        unsigned char *line, *plane;
         int mean_green = 0;
 
         clip_val = pow(2.0,bit_depth) - 1;
@@ -217,6 +323,7 @@ write_rgb_image (GraphicsInfo *info, FitsCutImage *Image)
         switch (Image->output_scale_mode) {
         case SCALE_MODE_AUTO:
         case SCALE_MODE_FULL:
+        case SCALE_MODE_ZSCALE:
                 datamin = Image->autoscale_min;
                 datamax = Image->autoscale_max;
                 /* check for user overrides */
@@ -247,7 +354,7 @@ write_rgb_image (GraphicsInfo *info, FitsCutImage *Image)
         }
 
         for (k = 0; k < Image->channels; k++) {
-                if (Image->data[k] == NULL)
+                if (! image_has_channel (Image, k))
                         continue;
                 if ( datamin[k] < datamax[k] )
                         scale[k] = clip_val / (datamax[k] - datamin[k]);
@@ -256,27 +363,43 @@ write_rgb_image (GraphicsInfo *info, FitsCutImage *Image)
 
                 fitscut_message (2, "\tchannel %d data min: %f max: %f clip: %f scale: %f\n",
                                  k, datamin[k], datamax[k], clip_val, scale[k]);
+                if (Image->transfer[k] != NULL)
+                        transfer_set_output (Image->transfer[k], scale[k], datamin[k],
+                                             datamax[k], clip_val, Image->output_invert);
+                quantize[k] = select_quantize_row (datamin[k], datamax[k], clip_val,
+                                                   Image->output_invert);
         }
 
-        if (Image->data[0] != NULL &&
-            Image->data[1] == NULL &&
-            Image->data[2] != NULL) {
+        if (image_has_channel (Image, 0) &&
+            ! image_has_channel (Image, 1) &&
+            image_has_channel (Image, 2)) {
                 fitscut_message (1, "creating a green channel from mean of red and blue\n");
                 mean_green = 1;
         }
 
         line_len = Image->ncolsref * (bit_depth / 8) * Image->channels;
         line = (unsigned char *) calloc (line_len, 1);
+        /* one row of bytes per channel, left 0 for missing channels */
+        plane = (unsigned char *) calloc (line_len, 1);
+        if (line == NULL || plane == NULL)
+                fitscut_error ("out of memory allocating JPEG/PNG row buffer");
         for (row = Image->nrowsref - 1; row >= 0; row--) {
                 for (k = 0; k < Image->channels; k++) {
-                        if (Image->data[k] == NULL)
+                        float *arrayp;
+
+                        if (! image_has_channel (Image, k))
                                 continue;
-                        scale_row_linear (Image->data[k] + row * Image->ncols[k],
-                                              line, k,
-                                              Image->channels, Image->ncols[k],
-                                              scale[k], datamin[k], datamax[k],
-                                              clip_val, Image->output_invert);
+                        arrayp = image_row (Image, k, row, Image->ncols[k]);
+                        if (Image->transfer[k] != NULL)
+                                transfer_row (Image->transfer[k], arrayp,
+                                              plane + k * Image->ncolsref, 0, 1,
+                                              Image->ncols[k]);
+                        else
+                                quantize[k] (arrayp, plane + k * Image->ncolsref,
+                                             Image->ncols[k], scale[k], datamin[k],
+                                             clip_val);
                 }
+                interleave_planes (plane, Image->channels, Image->ncolsref, line);
                 if (mean_green == 1) {
                         create_mean_green (line, Image->ncolsref);
                 }
@@ -286,6 +409,7 @@ write_rgb_image (GraphicsInfo *info, FitsCutImage *Image)
                         png_write_line(info, line);
                 }
         }
+        free (plane);
         free (line);
 }
 
@@ -298,12 +422,15 @@ write_simple_image (GraphicsInfo *info, FitsCutImage *Image)
         int row;
         double datamin, datamax, clip_val;
         unsigned char *line;
+        QuantizeRow quantize;
+        float *arrayp;
 
         clip_val = pow(2.0,bit_depth) - 1;
 
         switch (Image->output_scale_mode) {
         case SCALE_MODE_AUTO:
         case SCALE_MODE_FULL:
+        case SCALE_MODE_ZSCALE:
                 datamin = Image->autoscale_min[0];
                 datamax = Image->autoscale_max[0];
                 break;
@@ -330,15 +457,20 @@ write_simple_image (GraphicsInfo *info, FitsCutImage *Image)
 
         fitscut_message (2, "\tdata min: %f max: %f clip: %f scale: %f\n",
                          datamin, datamax, clip_val, scale);
+        if (Image->transfer[0] != NULL)
+                transfer_set_output (Image->transfer[0], scale, datamin, datamax,
+                                     clip_val, Image->output_invert);
+        quantize = select_quantize_row (datamin, datamax, clip_val, Image->output_invert);
 
         if ((line = (unsigned char *) malloc (Image->ncolsref * bit_depth / 8)) == NULL)
                 fitscut_error ("out of memory allocating JPEG/PNG row buffer");
 
         for (row = Image->nrowsref-1; row >= 0; row--) {
-                scale_row_linear (Image->data[0] + row * Image->ncolsref,
-                                      line, 0, 1, Image->ncolsref, scale,
-                                      datamin, datamax, clip_val,
-                                      Image->output_invert);
+                arrayp = image_row (Image, 0, row, Image->ncolsref);
+                if (Image->transfer[0] != NULL)
+                        transfer_row (Image->transfer[0], arrayp, line, 0, 1, Image->ncolsref);
+                else
+                        quantize (arrayp, line, Image->ncolsref, scale, datamin, clip_val);
                 if (usejpeg) {
                         jpg_write_line(info, line);
                 } else {
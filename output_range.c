@@ -76,6 +76,7 @@ int write_range(FitsCutImage *Image)
 	switch (Image->output_scale_mode) {
 	case SCALE_MODE_AUTO:
 	case SCALE_MODE_FULL:
+	case SCALE_MODE_ZSCALE:
 			datamin = Image->autoscale_min;
 			datamax = Image->autoscale_max;
 			/* check for user overrides */
@@ -41,6 +41,10 @@
 #include <ctype.h>
 #include <math.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef  HAVE_STRING_H
 #include <string.h>
 #else
@@ -55,6 +59,7 @@
 
 #include "fitscut.h"
 #include "resize.h"
+#include "threads.h"
 
 #ifdef DMALLOC
 #include <dmalloc.h>
@@ -113,11 +118,35 @@ int maxsize;
 	}
 }
 
+/*
+ * Get the size and zoom factor that scale the longer side of the image to
+ * exactly output_size.  Returns the length of that side.
+ */
+int
+get_exact_zoom_size (int ncols, int nrows, int output_size,
+		int *zoomcols, int *zoomrows, double *zoom_factor)
+{
+	if (ncols > nrows) {
+		*zoomcols = output_size;
+		*zoom_factor = ((double) output_size)/ncols;
+		*zoomrows = lround(*zoom_factor*nrows);
+		if (*zoomrows<1) *zoomrows = 1;
+		return ncols;
+	} else {
+		*zoomrows = output_size;
+		*zoom_factor = ((double) output_size)/nrows;
+		*zoomcols = lround(*zoom_factor*ncols);
+		if (*zoomcols<1) *zoomcols = 1;
+		return nrows;
+	}
+}
+
 void
 exact_resize_image_channel (FitsCutImage *srcImagePtr, int k, int output_size)
 {
-	FitsCutImage destImage;
-	int orig_width, orig_height, maxsize;
+	float *data, *shrunk;
+	int width, height, orig_width, orig_height, maxsize;
+	double zoom_factor;
 
 	orig_width = srcImagePtr->ncols[k];
 	orig_height = srcImagePtr->nrows[k];
@@ -126,14 +155,33 @@ exact_resize_image_channel (FitsCutImage *srcImagePtr, int k, int output_size)
 	/* we're done if size matches */
 	if (maxsize == output_size) return;
 
-	/* use simple interpolation to get desired size */
-	interpolate_image (srcImagePtr, &destImage, k, output_size);
-	free (srcImagePtr->data[k]);
-	srcImagePtr->data[k] = destImage.data[k];
-	destImage.data[k] = NULL;
-	srcImagePtr->ncols[k] = destImage.ncols[k];
-	srcImagePtr->nrows[k] = destImage.nrows[k];
-	srcImagePtr->output_zoom[k] = destImage.output_zoom[k];
+	get_exact_zoom_size (orig_width, orig_height, output_size, &width, &height, &zoom_factor);
+
+	fitscut_message (2, "\tresizing channel to x=%d y=%d from x=%d y=%d\n",
+			 width, height, orig_width, orig_height);
+
+	/* area-weighted resampling, in place when the image shrinks */
+	data = srcImagePtr->data[k];
+	if ((long) width * height > (long) orig_width * orig_height) {
+		data = (float *) realloc (data, (size_t) width * height * sizeof (float));
+		if (data == NULL) {
+			fitscut_message (0, "Unable to allocate memory for %d x %d image\n",
+					 width, height);
+			do_exit (1);
+		}
+	}
+	area_resize_array (data, data, orig_width, orig_height, width, height,
+			   zoom_factor, srcImagePtr->bad_data_value[k]);
+	if ((long) width * height < (long) orig_width * orig_height) {
+		/* give back the rest; keep the block if that fails */
+		shrunk = (float *) realloc (data, (size_t) width * height * sizeof (float));
+		if (shrunk != NULL) data = shrunk;
+	}
+
+	srcImagePtr->data[k] = data;
+	srcImagePtr->ncols[k] = width;
+	srcImagePtr->nrows[k] = height;
+	srcImagePtr->output_zoom[k] = zoom_factor * srcImagePtr->output_zoom[k];
 }
 
 /* modify reference header parameters for exact-resize scaling */
@@ -149,19 +197,8 @@ exact_resize_reference (FitsCutImage *Image, int output_size)
 	orig_zoom = Image->output_zoomref;
 	if (orig_zoom == 0) orig_zoom = 1.0;
 
-	if (orig_width > orig_height) {
-		maxsize = orig_width;
-		width = output_size;
-		zoom_factor = ((double) width)/orig_width;
-		height = lround(zoom_factor*orig_height);
-		if (height<1) height = 1;
-	} else {
-		maxsize = orig_height;
-		height = output_size;
-		zoom_factor = ((double) height)/orig_height;
-		width = lround(zoom_factor*orig_width);
-		if (width<1) width = 1;
-	}
+	maxsize = get_exact_zoom_size (orig_width, orig_height, output_size,
+				       &width, &height, &zoom_factor);
 
 	/* we're done if size matches */
 	if (maxsize == output_size) return;
@@ -171,50 +208,176 @@ exact_resize_reference (FitsCutImage *Image, int output_size)
 	Image->nrowsref = height;
 }
 
-void
-reduce_array (float *input, float *output, int orig_width, int orig_height, int pixfac, float bad_data_value)
-{
-	float *src;
-	float *dest;
-	int width, height;
-	int x, y, i, j, jmin, jmax;
-	int *count;
+/* below this many input pixels reduce_array does not start threads */
+#define REDUCE_PARALLEL_MIN (1<<18)
 
-	width = (orig_width-1)/pixfac + 1;
-	if (width<1) width = 1;
-	height = (orig_height-1)/pixfac + 1;
-	if (height<1) height = 1;
+typedef struct {
+	float *input, *output;
+	int orig_width, orig_height, width, height, pixfac;
+	float bad_data_value;
+	long rows_per_piece;
+} ReduceWork;
 
-	count = (int *) malloc (width * sizeof (int));
-
-	for (y=0; y<height; y++) {
-		dest = output + y*width;
-		for (x=0; x<width; x++) {
-			dest[x] = 0.0;
-			count[x] = 0;
-		}
-		jmin = pixfac*y;
-		jmax = jmin + pixfac;
-		if (jmax > orig_height) jmax = orig_height;
-		for (j=jmin; j<jmax; j++) {
+/*
+ * Mean of the good pixels in the block of each output pixel from column
+ * x0 on.  Each sum is accumulated row by row, left to right, in single
+ * precision, so every path gives bit-for-bit the same result.
+ */
+static void
+reduce_row_scalar (const float *input, float *dest, int orig_width, int nrows,
+		   int pixfac, int x0, int width, float bad_data_value)
+{
+	const float *src;
+	float sum;
+	int x, i, j, imin, imax, count;
+
+	for (x=x0; x<width; x++) {
+		imin = x*pixfac;
+		imax = MIN (imin+pixfac, orig_width);
+		sum = 0.0;
+		count = 0;
+		for (j=0; j<nrows; j++) {
 			src = input + j*orig_width;
-			for (i=0; i<orig_width; i++) {
+			for (i=imin; i<imax; i++) {
 				/* ignore bad-value and NaN pixels, which are missing data */
 				if (src[i] != bad_data_value && isfinite(src[i])) {
-					dest[i/pixfac] += src[i];
-					count[i/pixfac] += 1;
+					sum += src[i];
+					count += 1;
 				}
 			}
 		}
-		for (x=0; x<width; x++) {
-			if (count[x] > 0) {
-				dest[x] /= count[x];
-			} else {
-				dest[x] = NAN;
+		dest[x] = (count > 0) ? sum / count : NAN;
+	}
+}
+
+#ifdef __SSE2__
+/*
+ * Add the good lanes of v to sum and count them.  Bad lanes add +0.0,
+ * which leaves a sum that started at +0.0 unchanged.
+ */
+#define REDUCE_ADD(v) do {						\
+	__m128 ok_ = _mm_and_ps (_mm_cmpneq_ps ((v), bad),		\
+				 _mm_cmplt_ps (_mm_and_ps ((v), absmask), inf)); \
+	sum = _mm_add_ps (sum, _mm_and_ps ((v), ok_));			\
+	count = _mm_add_ps (count, _mm_and_ps (one, ok_));		\
+} while (0)
+
+/*
+ * Four output pixels at a time for pixfac 2, 4 and 8: the columns of
+ * each block are shuffled into lanes so that each lane adds its pixels in
+ * the same order as reduce_row_scalar.  Returns the number of output
+ * pixels done.
+ */
+static int
+reduce_row_sse2 (const float *input, float *dest, int orig_width, int nrows,
+		 int pixfac, float bad_data_value)
+{
+	const float *src;
+	__m128 v0, v1, v2, v3, sum, count, ok, mean;
+	const __m128 bad = _mm_set1_ps (bad_data_value);
+	const __m128 absmask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+	const __m128 inf = _mm_set1_ps (INFINITY);
+	const __m128 one = _mm_set1_ps (1.0f);
+	const __m128 nan = _mm_set1_ps (NAN);
+	int x, j, c;
+
+	if (pixfac != 2 && pixfac != 4 && pixfac != 8)
+		return 0;
+
+	for (x=0; (x+4)*pixfac <= orig_width; x += 4) {
+		sum = _mm_setzero_ps ();
+		count = _mm_setzero_ps ();
+		for (j=0; j<nrows; j++) {
+			src = input + j*orig_width + x*pixfac;
+			switch (pixfac) {
+			case 2:
+				v0 = _mm_loadu_ps (src);
+				v1 = _mm_loadu_ps (src+4);
+				/* even and odd columns */
+				v2 = _mm_shuffle_ps (v0, v1, _MM_SHUFFLE (2,0,2,0));
+				v3 = _mm_shuffle_ps (v0, v1, _MM_SHUFFLE (3,1,3,1));
+				REDUCE_ADD (v2);
+				REDUCE_ADD (v3);
+				break;
+			case 4:
+			case 8:
+				for (c=0; c<pixfac; c += 4) {
+					v0 = _mm_loadu_ps (src + c);
+					v1 = _mm_loadu_ps (src + pixfac + c);
+					v2 = _mm_loadu_ps (src + 2*pixfac + c);
+					v3 = _mm_loadu_ps (src + 3*pixfac + c);
+					/* lane m of vn is now column c+n of output pixel x+m */
+					_MM_TRANSPOSE4_PS (v0, v1, v2, v3);
+					REDUCE_ADD (v0);
+					REDUCE_ADD (v1);
+					REDUCE_ADD (v2);
+					REDUCE_ADD (v3);
+				}
+				break;
 			}
 		}
+		/* NaN where no pixel was good */
+		mean = _mm_div_ps (sum, count);
+		ok = _mm_cmpgt_ps (count, _mm_setzero_ps ());
+		mean = _mm_or_ps (_mm_and_ps (ok, mean), _mm_andnot_ps (ok, nan));
+		_mm_storeu_ps (dest + x, mean);
+	}
+	return x;
+}
+#endif /* __SSE2__ */
+
+/* bin one piece of the output rows */
+static void
+reduce_task (void *arg, int piece)
+{
+	ReduceWork *w = (ReduceWork *) arg;
+	int x, y, ymin, ymax, jmin, nrows;
+	float *src, *dest;
+
+	ymin = piece * w->rows_per_piece;
+	ymax = MIN (ymin + w->rows_per_piece, w->height);
+	for (y=ymin; y<ymax; y++) {
+		dest = w->output + y*w->width;
+		jmin = w->pixfac*y;
+		nrows = MIN (w->pixfac, w->orig_height - jmin);
+		src = w->input + jmin*w->orig_width;
+		x = 0;
+#ifdef __SSE2__
+		x = reduce_row_sse2 (src, dest, w->orig_width, nrows, w->pixfac,
+				     w->bad_data_value);
+#endif
+		reduce_row_scalar (src, dest, w->orig_width, nrows, w->pixfac,
+				   x, w->width, w->bad_data_value);
 	}
-	free(count);
+}
+
+/*
+ * Bin input by pixfac, averaging the good pixels of each block.  Output
+ * rows are shared out between the worker threads for large arrays.
+ */
+void
+reduce_array (float *input, float *output, int orig_width, int orig_height, int pixfac, float bad_data_value)
+{
+	ReduceWork w;
+	int npieces;
+
+	w.input = input;
+	w.output = output;
+	w.orig_width = orig_width;
+	w.orig_height = orig_height;
+	w.pixfac = pixfac;
+	w.bad_data_value = bad_data_value;
+	w.width = (orig_width-1)/pixfac + 1;
+	if (w.width<1) w.width = 1;
+	w.height = (orig_height-1)/pixfac + 1;
+	if (w.height<1) w.height = 1;
+
+	npieces = 1;
+	if ((long) orig_width * orig_height >= REDUCE_PARALLEL_MIN)
+		npieces = 4 * threads_get_count ();
+	npieces = threads_split (w.height, npieces, &w.rows_per_piece);
+
+	threads_parallel_for (npieces, reduce_task, &w);
 }
 
 void
@@ -239,75 +402,365 @@ enlarge_array (float *input, float *output, int orig_width, int orig_height, int
 	}
 }
 
-void
-interpolate_image (FitsCutImage *srcImagePtr,
-                   FitsCutImage *destImagePtr, 
-                   int k, int output_size)
+/* below this many input pixels the area resampling does not start threads */
+#define AREA_PARALLEL_MIN (1<<18)
+
+/*
+ * The input pixels under each output pixel along one axis.  Output pixel
+ * o covers [o/zoom, (o+1)/zoom) in input pixels, and input pixel first[o]+t
+ * is weighted by its overlap weight[o*maxtaps+t] with that interval, for
+ * t < ntaps[o].
+ */
+typedef struct {
+	int *first, *ntaps;
+	float *weight;
+	int maxtaps;
+} AreaAxis;
+
+/* input rows row0 .. row0+nrows-1 being added into the output */
+typedef struct {
+	const float *input;	/* row row0 of the input */
+	float *output;
+	float *weight;		/* output weight totals, NULL to finish each row */
+	float *sum, *wsum;	/* nrows x width horizontal pass */
+	float *wacc;		/* a row of weight totals per piece, with no weight */
+	int orig_width, orig_height, width, height;
+	int row0, nrows;
+	int ymin, ymax;		/* output rows the input rows fall in */
+	float bad_data_value;
+	AreaAxis xaxis, yaxis;
+	int npieces;
+	long rows_per_piece;
+} AreaWork;
+
+/* a resampling fed a block of input rows at a time, see area_resampler_new */
+struct area_resampler {
+	AreaWork w;
+	float *buffer;
+	size_t buffer_len;
+};
+
+/* the horizontal pass of area_resize_array, kept for the rest of the cutout */
+THREADS_MUTEX (area_lock);
+static float *area_buffer = NULL;
+static size_t area_buffer_len = 0;
+
+static void
+area_axis_init (AreaAxis *a, int orig, int size, double zoom_factor)
 {
-	float *src1;
-	float *dest;
-	int width, height, orig_width, orig_height;
-	int x, y, i, j;
-	double zoom_factor, u, v;
-	/* variables for linear interpolation */
-	/*
-	**	float *src2;
-	**	double wti1, wti2, wtj1, wtj2, zoom_factor, u, v;
-	*/
+	double lo, hi;
+	int o, i, t, imax;
+
+	a->maxtaps = (int) ceil (1.0/zoom_factor) + 1;
+	a->first = (int *) malloc (size * sizeof (int));
+	a->ntaps = (int *) malloc (size * sizeof (int));
+	a->weight = (float *) malloc ((size_t) size * a->maxtaps * sizeof (float));
+
+	for (o=0; o<size; o++) {
+		lo = o/zoom_factor;
+		hi = MIN ((o+1)/zoom_factor, orig);
+		i = (int) floor (lo);
+		imax = (int) ceil (hi);
+		if (i > orig-1) i = orig-1;
+		if (imax > orig) imax = orig;
+		a->first[o] = i;
+		t = 0;
+		for (; i<imax && t<a->maxtaps; i++) {
+			a->weight[o*a->maxtaps + t++] = MIN (hi, i+1) - MAX (lo, i);
+		}
+		if (t == 0) {
+			/* past the end after rounding the size: repeat the last pixel */
+			a->weight[o*a->maxtaps + t++] = 1.0;
+		}
+		a->ntaps[o] = t;
+	}
+}
 
-	orig_width = srcImagePtr->ncols[k];
-	orig_height = srcImagePtr->nrows[k];
-	if (orig_width > orig_height) {
-		width = output_size;
-		zoom_factor = ((double) width)/orig_width;
-		height = lround(zoom_factor*orig_height);
-		if (height<1) height = 1;
-	} else {
-		height = output_size;
-		zoom_factor = ((double) height)/orig_height;
-		width = lround(zoom_factor*orig_width);
-		if (width<1) width = 1;
+static void
+area_axis_free (AreaAxis *a)
+{
+	free (a->first);
+	free (a->ntaps);
+	free (a->weight);
+}
+
+static void
+area_work_init (AreaWork *w, int orig_width, int orig_height, int width, int height,
+		double zoom_factor, float bad_data_value)
+{
+	w->orig_width = orig_width;
+	w->orig_height = orig_height;
+	w->width = width;
+	w->height = height;
+	w->bad_data_value = bad_data_value;
+	area_axis_init (&w->xaxis, orig_width, width, zoom_factor);
+	area_axis_init (&w->yaxis, orig_height, height, zoom_factor);
+	w->npieces = 1;
+	if ((long) orig_width * orig_height >= AREA_PARALLEL_MIN)
+		w->npieces = 4 * threads_get_count ();
+}
+
+/* weighted sums of the good pixels of one piece of the input rows */
+static void
+area_row_task (void *arg, int piece)
+{
+	AreaWork *w = (AreaWork *) arg;
+	const AreaAxis *a = &w->xaxis;
+	const float *src, *wt;
+	float *sum, *wsum, s, ws, v;
+	int x, t, j, jmin, jmax;
+
+	jmin = piece * w->rows_per_piece;
+	jmax = MIN (jmin + w->rows_per_piece, w->nrows);
+	for (j=jmin; j<jmax; j++) {
+		sum = w->sum + (size_t) j*w->width;
+		wsum = w->wsum + (size_t) j*w->width;
+		for (x=0; x<w->width; x++) {
+			src = w->input + (size_t) j*w->orig_width + a->first[x];
+			wt = a->weight + x*a->maxtaps;
+			s = ws = 0;
+			for (t=0; t<a->ntaps[x]; t++) {
+				v = src[t];
+				if (v != w->bad_data_value && isfinite (v)) {
+					s += wt[t]*v;
+					ws += wt[t];
+				}
+			}
+			sum[x] = s;
+			wsum[x] = ws;
+		}
 	}
+}
 
-	destImagePtr->output_zoom[k] = zoom_factor * srcImagePtr->output_zoom[k];
-	destImagePtr->ncols[k] = width;
-	destImagePtr->nrows[k] = height;
-	destImagePtr->data[k] = (float *) malloc (width * height * sizeof (float));
+/* add the row sums into one piece of the output rows */
+static void
+area_column_task (void *arg, int piece)
+{
+	AreaWork *w = (AreaWork *) arg;
+	const AreaAxis *a = &w->yaxis;
+	const float *sum, *wsum;
+	float *dest, *wacc, wt;
+	int x, y, t, tmin, tmax, ymin, ymax;
+
+	ymin = w->ymin + piece * w->rows_per_piece;
+	ymax = MIN (ymin + w->rows_per_piece, w->ymax);
+	wacc = w->wacc + (size_t) piece*w->width;
+	for (y=ymin; y<ymax; y++) {
+		dest = w->output + (size_t) y*w->width;
+		if (w->weight == NULL) {
+			for (x=0; x<w->width; x++)
+				dest[x] = wacc[x] = 0;
+		} else {
+			wacc = w->weight + (size_t) y*w->width;
+		}
+		/* the taps of this row among the input rows given */
+		tmin = MAX (0, w->row0 - a->first[y]);
+		tmax = MIN (a->ntaps[y], w->row0 + w->nrows - a->first[y]);
+		for (t=tmin; t<tmax; t++) {
+			sum = w->sum + (size_t) (a->first[y]+t-w->row0)*w->width;
+			wsum = w->wsum + (size_t) (a->first[y]+t-w->row0)*w->width;
+			wt = a->weight[y*a->maxtaps + t];
+			x = 0;
+#ifdef __SSE2__
+			{
+				const __m128 vwt = _mm_set1_ps (wt);
+
+				for (; x+4<=w->width; x += 4) {
+					_mm_storeu_ps (dest+x, _mm_add_ps (_mm_loadu_ps (dest+x),
+						_mm_mul_ps (vwt, _mm_loadu_ps (sum+x))));
+					_mm_storeu_ps (wacc+x, _mm_add_ps (_mm_loadu_ps (wacc+x),
+						_mm_mul_ps (vwt, _mm_loadu_ps (wsum+x))));
+				}
+			}
+#endif
+			for (; x<w->width; x++) {
+				dest[x] += wt*sum[x];
+				wacc[x] += wt*wsum[x];
+			}
+		}
+		if (w->weight == NULL) {
+			/* NaN where no pixel was good */
+			for (x=0; x<w->width; x++)
+				dest[x] = (wacc[x] > 0) ? dest[x]/wacc[x] : NAN;
+		}
+	}
+}
 
-	fitscut_message (2, "\tresizing channel to x=%d y=%d from x=%d y=%d\n",
-					 width, height, orig_width, orig_height);
-
-	/* nearest neighbor interpolation */
-	for (y=0; y<height; y++) {
-		v = (y+0.5)/zoom_factor - 0.5;
-		j = lround(v);
-		dest = destImagePtr->data[k] + y*width;
-		src1 = srcImagePtr->data[k] + j*orig_width;
-		for (x=0; x<width; x++) {
-			u = (x+0.5)/zoom_factor - 0.5;
-			i = lround(u);
-			dest[x] = src1[i];
+/*
+ * Sum nrows input rows from row0 into w->sum and w->wsum, then add them
+ * into the output rows they fall in.  Returns a cfitsio status,
+ * MEMORY_ALLOCATION if out of memory.
+ */
+static int
+area_add_rows (AreaWork *w, const float *input, int row0, int nrows)
+{
+	const AreaAxis *a = &w->yaxis;
+	int npieces;
+
+	w->input = input;
+	w->row0 = row0;
+	w->nrows = nrows;
+
+	npieces = threads_split (nrows, w->npieces, &w->rows_per_piece);
+	threads_parallel_for (npieces, area_row_task, w);
+
+	/* output rows from the first ending after row0 to the last starting before the end */
+	w->ymin = MIN (w->height-1, (int) (row0 * (double) w->height / w->orig_height));
+	while (w->ymin > 0 && a->first[w->ymin-1] + a->ntaps[w->ymin-1] > row0)
+		w->ymin--;
+	while (w->ymin < w->height && a->first[w->ymin] + a->ntaps[w->ymin] <= row0)
+		w->ymin++;
+	for (w->ymax = w->ymin; w->ymax < w->height && a->first[w->ymax] < row0 + nrows; w->ymax++)
+		;
+	if (w->ymax <= w->ymin)
+		return 0;
+
+	npieces = threads_split (w->ymax - w->ymin, w->npieces, &w->rows_per_piece);
+	/* the pieces' scratch rows, allocated here rather than in the workers */
+	w->wacc = NULL;
+	if (w->weight == NULL) {
+		w->wacc = (float *) malloc ((size_t) npieces * w->width * sizeof (float));
+		if (w->wacc == NULL) {
+			fitscut_message (0, "Unable to allocate memory for %d x %d resize weights\n",
+					 w->width, npieces);
+			return MEMORY_ALLOCATION;
 		}
 	}
+	threads_parallel_for (npieces, area_column_task, w);
+	free (w->wacc);
+	w->wacc = NULL;
+	return 0;
+}
 
-	/* linear interpolation (would need bad pixel checks for this) */
-/***
-	for (y=0; y<height; y++) {
-		v = (y+0.5)/zoom_factor - 0.5;
-		j = (int) v;
-		wtj2 = v-j;
-		wtj1 = 1.0-wtj2;
-		dest = destImagePtr->data[k] + y*width;
-		src1 = srcImagePtr->data[k] + j*orig_width;
-		src2 = src1 + orig_width;
-		for (x=0; x<width; x++) {
-			u = (x+0.5)/zoom_factor - 0.5;
-			i = (int) u;
-			wti2 = u-i;
-			wti1 = 1.0-wti2;
-			dest[x] = wtj1*(wti1*src1[i]+wti2*src1[i+1]) + wtj2*(wti1*src2[i]+wti2*src2[i+1]);
+/*
+ * Resample input to width x height by zoom_factor, averaging the good
+ * pixels under each output pixel weighted by their overlap with it.  This
+ * is done in two separable passes, so that a 2-D weighted mean comes from
+ * 1-D weights: rows are summed into a buffer, then the sums are combined
+ * down the columns.  Both passes are shared out between the worker threads
+ * for large arrays.  The input is all read before output is written, so
+ * output may be input if it has room for width x height pixels.
+ */
+void
+area_resize_array (float *input, float *output, int orig_width, int orig_height,
+		   int width, int height, double zoom_factor, float bad_data_value)
+{
+	AreaWork w;
+	size_t len;
+	int status;
+
+	area_work_init (&w, orig_width, orig_height, width, height, zoom_factor, bad_data_value);
+	w.output = output;
+	w.weight = NULL;
+
+	threads_lock (area_lock);
+	len = 2 * (size_t) orig_height * width;
+	if (len > area_buffer_len) {
+		free (area_buffer);
+		area_buffer = (float *) malloc (len * sizeof (float));
+		if (area_buffer == NULL) {
+			area_buffer_len = 0;
+			threads_unlock (area_lock);
+			fitscut_message (0, "Unable to allocate memory for %d x %d resize buffer\n",
+					 width, orig_height);
+			do_exit (1);
 		}
+		area_buffer_len = len;
 	}
-***/
+	w.sum = area_buffer;
+	w.wsum = area_buffer + (size_t) orig_height * width;
+	status = area_add_rows (&w, input, 0, orig_height);
+	threads_unlock (area_lock);
+
+	area_axis_free (&w.xaxis);
+	area_axis_free (&w.yaxis);
+	if (status)
+		do_exit (1);
+}
+
+/* give back the buffer kept by area_resize_array, at the end of a cutout */
+void
+area_resize_release (void)
+{
+	threads_lock (area_lock);
+	free (area_buffer);
+	area_buffer = NULL;
+	area_buffer_len = 0;
+	threads_unlock (area_lock);
+}
 
+/*
+ * Start the same resampling as area_resize_array into output, for input
+ * that comes a block of rows at a time through area_resampler_add_rows.
+ * Only the output and its weight totals are held, not the input.  May be
+ * called from a worker thread, so returns NULL if out of memory.
+ */
+AreaResampler *
+area_resampler_new (float *output, int orig_width, int orig_height,
+		    int width, int height, double zoom_factor, float bad_data_value)
+{
+	AreaResampler *ar;
+	size_t i, n;
+
+	ar = (AreaResampler *) calloc (1, sizeof (AreaResampler));
+	n = (size_t) width * height;
+	if (ar != NULL)
+		ar->w.weight = (float *) malloc (n * sizeof (float));
+	if (ar == NULL || ar->w.weight == NULL) {
+		fitscut_message (0, "Unable to allocate memory for %d x %d resize weights\n",
+				 width, height);
+		free (ar);
+		return NULL;
+	}
+	area_work_init (&ar->w, orig_width, orig_height, width, height, zoom_factor, bad_data_value);
+	ar->w.output = output;
+	for (i=0; i<n; i++)
+		output[i] = ar->w.weight[i] = 0;
+	return ar;
+}
+
+/*
+ * Add input rows row0 .. row0+nrows-1, in any order but each just once.
+ * Returns a cfitsio status, MEMORY_ALLOCATION if out of memory.
+ */
+int
+area_resampler_add_rows (AreaResampler *ar, const float *input, int row0, int nrows)
+{
+	size_t len;
+
+	if (row0 < 0 || nrows <= 0 || row0 + nrows > ar->w.orig_height)
+		return 0;
+	len = 2 * (size_t) nrows * ar->w.width;
+	if (len > ar->buffer_len) {
+		free (ar->buffer);
+		ar->buffer = (float *) malloc (len * sizeof (float));
+		if (ar->buffer == NULL) {
+			fitscut_message (0, "Unable to allocate memory for %d x %d resize buffer\n",
+					 ar->w.width, nrows);
+			ar->buffer_len = 0;
+			return MEMORY_ALLOCATION;
+		}
+		ar->buffer_len = len;
+	}
+	ar->w.sum = ar->buffer;
+	ar->w.wsum = ar->buffer + (size_t) nrows * ar->w.width;
+	return area_add_rows (&ar->w, input, row0, nrows);
+}
+
+/* divide out the weights, NaN where no pixel was good, and free ar */
+void
+area_resampler_finish (AreaResampler *ar)
+{
+	size_t i, n;
+
+	if (ar == NULL)
+		return;
+	n = (size_t) ar->w.width * ar->w.height;
+	for (i=0; i<n; i++)
+		ar->w.output[i] = (ar->w.weight[i] > 0) ? ar->w.output[i]/ar->w.weight[i] : NAN;
+	area_axis_free (&ar->w.xaxis);
+	area_axis_free (&ar->w.yaxis);
+	free (ar->w.weight);
+	free (ar->buffer);
+	free (ar);
 }
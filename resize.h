@@ -20,9 +20,17 @@
 
 void exact_resize_image_channel (FitsCutImage *, int, int);
 void exact_resize_reference (FitsCutImage *, int);
-void interpolate_image (FitsCutImage *, FitsCutImage *, int, int);
 
+int get_exact_zoom_size (int ncols, int nrows, int output_size,
+	   int *zoomcols, int *zoomrows, double *zoom_factor);
 void get_zoom_size_channel (int ncols, int nrows, float zoom_factor, int output_size,
 	   int *pixfac, int *zoomcols, int *zoomrows, int *doshrink);
 void reduce_array (float *input, float *output, int orig_width, int orig_height, int pixfac, float bad_data_value);
 void enlarge_array (float *input, float *output, int orig_width, int orig_height, int pixfac);
+void area_resize_array (float *input, float *output, int orig_width, int orig_height,
+			int width, int height, double zoom_factor, float bad_data_value);
+void area_resize_release (void);
+AreaResampler *area_resampler_new (float *output, int orig_width, int orig_height,
+			int width, int height, double zoom_factor, float bad_data_value);
+int area_resampler_add_rows (AreaResampler *ar, const float *input, int row0, int nrows);
+void area_resampler_finish (AreaResampler *ar);
@@ -0,0 +1,352 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * On-disk cache of --full-scale statistics (--scale-cache)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * --full-scale samples the same rows of an image for every cutout so
+ * that tiles match.  With --scale-cache the result is kept in a
+ * directory, in two files named after a hash of a key line made from
+ * everything the sample depends on: the file (real path, extension,
+ * HDU, mtime and size), the data quality and bad pixel settings, BSOFTEN
+ * handling, the number of pixels sampled and whether rows or blocks
+ * were sampled.
+ *
+ *   HASH.sample  the cleaned-up sample itself, so that any percentiles
+ *                can be worked out without reading the image again
+ *   HASH.scale   one line per set of percentiles already worked out,
+ *                with the resulting scale
+ *
+ * Both start with the key line, which is checked on reading.  Sample
+ * files are written under a temporary name and renamed into place, and
+ * scale lines are appended whole, so cutouts made side by side can
+ * share a cache directory.  Any trouble with the cache just means the
+ * image is sampled as usual.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#ifdef  HAVE_STRING_H
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#ifdef HAVE_CFITSIO_FITSIO_H
+#include <cfitsio/fitsio.h>
+#else
+#include <fitsio.h>
+#endif
+
+#include "fitscut.h"
+#include <libwcs/wcs.h>
+#include "input_cache.h"
+#include "scale_cache.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+#define SCALE_CACHE_MAGIC "FITSCUT-SAMPLE 1"
+/* longest line in a cache file */
+#define SCALE_CACHE_LINE (4*FLEN_FILENAME)
+
+struct scale_cache {
+        char *key;
+        char *sample_path;
+        char *scale_path;
+        int scale_found;        /* the scale file exists with our key */
+};
+
+/* 64-bit FNV-1a */
+static uint64_t
+scale_cache_hash (const char *s)
+{
+        uint64_t h = UINT64_C (14695981039346656037);
+
+        while (*s) {
+                h ^= (unsigned char) *s++;
+                h *= UINT64_C (1099511628211);
+        }
+        return h;
+}
+
+/* read a line, without its newline; FALSE at the end or if it is too long */
+static int
+scale_cache_line (FILE *fp, char *line)
+{
+        size_t len;
+
+        if (fgets (line, SCALE_CACHE_LINE, fp) == NULL)
+                return FALSE;
+        len = strlen (line);
+        if (len == 0 || line[len-1] != '\n')
+                return FALSE;
+        line[len-1] = '\0';
+        return TRUE;
+}
+
+/*
+ * Set up the cache for sampling channel k of Image.  Returns NULL when
+ * there is no cache directory or the input is not a plain disk file.
+ */
+ScaleCache *
+scale_cache_open (FitsCutImage *Image, int k, FitsCutInput *input, int nsample,
+                  const char *sampler)
+{
+        ScaleCache *cache;
+        char rootname[FLEN_FILENAME];
+        char key[SCALE_CACHE_LINE];
+        char *realname;
+        int hdu, status = 0;
+        uint64_t h;
+        size_t len;
+
+        if (Image->scale_cache_dir == NULL || input->mtime == 0)
+                return NULL;
+        if (fits_parse_rootname (input->filename, rootname, &status))
+                return NULL;
+        fits_get_hdu_num (input->fptr, &hdu);
+
+        realname = realpath (rootname, NULL);
+        snprintf (key, sizeof (key),
+                  "%s %s hdu=%d mtime=%ld size=%ld qext=%d,%d,%d qmask=%d badpix=%d badvalue=%.9g bsoften=%d nsample=%d sampler=%s",
+                  realname ? realname : rootname, input->filename, hdu,
+                  (long) input->mtime, (long) input->size,
+                  Image->qext_set, Image->qext[k], Image->qext_bad_value[k], Image->qext_mask,
+                  Image->useBadpix, Image->bad_data_value[k], Image->useBsoften, nsample, sampler);
+        free (realname);
+        if (strchr (key, '\n') != NULL || strlen (key) >= sizeof (key) - 1)
+                return NULL;
+
+        /* make the directory the first time it is used */
+        if (mkdir (Image->scale_cache_dir, 0777) != 0 && errno != EEXIST) {
+                fitscut_message (1, "\tCannot create scale cache %s\n", Image->scale_cache_dir);
+                return NULL;
+        }
+
+        cache = (ScaleCache *) malloc (sizeof (ScaleCache));
+        cache->key = strdup (key);
+        h = scale_cache_hash (key);
+        len = strlen (Image->scale_cache_dir) + 32;
+        cache->sample_path = (char *) malloc (len);
+        cache->scale_path = (char *) malloc (len);
+        snprintf (cache->sample_path, len, "%s/%016" PRIx64 ".sample", Image->scale_cache_dir, h);
+        snprintf (cache->scale_path, len, "%s/%016" PRIx64 ".scale", Image->scale_cache_dir, h);
+        cache->scale_found = FALSE;
+        fitscut_message (3, "\tScale cache key %s\n", key);
+        return cache;
+}
+
+/*
+ * Look for the scale worked out before with the current percentiles.
+ * Returns TRUE and sets the scale of channel k if there is one.
+ */
+int
+scale_cache_get_scale (ScaleCache *cache, FitsCutImage *Image, int k)
+{
+        FILE *fp;
+        char line[SCALE_CACHE_LINE];
+        int exact, found = FALSE;
+        double low, high, dmin, dmax, amin, amax;
+        float badvalue, badmin, badmax;
+
+        if (cache == NULL)
+                return FALSE;
+        fp = fopen (cache->scale_path, "r");
+        if (fp == NULL)
+                return FALSE;
+        if (scale_cache_line (fp, line) && strcmp (line, cache->key) == 0) {
+                cache->scale_found = TRUE;
+                while (!found && scale_cache_line (fp, line)) {
+                        if (sscanf (line, "%d %lf %lf %lf %lf %lf %lf %f %f %f",
+                                    &exact, &low, &high, &dmin, &dmax, &amin, &amax,
+                                    &badvalue, &badmin, &badmax) != 10)
+                                continue;
+                        if (exact != Image->autoscale_exact ||
+                            low != Image->autoscale_percent_low[k] ||
+                            high != Image->autoscale_percent_high[k])
+                                continue;
+                        Image->data_min[k] = dmin;
+                        Image->data_max[k] = dmax;
+                        Image->autoscale_min[k] = amin;
+                        Image->autoscale_max[k] = amax;
+                        Image->bad_data_value[k] = badvalue;
+                        Image->badmin[k] = badmin;
+                        Image->badmax[k] = badmax;
+                        found = TRUE;
+                }
+        }
+        fclose (fp);
+        if (found)
+                fitscut_message (1, "Using cached full scale for channel %d min: %f max: %f\n",
+                                 k, Image->autoscale_min[k], Image->autoscale_max[k]);
+        return found;
+}
+
+/*
+ * Read the cached sample, setting the sample min/max of channel k.
+ * Returns NULL if there is none.
+ */
+float *
+scale_cache_get_sample (ScaleCache *cache, FitsCutImage *Image, int k, long *npix)
+{
+        FILE *fp;
+        char line[SCALE_CACHE_LINE];
+        float *arrayp = NULL;
+        long n;
+        double dmin, dmax;
+        float badvalue, badmin, badmax;
+
+        if (cache == NULL)
+                return NULL;
+        fp = fopen (cache->sample_path, "rb");
+        if (fp == NULL)
+                return NULL;
+        if (scale_cache_line (fp, line) && strcmp (line, SCALE_CACHE_MAGIC) == 0 &&
+            scale_cache_line (fp, line) && strcmp (line, cache->key) == 0 &&
+            scale_cache_line (fp, line) &&
+            sscanf (line, "%ld %lf %lf %f %f %f", &n, &dmin, &dmax, &badvalue, &badmin, &badmax) == 6 &&
+            n > 0) {
+                arrayp = (float *) malloc (sizeof (float) * n);
+                if (fread (arrayp, sizeof (float), n, fp) != (size_t) n) {
+                        free (arrayp);
+                        arrayp = NULL;
+                }
+        }
+        fclose (fp);
+        if (arrayp == NULL)
+                return NULL;
+
+        fitscut_message (1, "Using cached sample of %ld pixels for channel %d\n", n, k);
+        Image->data_min[k] = dmin;
+        Image->data_max[k] = dmax;
+        Image->bad_data_value[k] = badvalue;
+        Image->badmin[k] = badmin;
+        Image->badmax[k] = badmax;
+        *npix = n;
+        return arrayp;
+}
+
+/* open a temporary file next to path, to be renamed over it */
+static FILE *
+scale_cache_create (const char *path, char **tmppath)
+{
+        size_t len = strlen (path) + 32;
+
+        *tmppath = (char *) malloc (len);
+        snprintf (*tmppath, len, "%s.%ld", path, (long) getpid ());
+        return fopen (*tmppath, "wb");
+}
+
+static void
+scale_cache_commit (FILE *fp, const char *path, char *tmppath, int ok)
+{
+        if (fclose (fp) != 0)
+                ok = FALSE;
+        if (!ok || rename (tmppath, path) != 0) {
+                fitscut_message (1, "\tCannot write scale cache file %s\n", path);
+                unlink (tmppath);
+        }
+        free (tmppath);
+}
+
+/* save the sample of channel k, along with its min/max */
+void
+scale_cache_put_sample (ScaleCache *cache, FitsCutImage *Image, int k, float *arrayp, long npix)
+{
+        FILE *fp;
+        char *tmppath;
+        int ok;
+
+        if (cache == NULL)
+                return;
+        fp = scale_cache_create (cache->sample_path, &tmppath);
+        if (fp == NULL) {
+                free (tmppath);
+                return;
+        }
+        ok = fprintf (fp, "%s\n%s\n%ld %.17g %.17g %.9g %.9g %.9g\n", SCALE_CACHE_MAGIC, cache->key,
+                      npix, Image->data_min[k], Image->data_max[k],
+                      Image->bad_data_value[k], Image->badmin[k], Image->badmax[k]) > 0;
+        ok = ok && fwrite (arrayp, sizeof (float), npix, fp) == (size_t) npix;
+        scale_cache_commit (fp, cache->sample_path, tmppath, ok);
+}
+
+/* add the scale just worked out for channel k */
+void
+scale_cache_put_scale (ScaleCache *cache, FitsCutImage *Image, int k)
+{
+        FILE *fp;
+        char *tmppath = NULL;
+        char line[SCALE_CACHE_LINE];
+
+        if (cache == NULL)
+                return;
+        snprintf (line, sizeof (line), "%d %.17g %.17g %.17g %.17g %.17g %.17g %.9g %.9g %.9g\n",
+                  Image->autoscale_exact,
+                  Image->autoscale_percent_low[k], Image->autoscale_percent_high[k],
+                  Image->data_min[k], Image->data_max[k],
+                  Image->autoscale_min[k], Image->autoscale_max[k],
+                  Image->bad_data_value[k], Image->badmin[k], Image->badmax[k]);
+
+        if (cache->scale_found) {
+                /* one short write, so lines from other processes don't mix */
+                fp = fopen (cache->scale_path, "a");
+                if (fp == NULL)
+                        return;
+                fputs (line, fp);
+                fclose (fp);
+        } else {
+                fp = scale_cache_create (cache->scale_path, &tmppath);
+                if (fp == NULL) {
+                        free (tmppath);
+                        return;
+                }
+                scale_cache_commit (fp, cache->scale_path, tmppath,
+                                    fprintf (fp, "%s\n%s", cache->key, line) > 0);
+        }
+}
+
+void
+scale_cache_close (ScaleCache *cache)
+{
+        if (cache == NULL)
+                return;
+        free (cache->key);
+        free (cache->sample_path);
+        free (cache->scale_path);
+        free (cache);
+}
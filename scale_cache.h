@@ -0,0 +1,27 @@
+/* declarations for scale_cache.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+typedef struct scale_cache ScaleCache;
+
+ScaleCache *scale_cache_open       (FitsCutImage *Image, int k, FitsCutInput *input, int nsample,
+                                    const char *sampler);
+int         scale_cache_get_scale  (ScaleCache *cache, FitsCutImage *Image, int k);
+float      *scale_cache_get_sample (ScaleCache *cache, FitsCutImage *Image, int k, long *npix);
+void        scale_cache_put_sample (ScaleCache *cache, FitsCutImage *Image, int k,
+                                    float *arrayp, long npix);
+void        scale_cache_put_scale  (ScaleCache *cache, FitsCutImage *Image, int k);
+void        scale_cache_close      (ScaleCache *cache);
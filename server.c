@@ -0,0 +1,244 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Serve cutout requests over a local UNIX domain socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Protocol: a client connects and sends one line holding the arguments
+ * it would give on the command line (without the program name and
+ * without an output file; requests naming one, or using --scale-cache,
+ * --batch or --server, are refused).  Arguments are separated by white space and
+ * may be enclosed in double quotes.  The server writes the FITS, PNG,
+ * JPEG or JSON output back on the connection and closes it.  A request
+ * that fails is closed without any output; the reason is reported on
+ * the server's stderr.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#ifdef  HAVE_STRING_H
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#if defined (HAVE_SYS_SOCKET_H) && defined (HAVE_SYS_UN_H)
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+#include "fitscut.h"
+#include "server.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+extern char *progname;
+
+#ifdef HAVE_UNIX_SOCKETS
+
+/*
+ * Read one request line from the client
+ */
+static int
+read_request (int fd, char *buf, int len)
+{
+        int n = 0;
+        ssize_t nread;
+
+        while (n < len - 1) {
+                nread = read (fd, buf + n, len - 1 - n);
+                if (nread < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return ERROR;
+                }
+                if (nread == 0)
+                        break;
+                n += nread;
+                if (memchr (buf + n - nread, '\n', nread) != NULL)
+                        break;
+        }
+        buf[n] = '\0';
+        if (n == len - 1 && strchr (buf, '\n') == NULL) {
+                fitscut_message (0, "%s: request too long\n", progname);
+                return ERROR;
+        }
+        return OK;
+}
+
+/*
+ * Split the request line into an argument vector in place
+ */
+static int
+split_request (char *buf, char *argv[], int maxargs)
+{
+        char *src = buf, *dst;
+        int argc = 1;
+
+        argv[0] = progname;
+        for (;;) {
+                while (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n')
+                        src++;
+                if (*src == '\0')
+                        break;
+                if (argc >= maxargs - 1) {
+                        fitscut_message (0, "%s: too many arguments in request\n", progname);
+                        return -1;
+                }
+                argv[argc++] = dst = src;
+                while (*src != '\0' && *src != ' ' && *src != '\t' &&
+                       *src != '\r' && *src != '\n') {
+                        if (*src == '"') {
+                                src++;
+                                while (*src != '\0' && *src != '"')
+                                        *dst++ = *src++;
+                                if (*src == '"')
+                                        src++;
+                        } else {
+                                *dst++ = *src++;
+                        }
+                }
+                if (*src != '\0')
+                        src++;
+                *dst = '\0';
+        }
+        argv[argc] = NULL;
+        return argc;
+}
+
+static int
+open_socket (char *socket_path)
+{
+        struct sockaddr_un addr;
+        struct stat st;
+        int sock;
+
+        if (strlen (socket_path) >= sizeof (addr.sun_path)) {
+                fitscut_message (0, "%s: socket path too long: %s\n", progname, socket_path);
+                return -1;
+        }
+
+        if ((sock = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+                perror (progname);
+                return -1;
+        }
+
+        memset (&addr, 0, sizeof (addr));
+        addr.sun_family = AF_UNIX;
+        strcpy (addr.sun_path, socket_path);
+
+        /* remove a socket left behind by an earlier server, but nothing else */
+        if (lstat (socket_path, &st) == 0) {
+                if (! S_ISSOCK (st.st_mode)) {
+                        fitscut_message (0, "%s: %s exists and is not a socket\n",
+                                         progname, socket_path);
+                        close (sock);
+                        return -1;
+                }
+                unlink (socket_path);
+        }
+        if (bind (sock, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+            listen (sock, 16) < 0) {
+                perror (socket_path);
+                close (sock);
+                return -1;
+        }
+        return sock;
+}
+
+/*
+ * Accept connections forever, passing each request to handler with the
+ * connection as its stdout
+ */
+int
+server_run (char *socket_path, ServerHandler handler)
+{
+        char request[SERVER_MAX_REQUEST];
+        char *argv[SERVER_MAX_ARGS];
+        int sock, fd, saved_stdout, argc;
+
+        if ((sock = open_socket (socket_path)) < 0)
+                return ERROR;
+
+        /* a client that hangs up early must not kill the server */
+        (void) signal (SIGPIPE, SIG_IGN);
+
+        if ((saved_stdout = dup (fileno (stdout))) < 0) {
+                perror (progname);
+                return ERROR;
+        }
+
+        fitscut_message (1, "Listening on %s\n", socket_path);
+
+        for (;;) {
+                if ((fd = accept (sock, NULL, NULL)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror (progname);
+                        break;
+                }
+
+                if (read_request (fd, request, sizeof (request)) == OK &&
+                    (argc = split_request (request, argv, SERVER_MAX_ARGS)) > 1) {
+                        fitscut_message (2, "Request with %d arguments\n", argc - 1);
+
+                        fflush (stdout);
+                        dup2 (fd, fileno (stdout));
+                        handler (argc, argv);
+                        fflush (stdout);
+                        clearerr (stdout);
+                        dup2 (saved_stdout, fileno (stdout));
+                }
+                close (fd);
+        }
+
+        close (sock);
+        unlink (socket_path);
+        return ERROR;
+}
+
+#else /* ! HAVE_UNIX_SOCKETS */
+
+int
+server_run (char *socket_path, ServerHandler handler)
+{
+        fitscut_message (0, "%s: server mode needs UNIX domain sockets\n", progname);
+        return ERROR;
+}
+
+#endif /* HAVE_UNIX_SOCKETS */
@@ -0,0 +1,24 @@
+/* declarations for server.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* longest request line and most arguments accepted in one request */
+#define SERVER_MAX_REQUEST 8192
+#define SERVER_MAX_ARGS    128
+
+typedef int (*ServerHandler) (int argc, char *argv[]);
+
+int server_run (char *socket_path, ServerHandler handler);
@@ -0,0 +1,833 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Pixel statistics for scaling
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * stats_scan gets min, max, sum and count of the valid (finite, not
+ * bad) pixels in one pass.  The inner loop is masked rather than
+ * branched, with AVX2 and SSE2 versions; AVX2 is used when the processor
+ * has it, whatever the compiler flags.  Large arrays are cut into fixed
+ * pieces shared out between the worker threads, and the pieces are
+ * combined in order so the sum does not depend on the thread count.
+ *
+ * A StatsHist is the histogram autoscaling works from.  It is built
+ * with the same bins as compute_histogram, and stays around so that
+ * autoscale can narrow its range instead of starting over.  The first
+ * narrowing uses the histogram to size a copy of just the pixels inside
+ * the new range (the bins are monotonic in the pixel value, so the bins
+ * covering the range bound how many there can be); every later one
+ * works on that copy, which only shrinks.  Pixels left out are counted
+ * into the end bins exactly as a pass over the whole array would, so
+ * the histograms are the same as before, without the extra full passes.
+ * Large arrays are histogrammed by the worker threads, each into its own
+ * integer counts, which are added together at the end.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef  HAVE_STRING_H
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#include <math.h>
+#include <float.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STATS_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#include "fitscut.h"
+#include "stats.h"
+#include "threads.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+/* pixels per piece of a threaded scan */
+#define STATS_PIECE (1<<16)
+/* don't use threads for arrays smaller than this */
+#define STATS_PARALLEL_MIN (1<<18)
+/* pixels added up in single precision before going into the double sum */
+#define STATS_BLOCK 1024
+
+typedef struct {
+        float *arrayp;
+        long npix;
+        float bad_data_value;
+        PixelStats *piece;
+} StatsWork;
+
+/*
+ * malloc for the calling thread, never a piece task, giving up on the
+ * cutout if there is no memory
+ */
+static void *
+stats_alloc (size_t size, const char *what)
+{
+        void *ptr;
+
+        ptr = malloc (size);
+        if (ptr == NULL) {
+                fitscut_message (0, "Unable to allocate memory for %s\n", what);
+                do_exit (1);
+        }
+        return ptr;
+}
+
+static int stats_use_avx2 = 0;
+THREADS_ONCE (stats_cpu_once);
+
+/* probe the cpu once; the scan pieces run on worker threads */
+static void
+stats_cpu_init (void)
+{
+#ifdef STATS_AVX2
+        stats_use_avx2 = __builtin_cpu_supports ("avx2") ? 1 : 0;
+#endif
+}
+
+/* fold the scalar tail of an array into stats */
+static void
+stats_scan_scalar (const float *arrayp, long n, float bad_data_value, PixelStats *stats)
+{
+        long i, count;
+        float val, vmin, vmax;
+        double sum;
+
+        vmin = stats->min;
+        vmax = stats->max;
+        sum = 0.0;
+        count = 0;
+        for (i = 0; i < n; i++) {
+                val = arrayp[i];
+                if (finite (val) && val != bad_data_value) {
+                        if (val < vmin) vmin = val;
+                        if (val > vmax) vmax = val;
+                        sum += val;
+                        count++;
+                }
+        }
+        stats->min = vmin;
+        stats->max = vmax;
+        stats->sum += sum;
+        stats->count += count;
+}
+
+#ifdef STATS_AVX2
+/*
+ * Eight pixels at a time.  Bad lanes are replaced by FLT_MAX/-FLT_MAX
+ * for the min/max and by +0.0 for the sum.  Returns the number of
+ * pixels done.
+ */
+__attribute__ ((target ("avx2")))
+static long
+stats_scan_avx2 (const float *arrayp, long n, float bad_data_value, PixelStats *stats)
+{
+        const __m256 bad = _mm256_set1_ps (bad_data_value);
+        const __m256 absmask = _mm256_castsi256_ps (_mm256_set1_epi32 (0x7fffffff));
+        const __m256 inf = _mm256_set1_ps (INFINITY);
+        const __m256 big = _mm256_set1_ps (FLT_MAX);
+        const __m256 nbig = _mm256_set1_ps (-FLT_MAX);
+        __m256 v, ok, sum, vmin, vmax;
+        __m256i count;
+        float lane[8], lane2[8];
+        int lanei[8];
+        long i, iend, done;
+        int m;
+
+        done = n & ~7L;
+        vmin = big;
+        vmax = nbig;
+        for (i = 0; i < done; i = iend) {
+                iend = MIN (i + STATS_BLOCK, done);
+                sum = _mm256_setzero_ps ();
+                count = _mm256_setzero_si256 ();
+                for (; i < iend; i += 8) {
+                        v = _mm256_loadu_ps (arrayp + i);
+                        ok = _mm256_and_ps (_mm256_cmp_ps (v, bad, _CMP_NEQ_UQ),
+                                            _mm256_cmp_ps (_mm256_and_ps (v, absmask), inf, _CMP_LT_OQ));
+                        vmin = _mm256_min_ps (vmin, _mm256_blendv_ps (big, v, ok));
+                        vmax = _mm256_max_ps (vmax, _mm256_blendv_ps (nbig, v, ok));
+                        sum = _mm256_add_ps (sum, _mm256_and_ps (v, ok));
+                        /* true lanes are -1 */
+                        count = _mm256_sub_epi32 (count, _mm256_castps_si256 (ok));
+                }
+                _mm256_storeu_ps (lane, sum);
+                _mm256_storeu_si256 ((__m256i *) lanei, count);
+                for (m = 0; m < 8; m++) {
+                        stats->sum += lane[m];
+                        stats->count += lanei[m];
+                }
+        }
+        _mm256_storeu_ps (lane, vmin);
+        _mm256_storeu_ps (lane2, vmax);
+        for (m = 0; m < 8; m++) {
+                if (lane[m] < stats->min) stats->min = lane[m];
+                if (lane2[m] > stats->max) stats->max = lane2[m];
+        }
+        return done;
+}
+#endif /* STATS_AVX2 */
+
+#ifdef __SSE2__
+/* as stats_scan_avx2, four pixels at a time */
+static long
+stats_scan_sse2 (const float *arrayp, long n, float bad_data_value, PixelStats *stats)
+{
+        const __m128 bad = _mm_set1_ps (bad_data_value);
+        const __m128 absmask = _mm_castsi128_ps (_mm_set1_epi32 (0x7fffffff));
+        const __m128 inf = _mm_set1_ps (INFINITY);
+        const __m128 big = _mm_set1_ps (FLT_MAX);
+        const __m128 nbig = _mm_set1_ps (-FLT_MAX);
+        __m128 v, ok, sum, vmin, vmax;
+        __m128i count;
+        float lane[4], lane2[4];
+        int lanei[4];
+        long i, iend, done;
+        int m;
+
+        done = n & ~3L;
+        vmin = big;
+        vmax = nbig;
+        for (i = 0; i < done; i = iend) {
+                iend = MIN (i + STATS_BLOCK, done);
+                sum = _mm_setzero_ps ();
+                count = _mm_setzero_si128 ();
+                for (; i < iend; i += 4) {
+                        v = _mm_loadu_ps (arrayp + i);
+                        ok = _mm_and_ps (_mm_cmpneq_ps (v, bad),
+                                         _mm_cmplt_ps (_mm_and_ps (v, absmask), inf));
+                        vmin = _mm_min_ps (vmin, _mm_or_ps (_mm_and_ps (ok, v), _mm_andnot_ps (ok, big)));
+                        vmax = _mm_max_ps (vmax, _mm_or_ps (_mm_and_ps (ok, v), _mm_andnot_ps (ok, nbig)));
+                        sum = _mm_add_ps (sum, _mm_and_ps (v, ok));
+                        count = _mm_sub_epi32 (count, _mm_castps_si128 (ok));
+                }
+                _mm_storeu_ps (lane, sum);
+                _mm_storeu_si128 ((__m128i *) lanei, count);
+                for (m = 0; m < 4; m++) {
+                        stats->sum += lane[m];
+                        stats->count += lanei[m];
+                }
+        }
+        _mm_storeu_ps (lane, vmin);
+        _mm_storeu_ps (lane2, vmax);
+        for (m = 0; m < 4; m++) {
+                if (lane[m] < stats->min) stats->min = lane[m];
+                if (lane2[m] > stats->max) stats->max = lane2[m];
+        }
+        return done;
+}
+#endif /* __SSE2__ */
+
+/* scan n pixels into stats, which starts out empty */
+static void
+stats_scan_piece (const float *arrayp, long n, float bad_data_value, PixelStats *stats)
+{
+        long done = 0;
+
+        stats->min = FLT_MAX;
+        stats->max = -FLT_MAX;
+        stats->sum = 0.0;
+        stats->count = 0;
+#ifdef STATS_AVX2
+        if (stats_use_avx2)
+                done = stats_scan_avx2 (arrayp, n, bad_data_value, stats);
+#endif
+#ifdef __SSE2__
+        if (done == 0)
+                done = stats_scan_sse2 (arrayp, n, bad_data_value, stats);
+#endif
+        stats_scan_scalar (arrayp + done, n - done, bad_data_value, stats);
+}
+
+static void
+stats_scan_task (void *arg, int piece)
+{
+        StatsWork *w = (StatsWork *) arg;
+        long start = (long) piece * STATS_PIECE;
+
+        stats_scan_piece (w->arrayp + start, MIN (STATS_PIECE, w->npix - start),
+                          w->bad_data_value, &w->piece[piece]);
+}
+
+void
+stats_scan (float *arrayp, long npix, float bad_data_value, PixelStats *stats)
+{
+        StatsWork w;
+        int npieces, i;
+
+        threads_once (stats_cpu_once, stats_cpu_init);
+
+        if (npix < STATS_PARALLEL_MIN) {
+                stats_scan_piece (arrayp, npix, bad_data_value, stats);
+        } else {
+                w.arrayp = arrayp;
+                w.npix = npix;
+                w.bad_data_value = bad_data_value;
+                npieces = (npix + STATS_PIECE - 1) / STATS_PIECE;
+                w.piece = (PixelStats *) stats_alloc (sizeof (PixelStats) * npieces, "pixel statistics");
+                threads_parallel_for (npieces, stats_scan_task, &w);
+
+                *stats = w.piece[0];
+                for (i = 1; i < npieces; i++) {
+                        if (w.piece[i].min < stats->min) stats->min = w.piece[i].min;
+                        if (w.piece[i].max > stats->max) stats->max = w.piece[i].max;
+                        stats->sum += w.piece[i].sum;
+                        stats->count += w.piece[i].count;
+                }
+                free (w.piece);
+        }
+        if (stats->count == 0) {
+                /* apparently the entire section is blank, use zeros for limits */
+                stats->min = 0.0;
+                stats->max = 0.0;
+        }
+}
+
+/* histogram bin of value for the current range */
+static double
+stats_hist_bin (StatsHist *sh, double value)
+{
+        double binsize = (sh->dmax - sh->dmin) / (sh->length - 1);
+
+        return ceil ((value - sh->dmin) / binsize);
+}
+
+typedef struct {
+        float *values;
+        long n, piece;          /* pixels, and pixels per piece */
+        double dmin, dmax, binsize;
+        float bad_data_value;
+        int length;
+        long *counts;           /* length+1 per piece */
+        long *pixcount;
+        float *fmin, *fmax;
+} StatsHistWork;
+
+/* count one piece of the values into its own histogram */
+static void
+stats_hist_task (void *arg, int piece)
+{
+        StatsHistWork *w = (StatsHistWork *) arg;
+        double dmin = w->dmin;
+        double dmax = w->dmax;
+        double binsize = w->binsize;
+        float bad_data_value = w->bad_data_value;
+        int length = w->length;
+        long *counts = w->counts + (long) piece * (length + 1);
+        long i, ind, start, end, lpixcount;
+        float value, fmin, fmax;
+
+        for (i = 0; i <= length; i++)
+                counts[i] = 0;
+
+        start = piece * w->piece;
+        end = MIN (start + w->piece, w->n);
+        lpixcount = 0;
+        fmin = FLT_MAX;
+        fmax = -FLT_MAX;
+        for (i = start; i < end; i++) {
+                value = w->values[i];
+                /* exclude blanked values */
+                if (finite (value) && value != bad_data_value) {
+                        if (value < dmin) {
+                                ind = 0;
+                        } else if (value > dmax) {
+                                ind = length-1;
+                        } else {
+                                /* a single-valued range has nothing to divide */
+                                ind = (binsize > 0) ? ceil ((value-dmin) / binsize) : 0;
+                                if (value > fmax) fmax = value;
+                                if (value < fmin) fmin = value;
+                        }
+                        counts[ind]++;
+                        lpixcount++;
+                }
+        }
+        w->pixcount[piece] = lpixcount;
+        w->fmin[piece] = fmin;
+        w->fmax[piece] = fmax;
+}
+
+/*
+ * histogram n values into sh over its current range; large arrays are
+ * shared out between the worker threads, each counting into its own
+ * histogram, and the counts are added up after
+ */
+static void
+stats_hist_fill (StatsHist *sh, float *values, long n)
+{
+        StatsHistWork w;
+        int length = sh->length;
+        int npieces, i;
+        long j, lpixcount, *counts;
+        long pixcount1;
+        float fmin, fmax, fmin1, fmax1;
+
+        w.values = values;
+        w.n = n;
+        w.dmin = sh->dmin;
+        w.dmax = sh->dmax;
+        w.binsize = (sh->dmax - sh->dmin) / (length - 1);
+        w.bad_data_value = sh->bad_data_value;
+        w.length = length;
+        fitscut_message (4, "\tdmax: %lf dmin: %lf length: %d binsize: %lf npix: %ld...\n",
+                         w.dmax, w.dmin, length, w.binsize, n);
+
+        npieces = 1;
+        if (n >= STATS_PARALLEL_MIN)
+                npieces = threads_get_count ();
+        w.piece = (n + npieces - 1) / npieces;
+        if (w.piece < 1)
+                w.piece = 1;
+
+        /* piece 0 counts straight into sh->counts */
+        if (npieces == 1) {
+                w.counts = sh->counts;
+                w.pixcount = &pixcount1;
+                w.fmin = &fmin1;
+                w.fmax = &fmax1;
+                stats_hist_task (&w, 0);
+        } else {
+                w.counts = (long *) stats_alloc (sizeof (long) * (length + 1) * npieces, "histogram");
+                w.pixcount = (long *) stats_alloc (sizeof (long) * npieces, "histogram");
+                w.fmin = (float *) stats_alloc (sizeof (float) * npieces, "histogram");
+                w.fmax = (float *) stats_alloc (sizeof (float) * npieces, "histogram");
+                threads_parallel_for (npieces, stats_hist_task, &w);
+        }
+
+        counts = sh->counts;
+        lpixcount = w.pixcount[0];
+        fmin = w.fmin[0];
+        fmax = w.fmax[0];
+        if (npieces > 1) {
+                for (j = 0; j <= length; j++)
+                        counts[j] = w.counts[j];
+                for (i = 1; i < npieces; i++) {
+                        long *pc = w.counts + (long) i * (length + 1);
+
+                        for (j = 0; j <= length; j++)
+                                counts[j] += pc[j];
+                        lpixcount += w.pixcount[i];
+                        if (w.fmin[i] < fmin) fmin = w.fmin[i];
+                        if (w.fmax[i] > fmax) fmax = w.fmax[i];
+                }
+                free (w.counts);
+                free (w.pixcount);
+                free (w.fmin);
+                free (w.fmax);
+        }
+
+        counts[0] += sh->nbelow;
+        counts[length-1] += sh->nabove;
+        for (j = 0; j <= length; j++)
+                sh->hist[j] = counts[j];
+
+        sh->pixcount = lpixcount + sh->nbelow + sh->nabove;
+        if (fmin > fmax) {
+                /* no pixels in bounds */
+                sh->inmin = 0.5*(sh->dmin+sh->dmax);
+                sh->inmax = sh->inmin;
+        } else {
+                sh->inmin = fmin;
+                sh->inmax = fmax;
+        }
+}
+
+/* keep the valid values within dmin..dmax, counting the rest */
+static long
+stats_hist_keep (StatsHist *sh, float *values, long n, float *subset, long nmax,
+                 double dmin, double dmax)
+{
+        float bad_data_value = sh->bad_data_value;
+        long i, nkeep;
+        float value;
+
+        nkeep = 0;
+        for (i = 0; i < n; i++) {
+                value = values[i];
+                if (!finite (value) || value == bad_data_value)
+                        continue;
+                if (value < dmin) {
+                        sh->nbelow++;
+                } else if (value > dmax) {
+                        sh->nabove++;
+                } else if (nkeep < nmax) {
+                        subset[nkeep++] = value;
+                }
+        }
+        return nkeep;
+}
+
+StatsHist *
+stats_hist_new (float *arrayp, long npix, float bad_data_value, int length,
+                double dmin, double dmax)
+{
+        StatsHist *sh;
+
+        fitscut_message (3, "\tbuilding histogram...\n");
+
+        sh = (StatsHist *) stats_alloc (sizeof (StatsHist), "histogram");
+        sh->length = length;
+        sh->dmin = dmin;
+        sh->dmax = dmax;
+        sh->hist = (float *) stats_alloc (sizeof (float) * (length + 1), "histogram");
+        sh->counts = (long *) stats_alloc (sizeof (long) * (length + 1), "histogram");
+        sh->arrayp = arrayp;
+        sh->npix = npix;
+        sh->bad_data_value = bad_data_value;
+        sh->subset = NULL;
+        sh->nsubset = 0;
+        sh->nbelow = 0;
+        sh->nabove = 0;
+
+        stats_hist_fill (sh, arrayp, npix);
+        return sh;
+}
+
+void
+stats_hist_refine (StatsHist *sh, double dmin, double dmax)
+{
+        long lo, hi, i, nmax;
+        double b;
+
+        fitscut_message (3, "\trefining histogram...\n");
+
+        if (dmin < sh->dmin || dmax > sh->dmax || !(sh->dmax > sh->dmin)) {
+                /* not inside the current range: start again from all the pixels */
+                free (sh->subset);
+                sh->subset = NULL;
+                sh->nsubset = 0;
+                sh->nbelow = 0;
+                sh->nabove = 0;
+                sh->dmin = dmin;
+                sh->dmax = dmax;
+                stats_hist_fill (sh, sh->arrayp, sh->npix);
+                return;
+        }
+
+        if (sh->subset == NULL) {
+                /* the bins covering the new range bound the pixels inside it */
+                lo = 0;
+                hi = sh->length;
+                if (dmin <= dmax) {
+                        b = stats_hist_bin (sh, dmin);
+                        if (b > lo) lo = b;
+                        b = stats_hist_bin (sh, dmax);
+                        if (b < hi) hi = b;
+                }
+                for (i = lo, nmax = 0; i <= hi; i++)
+                        nmax += sh->counts[i];
+                fitscut_message (3, "\tkeeping at most %ld of %ld pixels\n", nmax, sh->pixcount);
+
+                sh->subset = (float *) stats_alloc (sizeof (float) * (nmax > 0 ? nmax : 1), "histogram subset");
+                sh->nsubset = stats_hist_keep (sh, sh->arrayp, sh->npix, sh->subset, nmax,
+                                               dmin, dmax);
+        } else {
+                sh->nsubset = stats_hist_keep (sh, sh->subset, sh->nsubset, sh->subset,
+                                               sh->nsubset, dmin, dmax);
+        }
+
+        sh->dmin = dmin;
+        sh->dmax = dmax;
+        stats_hist_fill (sh, sh->subset, sh->nsubset);
+}
+
+void
+stats_hist_free (StatsHist *sh)
+{
+        if (sh == NULL)
+                return;
+        free (sh->subset);
+        free (sh->counts);
+        free (sh->hist);
+        free (sh);
+}
+
+/*
+ * Exact order statistics.  stats_select_new copies the valid pixels
+ * out; stats_select_rank then finds the value of a given rank with a
+ * three-way quickselect (pivot the median of three, falling back to a
+ * sort if the partitions keep coming out lopsided).  Ranks already found
+ * stay in place and bound the search for the next one.  While the range
+ * being searched is large, the copy and the partitions are done by the
+ * worker threads: each piece counts where its pixels go, then they are
+ * all written out to a second buffer at once.
+ */
+
+/* ways of splitting a range of pixels between the worker threads */
+enum {
+        STATS_SPLIT_VALID,      /* keep the valid pixels */
+        STATS_SPLIT_PIVOT       /* below, equal to and above the pivot */
+};
+
+typedef struct {
+        int mode;
+        const float *src;
+        float *dst;
+        long n;
+        long piece;             /* pixels per piece */
+        float bad_data_value;
+        float pivot;
+        long *count;            /* 3 per piece, turned into output offsets */
+} StatsSplit;
+
+/* which part of the split a pixel goes to, -1 for none */
+static int
+stats_split_part (StatsSplit *w, float value)
+{
+        if (w->mode == STATS_SPLIT_VALID)
+                return (finite (value) && value != w->bad_data_value) ? 0 : -1;
+        if (value < w->pivot)
+                return 0;
+        return (value == w->pivot) ? 1 : 2;
+}
+
+static void
+stats_split_count (void *arg, int piece)
+{
+        StatsSplit *w = (StatsSplit *) arg;
+        long *count = w->count + 3*piece;
+        long i, start, end;
+        int c;
+
+        start = piece * w->piece;
+        end = MIN (start + w->piece, w->n);
+        count[0] = count[1] = count[2] = 0;
+        for (i = start; i < end; i++) {
+                c = stats_split_part (w, w->src[i]);
+                if (c >= 0)
+                        count[c]++;
+        }
+}
+
+static void
+stats_split_write (void *arg, int piece)
+{
+        StatsSplit *w = (StatsSplit *) arg;
+        long *offset = w->count + 3*piece;
+        long i, start, end;
+        int c;
+
+        start = piece * w->piece;
+        end = MIN (start + w->piece, w->n);
+        for (i = start; i < end; i++) {
+                c = stats_split_part (w, w->src[i]);
+                if (c >= 0)
+                        w->dst[offset[c]++] = w->src[i];
+        }
+}
+
+/*
+ * Split the n pixels of src into dst, in order of part.  Returns the
+ * number written; parts[] gets the size of each part.
+ */
+static long
+stats_split (StatsSplit *w, long parts[3])
+{
+        long total[3], next[3], t;
+        int npieces, i, c;
+
+        npieces = (w->n + STATS_PIECE - 1) / STATS_PIECE;
+        if (npieces < 1) npieces = 1;
+        w->piece = STATS_PIECE;
+        w->count = (long *) stats_alloc (sizeof (long) * 3 * npieces, "pixel split");
+        threads_parallel_for (npieces, stats_split_count, w);
+
+        total[0] = total[1] = total[2] = 0;
+        for (i = 0; i < npieces; i++)
+                for (c = 0; c < 3; c++)
+                        total[c] += w->count[3*i + c];
+        next[0] = 0;
+        next[1] = total[0];
+        next[2] = total[0] + total[1];
+        for (i = 0; i < npieces; i++) {
+                for (c = 0; c < 3; c++) {
+                        t = w->count[3*i + c];
+                        w->count[3*i + c] = next[c];
+                        next[c] += t;
+                }
+        }
+        threads_parallel_for (npieces, stats_split_write, w);
+        free (w->count);
+
+        for (c = 0; c < 3; c++)
+                parts[c] = total[c];
+        return total[0] + total[1] + total[2];
+}
+
+static int
+stats_float_cmp (const void *a, const void *b)
+{
+        float fa = *(const float *) a;
+        float fb = *(const float *) b;
+
+        return (fa > fb) - (fa < fb);
+}
+
+static float
+stats_median3 (float a, float b, float c)
+{
+        if (a > b) { float t = a; a = b; b = t; }
+        if (b > c) b = c;
+        return (a > b) ? a : b;
+}
+
+StatsSelect *
+stats_select_new (float *arrayp, long npix, float bad_data_value)
+{
+        StatsSelect *ss;
+        StatsSplit w;
+        long parts[3];
+
+        ss = (StatsSelect *) stats_alloc (sizeof (StatsSelect), "exact percentiles");
+        ss->values = (float *) stats_alloc (sizeof (float) * (npix > 0 ? npix : 1), "exact percentiles");
+        ss->scratch = NULL;
+        ss->nranks = 0;
+
+        if (npix < STATS_PARALLEL_MIN || threads_get_count () < 2) {
+                long i, n;
+                float value;
+
+                for (i = 0, n = 0; i < npix; i++) {
+                        value = arrayp[i];
+                        if (finite (value) && value != bad_data_value)
+                                ss->values[n++] = value;
+                }
+                ss->count = n;
+        } else {
+                w.mode = STATS_SPLIT_VALID;
+                w.src = arrayp;
+                w.dst = ss->values;
+                w.n = npix;
+                w.bad_data_value = bad_data_value;
+                ss->count = stats_split (&w, parts);
+        }
+        return ss;
+}
+
+float
+stats_select_rank (StatsSelect *ss, long rank)
+{
+        float *a = ss->values;
+        long lo, hi, lt, gt, i, depth, parts[3];
+        float pivot, t;
+        StatsSplit w;
+        int r;
+
+        if (ss->count == 0)
+                return 0.0;
+        if (rank < 0) rank = 0;
+        if (rank >= ss->count) rank = ss->count - 1;
+
+        /* ranks already in place bound the search */
+        lo = 0;
+        hi = ss->count;
+        for (r = 0; r < ss->nranks; r++) {
+                if (ss->ranks[r] == rank)
+                        return a[rank];
+                if (ss->ranks[r] < rank && ss->ranks[r] + 1 > lo)
+                        lo = ss->ranks[r] + 1;
+                if (ss->ranks[r] > rank && ss->ranks[r] < hi)
+                        hi = ss->ranks[r];
+        }
+
+        /* about twice the depth of a balanced search before giving up */
+        for (depth = 8, i = hi - lo; i > 1; i >>= 1)
+                depth += 2;
+
+        while (hi - lo > 1) {
+                if (depth-- == 0) {
+                        qsort (a + lo, hi - lo, sizeof (float), stats_float_cmp);
+                        break;
+                }
+                pivot = stats_median3 (a[lo], a[lo + (hi-lo)/2], a[hi-1]);
+
+                if (hi - lo >= STATS_PARALLEL_MIN && threads_get_count () > 1) {
+                        if (ss->scratch == NULL)
+                                ss->scratch = (float *) stats_alloc (sizeof (float) * ss->count, "exact percentiles");
+                        w.mode = STATS_SPLIT_PIVOT;
+                        w.src = a + lo;
+                        w.dst = ss->scratch + lo;
+                        w.n = hi - lo;
+                        w.pivot = pivot;
+                        stats_split (&w, parts);
+                        memcpy (a + lo, ss->scratch + lo, sizeof (float) * (hi - lo));
+                        lt = lo + parts[0];
+                        gt = lt + parts[1];
+                } else {
+                        /* a[lo..lt) < pivot, a[lt..gt) == pivot, a[gt..hi) > pivot */
+                        lt = lo;
+                        gt = hi;
+                        i = lo;
+                        while (i < gt) {
+                                if (a[i] < pivot) {
+                                        t = a[i]; a[i] = a[lt]; a[lt] = t;
+                                        lt++;
+                                        i++;
+                                } else if (a[i] > pivot) {
+                                        gt--;
+                                        t = a[i]; a[i] = a[gt]; a[gt] = t;
+                                } else {
+                                        i++;
+                                }
+                        }
+                }
+
+                if (rank < lt) {
+                        hi = lt;
+                } else if (rank >= gt) {
+                        lo = gt;
+                } else {
+                        /* the pivot run covers rank; make sure it's stored there */
+                        a[rank] = pivot;
+                        break;
+                }
+        }
+
+        if (ss->nranks < STATS_SELECT_RANKS)
+                ss->ranks[ss->nranks++] = rank;
+        return a[rank];
+}
+
+void
+stats_select_free (StatsSelect *ss)
+{
+        if (ss == NULL)
+                return;
+        free (ss->scratch);
+        free (ss->values);
+        free (ss);
+}
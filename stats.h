@@ -0,0 +1,62 @@
+/* declarations for stats.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* min/max/sum/count of the valid (finite, not bad) pixels of an array */
+typedef struct {
+        float min, max;         /* 0, 0 when there are no valid pixels */
+        double sum;
+        long count;
+} PixelStats;
+
+/* a histogram of an array that can be narrowed to a smaller range */
+typedef struct {
+        int length;             /* hist has length+1 bins, as compute_histogram */
+        double dmin, dmax;      /* current range */
+        float *hist;
+        long pixcount;          /* valid pixels, in range or not */
+        float inmin, inmax;     /* range of the valid pixels inside dmin..dmax */
+
+        float *arrayp;          /* the pixels */
+        long npix;
+        float bad_data_value;
+
+        float *subset;          /* pixels inside the range, once narrowed */
+        long nsubset;
+        long nbelow, nabove;    /* valid pixels dropped from subset */
+        long *counts;
+} StatsHist;
+
+/* most ranks remembered by a StatsSelect */
+#define STATS_SELECT_RANKS 8
+
+/* the valid pixels of an array, for finding exact percentiles */
+typedef struct {
+        float *values;
+        long count;
+        float *scratch;         /* for the threaded partitions */
+        long ranks[STATS_SELECT_RANKS]; /* ranks found, in place in values */
+        int nranks;
+} StatsSelect;
+
+void       stats_scan       (float *arrayp, long npix, float bad_data_value, PixelStats *stats);
+StatsHist *stats_hist_new   (float *arrayp, long npix, float bad_data_value, int length,
+                             double dmin, double dmax);
+void       stats_hist_refine (StatsHist *sh, double dmin, double dmax);
+void       stats_hist_free  (StatsHist *sh);
+StatsSelect *stats_select_new (float *arrayp, long npix, float bad_data_value);
+float      stats_select_rank (StatsSelect *ss, long rank);
+void       stats_select_free (StatsSelect *ss);
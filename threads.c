@@ -0,0 +1,249 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Worker threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * threads_parallel_for runs the n pieces of a task on up to --threads
+ * threads (the calling thread is one of them) and returns when all are
+ * done.  Pieces are handed out one at a time, so they need not take the
+ * same time.  The worker threads are started by threads_set_count and
+ * wait between tasks.  Tasks may be started from within the pieces of
+ * other tasks: the workers, never more than --threads in all, take
+ * pieces of whichever task was started last, so a nested task is shared
+ * out as the threads become free.  Without pthreads everything runs in
+ * the calling thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#include "fitscut.h"
+#include "threads.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+static int thread_count = 1;
+
+/*
+ * Number of processors online, the default for --threads
+ */
+int
+threads_default_count (void)
+{
+        long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+        n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+        if (n < 1)
+                n = 1;
+        if (n > THREADS_MAX)
+                n = THREADS_MAX;
+        return (int) n;
+}
+
+static void pool_resize (int nthreads);
+
+void
+threads_set_count (int nthreads)
+{
+        if (nthreads < 1)
+                nthreads = 1;
+        if (nthreads > THREADS_MAX)
+                nthreads = THREADS_MAX;
+        pool_resize (nthreads);
+}
+
+int
+threads_get_count (void)
+{
+        return thread_count;
+}
+
+/*
+ * Split n items into at most maxpieces pieces of equal size, but for the
+ * last.  Returns the number of pieces; *per_piece gets the items in each.
+ */
+int
+threads_split (long n, int maxpieces, long *per_piece)
+{
+        long npieces;
+
+        npieces = MIN (n, maxpieces);
+        if (npieces < 1)
+                npieces = 1;
+        *per_piece = (n + npieces - 1) / npieces;
+        if (*per_piece < 1)
+                *per_piece = 1;
+        return (int) ((n + *per_piece - 1) / *per_piece);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/* a task with pieces still to hand out is queued, newest first */
+typedef struct thread_work {
+        int next;               /* next piece to hand out */
+        int done;               /* pieces finished */
+        int n;
+        ThreadTask task;
+        void *arg;
+        struct thread_work *link;
+} ThreadWork;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast when a task is queued or the thread count changes */
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+/* broadcast when the last piece of a task is finished */
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static ThreadWork *queue = NULL;
+static int pool_size = 0;       /* worker threads started */
+
+/* hand out the next piece of work, dequeuing it after its last piece */
+static int
+take_piece (ThreadWork *work)
+{
+        ThreadWork **pp;
+        int i;
+
+        i = work->next++;
+        if (work->next == work->n) {
+                for (pp = &queue; *pp != work; pp = &(*pp)->link)
+                        ;
+                *pp = work->link;
+        }
+        return i;
+}
+
+/* run piece i of work, with pool_lock held except during the piece */
+static void
+run_piece (ThreadWork *work, int i)
+{
+        pthread_mutex_unlock (&pool_lock);
+        work->task (work->arg, i);
+        pthread_mutex_lock (&pool_lock);
+        if (++work->done == work->n)
+                pthread_cond_broadcast (&pool_done);
+}
+
+/*
+ * Run pieces of the most recently queued task for as long as the process
+ * lasts.  Workers beyond the first --threads - 1 wait until it is raised.
+ */
+static void *
+thread_worker (void *data)
+{
+        int index = (int) (long) data;
+        ThreadWork *work;
+
+        pthread_mutex_lock (&pool_lock);
+        for (;;) {
+                while (queue == NULL || index >= thread_count - 1)
+                        pthread_cond_wait (&pool_work, &pool_lock);
+                work = queue;
+                run_piece (work, take_piece (work));
+        }
+        return NULL;
+}
+
+/* start workers so that there are nthreads in all with the caller */
+static void
+pool_resize (int nthreads)
+{
+        pthread_t thread;
+
+        pthread_mutex_lock (&pool_lock);
+        while (pool_size < nthreads - 1) {
+                if (pthread_create (&thread, NULL, thread_worker, (void *) (long) pool_size) != 0) {
+                        fitscut_message (2, "\tcould only start %d worker threads\n", pool_size);
+                        nthreads = pool_size + 1;
+                        break;
+                }
+                pthread_detach (thread);
+                pool_size++;
+        }
+        thread_count = nthreads;
+        pthread_cond_broadcast (&pool_work);
+        pthread_mutex_unlock (&pool_lock);
+}
+
+void
+threads_parallel_for (int n, ThreadTask task, void *arg)
+{
+        ThreadWork work;
+        int i;
+
+        if (n <= 1 || thread_count <= 1) {
+                for (i = 0; i < n; i++)
+                        task (arg, i);
+                return;
+        }
+
+        work.next = 0;
+        work.done = 0;
+        work.n = n;
+        work.task = task;
+        work.arg = arg;
+
+        pthread_mutex_lock (&pool_lock);
+        work.link = queue;
+        queue = &work;
+        pthread_cond_broadcast (&pool_work);
+
+        /* the calling thread runs only pieces of its own task, as it may
+         * hold locks that the pieces of other tasks want */
+        while (work.next < work.n)
+                run_piece (&work, take_piece (&work));
+        while (work.done < work.n)
+                pthread_cond_wait (&pool_done, &pool_lock);
+        pthread_mutex_unlock (&pool_lock);
+}
+
+#else /* not HAVE_PTHREAD_H */
+
+static void
+pool_resize (int nthreads)
+{
+        thread_count = nthreads;
+}
+
+void
+threads_parallel_for (int n, ThreadTask task, void *arg)
+{
+        int i;
+
+        for (i = 0; i < n; i++)
+                task (arg, i);
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,45 @@
+/* declarations for threads.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* most worker threads used for one task (--threads) */
+#define THREADS_MAX 64
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+/* lock protecting state shared between worker threads */
+#define THREADS_MUTEX(name) static pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#define threads_lock(name)   pthread_mutex_lock (&(name))
+#define threads_unlock(name) pthread_mutex_unlock (&(name))
+/* run fn exactly once, whichever thread gets there first */
+#define THREADS_ONCE(name) static pthread_once_t name = PTHREAD_ONCE_INIT
+#define threads_once(name, fn) pthread_once (&(name), fn)
+#else
+#define THREADS_MUTEX(name) static int name = 0
+#define threads_lock(name)   ((void) (name))
+#define threads_unlock(name) ((void) (name))
+#define THREADS_ONCE(name) static int name = 0
+#define threads_once(name, fn) do { if (!(name)) { (name) = 1; fn (); } } while (0)
+#endif
+
+/* one piece of work: task (arg, i) for i = 0 .. n-1 */
+typedef void (*ThreadTask) (void *arg, int i);
+
+int  threads_default_count (void);
+void threads_set_count (int nthreads);
+int  threads_get_count (void);
+int  threads_split (long n, int maxpieces, long *per_piece);
+void threads_parallel_for (int n, ThreadTask task, void *arg);
@@ -0,0 +1,507 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Tile-aware reader for tile-compressed (fpack) images
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * cfitsio decompresses every tile that overlaps a read, so strided reads
+ * (the autoscale row sample) and reads in small row blocks (the shrink
+ * loop in extract_fits) decompress the same tiles many times.  Here each
+ * tile is read on its own, exactly once, into a cache holding up to
+ * TILE_CACHE_BYTES of decompressed tiles, and subsets are copied out of
+ * the cached tiles.
+ *
+ * Only 2-D images, or single planes of 3-D images with one plane per
+ * tile, are handled; anything else falls back to plain cfitsio reads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#ifdef  HAVE_STRING_H
+#include <string.h>
+#else
+#include <strings.h>
+#endif
+
+#ifdef HAVE_CFITSIO_FITSIO_H
+#include <cfitsio/fitsio.h>
+#else
+#include <fitsio.h>
+#endif
+
+#include "fitscut.h"
+#include "tile_reader.h"
+#include "threads.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+#define TILE_HASH_SIZE 4096
+
+/* tile layout of one image HDU */
+typedef struct tile_image {
+        fitsfile *fptr;
+        int hdunum;
+        int tiled;              /* false: leave the read to cfitsio */
+        long naxes[3];
+        long ztile[3];
+        struct tile_image *next;
+} TileImage;
+
+/* one decompressed tile */
+typedef struct tile {
+        TileImage *image;
+        int datatype;
+        int has_null;           /* nulval given, and its bits */
+        int null_bits;
+        long tx, ty, plane;
+        long nx, ny;            /* size of this tile, smaller at the image edges */
+        int anynul;
+        int *data;              /* TINT or TFLOAT, both 4 bytes */
+        size_t nbytes;
+        int loading;            /* being read, and not yet in the LRU list */
+        int users;              /* threads copying out of it, not to be evicted */
+        struct tile *hnext;
+        struct tile *prev, *next;  /* most recently used first */
+} Tile;
+
+static TileImage *image_list = NULL;
+static Tile *tile_hash[TILE_HASH_SIZE];
+static Tile *lru_head = NULL, *lru_tail = NULL;
+static size_t cache_bytes = 0;
+/* the cache is shared by the extraction threads; tiles are read without it */
+THREADS_MUTEX (cache_lock);
+
+#ifdef HAVE_PTHREAD_H
+/* broadcast whenever a tile has finished loading */
+static pthread_cond_t tile_loaded = PTHREAD_COND_INITIALIZER;
+
+/* serialise cfitsio calls on each open file, chosen by its FITSfile address */
+#define TILE_FILE_LOCKS 16
+static pthread_mutex_t file_lock[TILE_FILE_LOCKS];
+THREADS_ONCE (file_lock_once);
+
+static void
+file_lock_init (void)
+{
+        int i;
+
+        for (i = 0; i < TILE_FILE_LOCKS; i++)
+                pthread_mutex_init (&file_lock[i], NULL);
+}
+#endif
+
+/*
+ * Channels may share an input, and separate opens of one file (at other
+ * HDUs, say) share its FITSfile, which cfitsio may not use in two
+ * threads at once
+ */
+static void
+tile_file_begin (fitsfile *fptr)
+{
+#ifdef HAVE_PTHREAD_H
+        threads_once (file_lock_once, file_lock_init);
+        pthread_mutex_lock (&file_lock[((unsigned long) fptr->Fptr >> 4) % TILE_FILE_LOCKS]);
+#endif
+}
+
+static void
+tile_file_end (fitsfile *fptr)
+{
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock (&file_lock[((unsigned long) fptr->Fptr >> 4) % TILE_FILE_LOCKS]);
+#endif
+}
+
+static unsigned int
+tile_hash_key (TileImage *image, long tx, long ty, long plane)
+{
+        unsigned long h;
+
+        h = (unsigned long) image;
+        h ^= (unsigned long) tx * 2654435761UL;
+        h ^= (unsigned long) ty * 40503UL;
+        h ^= (unsigned long) plane * 97UL;
+        h ^= h >> 13;
+        return (unsigned int) (h % TILE_HASH_SIZE);
+}
+
+static void
+lru_unlink (Tile *tile)
+{
+        if (tile->prev != NULL)
+                tile->prev->next = tile->next;
+        else
+                lru_head = tile->next;
+        if (tile->next != NULL)
+                tile->next->prev = tile->prev;
+        else
+                lru_tail = tile->prev;
+        tile->prev = tile->next = NULL;
+}
+
+static void
+lru_push (Tile *tile)
+{
+        tile->prev = NULL;
+        tile->next = lru_head;
+        if (lru_head != NULL)
+                lru_head->prev = tile;
+        lru_head = tile;
+        if (lru_tail == NULL)
+                lru_tail = tile;
+}
+
+static void
+tile_unhash (Tile *tile)
+{
+        Tile **pp;
+
+        pp = &tile_hash[tile_hash_key (tile->image, tile->tx, tile->ty, tile->plane)];
+        for (; *pp != NULL; pp = &(*pp)->hnext) {
+                if (*pp == tile) {
+                        *pp = tile->hnext;
+                        break;
+                }
+        }
+        cache_bytes -= tile->nbytes;
+}
+
+static void
+tile_free (Tile *tile)
+{
+        tile_unhash (tile);
+        lru_unlink (tile);
+        free (tile->data);
+        free (tile);
+}
+
+/*
+ * Find or create the tile layout record for the current HDU of fptr
+ */
+static TileImage *
+tile_image_info (fitsfile *fptr, int *status)
+{
+        TileImage *image;
+        char keyname[FLEN_KEYWORD];
+        int hdunum, naxis, i, keystat;
+
+        fits_get_hdu_num (fptr, &hdunum);
+        for (image = image_list; image != NULL; image = image->next) {
+                if (image->fptr == fptr && image->hdunum == hdunum)
+                        return image;
+        }
+
+        image = (TileImage *) malloc (sizeof (TileImage));
+        if (image == NULL) {
+                *status = MEMORY_ALLOCATION;
+                return NULL;
+        }
+        image->fptr = fptr;
+        image->hdunum = hdunum;
+        image->tiled = 0;
+        image->naxes[0] = image->naxes[1] = image->naxes[2] = 1;
+
+        tile_file_begin (fptr);
+        if (fits_is_compressed_image (fptr, status) &&
+            ! fits_get_img_dim (fptr, &naxis, status) &&
+            naxis >= 2 && naxis <= 3 &&
+            ! fits_get_img_size (fptr, naxis, image->naxes, status)) {
+                image->tiled = 1;
+                for (i = 0; i < 3; i++) {
+                        /* default tiling is one row per tile */
+                        image->ztile[i] = (i == 0) ? image->naxes[0] : 1;
+                        keystat = 0;
+                        sprintf (keyname, "ZTILE%d", i+1);
+                        if (fits_read_key (fptr, TLONG, keyname, &image->ztile[i], NULL, &keystat))
+                                image->ztile[i] = (i == 0) ? image->naxes[0] : 1;
+                        if (image->ztile[i] <= 0)
+                                image->tiled = 0;
+                }
+                /* planes of a 3-D image must be in separate tiles */
+                if (image->ztile[2] != 1)
+                        image->tiled = 0;
+                fitscut_message (2, "\tCompressed image tiles %ld x %ld%s\n",
+                                 image->ztile[0], image->ztile[1],
+                                 image->tiled ? "" : " (not using tile cache)");
+        }
+        tile_file_end (fptr);
+        if (*status) {
+                free (image);
+                return NULL;
+        }
+
+        image->next = image_list;
+        image_list = image;
+        return image;
+}
+
+/*
+ * Return the decompressed tile, reading it if it is not cached, with its
+ * user count raised.  Called with cache_lock held; the lock is dropped
+ * while the tile is read, and a thread wanting a tile that another is
+ * reading waits for it.
+ */
+static Tile *
+tile_get (TileImage *image, int datatype, void *nulval,
+          long tx, long ty, long plane, int *status)
+{
+        Tile *tile, *old, *prev;
+        long fpixel[3], lpixel[3], inc[3] = { 1, 1, 1 };
+        unsigned int h;
+        int has_null = (nulval != NULL);
+        int null_bits = 0;
+
+        if (has_null)
+                memcpy (&null_bits, nulval, sizeof (int));
+
+        h = tile_hash_key (image, tx, ty, plane);
+        for (;;) {
+                for (tile = tile_hash[h]; tile != NULL; tile = tile->hnext) {
+                        if (tile->image == image && tile->tx == tx && tile->ty == ty &&
+                            tile->plane == plane && tile->datatype == datatype &&
+                            tile->has_null == has_null && tile->null_bits == null_bits)
+                                break;
+                }
+                if (tile == NULL || ! tile->loading)
+                        break;
+#ifdef HAVE_PTHREAD_H
+                /* look again afterwards: the read may fail and drop the tile */
+                pthread_cond_wait (&tile_loaded, &cache_lock);
+#endif
+        }
+        if (tile != NULL) {
+                lru_unlink (tile);
+                lru_push (tile);
+                tile->users++;
+                return tile;
+        }
+
+        tile = (Tile *) malloc (sizeof (Tile));
+        if (tile == NULL) {
+                *status = MEMORY_ALLOCATION;
+                return NULL;
+        }
+        tile->image = image;
+        tile->datatype = datatype;
+        tile->has_null = has_null;
+        tile->null_bits = null_bits;
+        tile->tx = tx;
+        tile->ty = ty;
+        tile->plane = plane;
+
+        fpixel[0] = tx*image->ztile[0] + 1;
+        fpixel[1] = ty*image->ztile[1] + 1;
+        fpixel[2] = plane;
+        lpixel[0] = fpixel[0] + image->ztile[0] - 1;
+        lpixel[1] = fpixel[1] + image->ztile[1] - 1;
+        lpixel[2] = plane;
+        if (lpixel[0] > image->naxes[0])
+                lpixel[0] = image->naxes[0];
+        if (lpixel[1] > image->naxes[1])
+                lpixel[1] = image->naxes[1];
+        tile->nx = lpixel[0] - fpixel[0] + 1;
+        tile->ny = lpixel[1] - fpixel[1] + 1;
+        tile->nbytes = tile->nx * tile->ny * sizeof (int);
+
+        /* make room, but keep the tiles still being copied from */
+        for (old = lru_tail; old != NULL && cache_bytes + tile->nbytes > TILE_CACHE_BYTES; old = prev) {
+                prev = old->prev;
+                if (old->users == 0)
+                        tile_free (old);
+        }
+
+        tile->data = (int *) malloc (tile->nbytes);
+        if (tile->data == NULL) {
+                free (tile);
+                *status = MEMORY_ALLOCATION;
+                return NULL;
+        }
+
+        /* in the hash so that others wait for it, out of the LRU list until read */
+        tile->loading = 1;
+        tile->users = 1;
+        tile->prev = tile->next = NULL;
+        tile->hnext = tile_hash[h];
+        tile_hash[h] = tile;
+        cache_bytes += tile->nbytes;
+
+        threads_unlock (cache_lock);
+        tile->anynul = 0;
+        tile_file_begin (image->fptr);
+        fits_read_subset (image->fptr, datatype, fpixel, lpixel, inc,
+                          nulval, tile->data, &tile->anynul, status);
+        tile_file_end (image->fptr);
+        threads_lock (cache_lock);
+
+        tile->loading = 0;
+#ifdef HAVE_PTHREAD_H
+        pthread_cond_broadcast (&tile_loaded);
+#endif
+        if (*status) {
+                tile_unhash (tile);
+                free (tile->data);
+                free (tile);
+                return NULL;
+        }
+        lru_push (tile);
+        return tile;
+}
+
+/*
+ * Read a subset of a tile-compressed image through the tile cache.
+ * Arguments are as for fits_read_subset.  Returns true if the read was
+ * handled here (check status for errors), false if the image is not
+ * tile-compressed or the read is not one this reader understands, in
+ * which case nothing has been done.
+ */
+int
+tile_read_subset (fitsfile *fptr, int datatype, long *fpixel, long *lpixel, long *inc,
+                  void *nulval, void *array, int *anynul, int *status)
+{
+        TileImage *image;
+        Tile *tile;
+        int *out = (int *) array;
+        int *src;
+        long ny, x, xend, y, tx, ty, yoff, r;
+        int i;
+
+        if (*status)
+                return 1;
+        if (datatype != TFLOAT && datatype != TINT)
+                return 0;
+
+        threads_lock (cache_lock);
+        image = tile_image_info (fptr, status);
+        threads_unlock (cache_lock);
+        if (image == NULL)
+                return *status != 0;
+        if (! image->tiled)
+                return 0;
+
+        /* a single plane of a 2-D or 3-D image only */
+        if (fpixel[2] != lpixel[2])
+                return 0;
+        for (i = 3; i < 7; i++) {
+                if (fpixel[i] != 1 || lpixel[i] != 1)
+                        return 0;
+        }
+        if (fpixel[0] < 1 || lpixel[0] > image->naxes[0] ||
+            fpixel[1] < 1 || lpixel[1] > image->naxes[1] ||
+            fpixel[2] < 1 || fpixel[2] > image->naxes[2])
+                return 0;
+
+        ny = (lpixel[1]-fpixel[1])/inc[1] + 1;
+        if (anynul != NULL)
+                *anynul = 0;
+
+        tile = NULL;
+        for (r = 0; r < ny; r++) {
+                y = fpixel[1] + r*inc[1];
+                ty = (y-1) / image->ztile[1];
+                x = fpixel[0];
+                while (x <= lpixel[0]) {
+                        tx = (x-1) / image->ztile[0];
+                        if (tile == NULL || tile->tx != tx || tile->ty != ty) {
+                                threads_lock (cache_lock);
+                                if (tile != NULL)
+                                        tile->users--;
+                                tile = tile_get (image, datatype, nulval, tx, ty, fpixel[2], status);
+                                threads_unlock (cache_lock);
+                                if (tile == NULL)
+                                        return 1;
+                        }
+                        if (anynul != NULL && tile->anynul)
+                                *anynul = 1;
+
+                        /* copy the strided pixels that fall in this tile */
+                        yoff = (y-1) - ty*image->ztile[1];
+                        src = tile->data + yoff*tile->nx - tx*image->ztile[0] - 1;
+                        xend = (tx+1)*image->ztile[0];
+                        if (xend > lpixel[0])
+                                xend = lpixel[0];
+                        for (; x <= xend; x += inc[0])
+                                *out++ = src[x];
+                }
+        }
+        if (tile != NULL) {
+                threads_lock (cache_lock);
+                tile->users--;
+                threads_unlock (cache_lock);
+        }
+        return 1;
+}
+
+/*
+ * Tile size of the current HDU of fptr, if it is read through the tile
+ * cache; false if it isn't
+ */
+int
+tile_geometry (fitsfile *fptr, long *tilex, long *tiley)
+{
+        TileImage *image;
+        int status = 0, tiled = 0;
+
+        threads_lock (cache_lock);
+        image = tile_image_info (fptr, &status);
+        if (image != NULL && image->tiled) {
+                *tilex = image->ztile[0];
+                *tiley = image->ztile[1];
+                tiled = 1;
+        }
+        threads_unlock (cache_lock);
+        return tiled;
+}
+
+/*
+ * Drop everything cached for fptr; call before the file is closed
+ */
+void
+tile_cache_forget (fitsfile *fptr)
+{
+        TileImage **pp, *image;
+        Tile *tile, *next;
+
+        threads_lock (cache_lock);
+        for (pp = &image_list; *pp != NULL; ) {
+                image = *pp;
+                if (image->fptr != fptr) {
+                        pp = &image->next;
+                        continue;
+                }
+                for (tile = lru_head; tile != NULL; tile = next) {
+                        next = tile->next;
+                        if (tile->image == image)
+                                tile_free (tile);
+                }
+                *pp = image->next;
+                free (image);
+        }
+        threads_unlock (cache_lock);
+}
@@ -0,0 +1,24 @@
+/* declarations for tile_reader.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* memory used for decompressed tiles before the oldest are dropped */
+#define TILE_CACHE_BYTES (64*1024*1024)
+
+int  tile_read_subset  (fitsfile *fptr, int datatype, long *fpixel, long *lpixel, long *inc,
+                        void *nulval, void *array, int *anynul, int *status);
+int  tile_geometry     (fitsfile *fptr, long *tilex, long *tiley);
+void tile_cache_forget (fitsfile *fptr);
@@ -0,0 +1,362 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * Log, sqrt and histeq stretches applied while writing PNG/JPEG output
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Instead of rewriting the cutout with log10/sqrt/histeq values and then
+ * scaling those to bytes, a Transfer maps raw pixel values straight to
+ * output bytes.  transfer_byte is the per-pixel arithmetic of the stretch
+ * followed by the linear output scaling, so its bytes are the ones the
+ * two passes would give.
+ *
+ * Away from blanks that mapping is monotonic in the pixel value, and so
+ * in the pixel's bits read as an ordered integer key.  There are at most
+ * 256 runs of equal bytes, whose starting keys are found by bisection
+ * when the output scale is set.  The keys between the first and the last
+ * start are cut into TRANSFER_BUCKETS equal buckets; a bucket lying
+ * within one run holds that run's byte, and the few that straddle two
+ * runs are marked to work out their pixels one at a time.  Keys below or
+ * above that span get the first or last byte, and NaNs, and pixels where
+ * the stretch itself is undefined (log of a negative number), are
+ * always done one at a time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <math.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#include "fitscut.h"
+#include "transfer.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+/* keys of -infinity and +infinity */
+#define KEY_NEG_INF 0x007fffffU
+#define KEY_POS_INF 0xff800000U
+/* a bucket whose pixels are worked out one at a time */
+#define TRANSFER_MIXED 256
+
+enum {
+        TRANSFER_LOG,
+        TRANSFER_SQRT,
+        TRANSFER_HISTEQ
+};
+
+struct transfer {
+        int kind;
+        double shift;           /* log: added; sqrt: subtracted */
+        double dmin;            /* histeq */
+        float binsize;
+        int num_bins;
+        unsigned char *lut;
+
+        /* output scaling, as for the quantize_row kernels */
+        float scale, minval, clip_val;
+        int do_scale, invert;
+
+        /* the byte table, when it could be made */
+        int use_table;
+        uint32_t klo;           /* lowest key of the monotonic range */
+        uint32_t kbase;         /* first key of the bucketed span */
+        uint32_t span;          /* keys in the bucketed span */
+        int kshift;             /* key offset to bucket */
+        unsigned char blow, bhigh;
+        unsigned short *table;
+};
+
+static uint32_t
+transfer_key (float value)
+{
+        union { float f; uint32_t u; } x;
+
+        x.f = value;
+        return (x.u & 0x80000000U) ? ~x.u : (x.u | 0x80000000U);
+}
+
+static float
+transfer_unkey (uint32_t key)
+{
+        union { float f; uint32_t u; } x;
+
+        x.u = (key & 0x80000000U) ? (key & 0x7fffffffU) : ~key;
+        return x.f;
+}
+
+static Transfer *
+transfer_new (int kind)
+{
+        Transfer *tf;
+
+        tf = (Transfer *) calloc (1, sizeof (Transfer));
+        tf->kind = kind;
+        return tf;
+}
+
+/* log10 (value + linear_shift), as log_image */
+Transfer *
+transfer_new_log (double linear_shift)
+{
+        Transfer *tf = transfer_new (TRANSFER_LOG);
+
+        tf->shift = linear_shift;
+        return tf;
+}
+
+/* sqrt (value - user_minval), as sqrt_image */
+Transfer *
+transfer_new_sqrt (double user_minval)
+{
+        Transfer *tf = transfer_new (TRANSFER_SQRT);
+
+        tf->shift = user_minval;
+        return tf;
+}
+
+/* histogram equalization through lut, as histeq_image; takes lut over */
+Transfer *
+transfer_new_histeq (double dmin, float binsize, int num_bins, unsigned char *lut)
+{
+        Transfer *tf = transfer_new (TRANSFER_HISTEQ);
+
+        tf->dmin = dmin;
+        tf->binsize = binsize;
+        tf->num_bins = num_bins;
+        tf->lut = lut;
+        return tf;
+}
+
+void
+transfer_free (Transfer *tf)
+{
+        if (tf == NULL)
+                return;
+        free (tf->lut);
+        free (tf->table);
+        free (tf);
+}
+
+/* the stretched value of one pixel */
+float
+transfer_value (Transfer *tf, float value)
+{
+        float t;
+        double x;
+
+        switch (tf->kind) {
+        case TRANSFER_LOG:
+                t = value + tf->shift;
+                return log10 (t);
+        case TRANSFER_SQRT:
+                /* MAX is a macro we have to be careful */
+                t = value - tf->shift;
+                return sqrt (MAX (0, t));
+        case TRANSFER_HISTEQ:
+        default:
+                x = ceil ((value - tf->dmin) / tf->binsize);
+                /* blanks and pixels outside the histogram go to the end bins */
+                if (!(x >= 0))
+                        x = 0;
+                else if (x > tf->num_bins - 1)
+                        x = tf->num_bins - 1;
+                return tf->lut[(long) x];
+        }
+}
+
+/* the output byte for one pixel, as the linear output scaling of the stretched value */
+static unsigned char
+transfer_byte (Transfer *tf, float value)
+{
+        float t, tx;
+
+        t = transfer_value (tf, value);
+        if (tf->do_scale) {
+                t = tf->scale * (t - tf->minval);
+                tx = MIN (t, tf->clip_val);
+                t = MAX (0, tx);
+        }
+        if (tf->invert) {
+                t = tf->clip_val - t;
+        }
+        return (unsigned char) t;
+}
+
+static unsigned char
+transfer_byte_key (Transfer *tf, uint32_t key)
+{
+        return transfer_byte (tf, transfer_unkey (key));
+}
+
+/* the run (0 .. nstart) that key falls in */
+static int
+transfer_run (uint32_t *start, int nstart, uint32_t key)
+{
+        int lo = 0, hi = nstart, mid;
+
+        /* number of run starts <= key */
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (start[mid] <= key)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/* find the runs of equal bytes and fill the bucket table; FALSE if it can't be done */
+static int
+transfer_make_table (Transfer *tf)
+{
+        uint32_t start[256], lo, hi, mid, first, last;
+        unsigned char value[257];
+        int nstart, b, r0, r1, nbuckets;
+
+        /* the stretch is undefined (NaN) below klo, if anywhere */
+        if (isnan (transfer_value (tf, transfer_unkey (KEY_POS_INF))))
+                return FALSE;
+        lo = KEY_NEG_INF;
+        hi = KEY_POS_INF;
+        if (isnan (transfer_value (tf, transfer_unkey (lo)))) {
+                while (hi - lo > 1) {
+                        mid = lo + (hi - lo) / 2;
+                        if (isnan (transfer_value (tf, transfer_unkey (mid))))
+                                lo = mid;
+                        else
+                                hi = mid;
+                }
+                lo = hi;
+        }
+        tf->klo = lo;
+
+        /* starts of the runs after the first */
+        nstart = 0;
+        value[0] = transfer_byte_key (tf, tf->klo);
+        lo = tf->klo;
+        while (transfer_byte_key (tf, KEY_POS_INF) != value[nstart]) {
+                if (nstart == 256)
+                        return FALSE;   /* not monotonic after all */
+                hi = KEY_POS_INF;
+                while (hi - lo > 1) {
+                        mid = lo + (hi - lo) / 2;
+                        if (transfer_byte_key (tf, mid) != value[nstart])
+                                hi = mid;
+                        else
+                                lo = mid;
+                }
+                start[nstart++] = hi;
+                value[nstart] = transfer_byte_key (tf, hi);
+                lo = hi;
+        }
+
+        tf->blow = value[0];
+        tf->bhigh = value[nstart];
+        if (nstart == 0) {
+                /* one byte for everything: nothing to bucket */
+                tf->kbase = KEY_POS_INF;
+                tf->span = 0;
+                return TRUE;
+        }
+
+        first = start[0];
+        last = start[nstart-1];
+        tf->kbase = first;
+        tf->span = last - first + 1;
+        for (tf->kshift = 0; ((tf->span - 1) >> tf->kshift) >= TRANSFER_BUCKETS; tf->kshift++)
+                ;
+        nbuckets = ((tf->span - 1) >> tf->kshift) + 1;
+
+        if (tf->table == NULL)
+                tf->table = (unsigned short *) malloc (sizeof (unsigned short) * TRANSFER_BUCKETS);
+        for (b = 0; b < nbuckets; b++) {
+                lo = first + ((uint32_t) b << tf->kshift);
+                hi = lo + ((1U << tf->kshift) - 1);
+                if (hi > last || hi < lo)
+                        hi = last;
+                r0 = transfer_run (start, nstart, lo);
+                r1 = transfer_run (start, nstart, hi);
+                tf->table[b] = (r0 == r1) ? value[r0] : TRANSFER_MIXED;
+        }
+        return TRUE;
+}
+
+/* set the scaling of transfer_row, as select_quantize_row */
+void
+transfer_set_output (Transfer *tf, float scale, float minval, float maxval,
+                     float clip_val, int invert)
+{
+        tf->scale = scale;
+        tf->minval = minval;
+        tf->clip_val = clip_val;
+        tf->do_scale = !((minval == 0) && (maxval == clip_val));
+        tf->invert = invert;
+        tf->use_table = transfer_make_table (tf);
+        if (!tf->use_table)
+                fitscut_message (2, "\tstretch is not monotonic, no byte table\n");
+}
+
+/* stretch and scale ncols pixels to bytes, as the quantize_row kernels */
+void
+transfer_row (Transfer *tf, float *arrayp, unsigned char *line,
+              int skip, int stride, long ncols)
+{
+        unsigned char *pp;
+        unsigned short b;
+        uint32_t key, d;
+        long col;
+
+        pp = line + skip;
+        if (!tf->use_table) {
+                for (col = 0; col < ncols; col++) {
+                        *pp = transfer_byte (tf, arrayp[col]);
+                        pp += stride;
+                }
+                return;
+        }
+
+        for (col = 0; col < ncols; col++) {
+                key = transfer_key (arrayp[col]);
+                d = key - tf->kbase;
+                if (d < tf->span) {
+                        b = tf->table[d >> tf->kshift];
+                        if (b == TRANSFER_MIXED)
+                                b = transfer_byte (tf, arrayp[col]);
+                } else if (key < tf->klo || key > KEY_POS_INF) {
+                        /* NaN, or where the stretch is undefined */
+                        b = transfer_byte (tf, arrayp[col]);
+                } else if (key < tf->kbase) {
+                        b = tf->blow;
+                } else {
+                        b = tf->bhigh;
+                }
+                *pp = (unsigned char) b;
+                pp += stride;
+        }
+}
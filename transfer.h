@@ -0,0 +1,29 @@
+/* declarations for transfer.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* buckets in the table mapping pixel values to output bytes */
+#define TRANSFER_BUCKETS 65536
+
+Transfer *transfer_new_log    (double linear_shift);
+Transfer *transfer_new_sqrt   (double user_minval);
+Transfer *transfer_new_histeq (double dmin, float binsize, int num_bins, unsigned char *lut);
+void      transfer_free       (Transfer *tf);
+float     transfer_value      (Transfer *tf, float value);
+void      transfer_set_output (Transfer *tf, float scale, float minval, float maxval,
+                               float clip_val, int invert);
+void      transfer_row        (Transfer *tf, float *arrayp, unsigned char *line,
+                               int skip, int stride, long ncols);
@@ -38,6 +38,10 @@
 #include <signal.h>
 #include <ctype.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_CFITSIO_FITSIO_H
 #include <cfitsio/fitsio.h> 
 #else
@@ -48,6 +52,8 @@
 #include "extract.h"
 #include <libwcs/wcs.h>
 #include "wcs_align.h"
+#include "input_cache.h"
+#include "threads.h"
 
 #ifdef  STDC_HEADERS
 #include <stdlib.h>
@@ -72,7 +78,8 @@ wcs_initialize_channel (FitsCutImage *Image, int k)
         if (Image->header[k] != NULL) {
                 struct WorldCoor *wcs;
 
-                wcs = wcsninit (Image->header[k], Image->header_cards[k]*80);
+                /* header was cached when the channel was opened */
+                wcs = input_cache_wcs (input_cache_open (Image->input_filename[k]));
                 if (iswcs (wcs)) {
                         Image->wcs[k] = wcs;
                 }
@@ -88,39 +95,27 @@ wcs_initialize (FitsCutImage *Image)
                 wcs_initialize_channel (Image, k);
 }
 
-/* open FITS file, extract the WCS, and close it
+/* get the WCS for a FITS file (opened through the input cache)
  * also returns the image dimensions in naxes array
  */
 
 struct WorldCoor *wcs_read(char *filename, long *naxes)
 {
-    fitsfile *fptr;
-    char *header;
-    int status = 0;
+    FitsCutInput *input;
     struct WorldCoor *wcs;
 
-    if (fits_open_image (&fptr, filename, READONLY, &status)) 
-        printerror (status);
-
-    /* let cfitsio extract the entire header as a string */
-    if (fits_get_image_wcs_keys (fptr, &header, &status))
-        printerror (status);
-
-    if (fits_get_img_size (fptr, 2, naxes, &status))
-        printerror (status);
-
-    if (fits_close_file(fptr, &status))
-        printerror (status);
+    input = input_cache_open (filename);
+    naxes[0] = input->naxes[0];
+    naxes[1] = input->naxes[1];
 
     /* get world coordinate system info from header */
-    wcs = wcsinit (header);
+    wcs = input_cache_wcs (input);
 
     if (nowcs(wcs)) {
         fitscut_message (1,
             "fitscut: warning: no WCS info for file %s\n", filename);
     }
 
-    free(header);
     return (wcs);
 }
 
@@ -130,25 +125,6 @@ wcs_initialize_ref (FitsCutImage *Image, long *naxes)
     Image->wcsref = wcs_read(Image->reference_filename, naxes);
 }
 
-void
-wcs_align_ref (FitsCutImage *Image)
-{
-        int k;
-  
-        if (Image->wcsref == NULL)
-                return;
-
-        if (nowcs (Image->wcsref))
-                return;
-
-        for (k = 0; k < Image->channels; k++) {
-            if (Image->data[k] != NULL) {
-                fitscut_message (2, "\t\tremapping channel %d\n", k);
-                wcs_remap_channel (Image, k);
-            }
-        }
-}
-
 /* returns true if 2 WCS systems are the same */
 
 static int
@@ -183,48 +159,429 @@ pix2pix(struct WorldCoor *wcs_in, double x_in, double y_in, struct WorldCoor *wc
     wcs2pix (wcs_out, xpos, ypos, x_out, y_out, offscl);
 }
 
-int
-wcs_remap_channel (FitsCutImage *Image, int channel)
+/*
+ * The remap evaluates pix2pix exactly on a grid of REMAP_GRID_STEP output
+ * pixels and interpolates bilinearly inside each cell.  A cell is split in
+ * four (or two, when it is one pixel across) until the interpolation at
+ * the middles of its edges and at its centre is within align_tolerance of
+ * the exact transform, or every pixel in it has been done exactly.
+ */
+#define REMAP_GRID_STEP 16
+
+/* an output pixel and where it falls in the input image */
+typedef struct {
+        double x, y;
+        int offscl;
+} RemapPoint;
+
+typedef struct {
+        struct WorldCoor *wcs_in, *wcs_out;
+        float *image, *image_out;
+        int ncols_in, nrows_in, ncols_out;
+        double tolerance;
+        int irow0, irow1;       /* output rows written */
+        long nexact;            /* pix2pix evaluations */
+} RemapGrid;
+
+static void
+remap_exact (RemapGrid *g, int jout, int iout, RemapPoint *p)
+{
+        pix2pix (g->wcs_out, (double) jout, (double) iout, g->wcs_in, &p->x, &p->y, &p->offscl);
+        g->nexact++;
+}
+
+/* nearest input pixel to (xin, yin) into output pixel (jout, iout) */
+static void
+remap_copy (RemapGrid *g, int jout, int iout, double xin, double yin)
+{
+        int iin, jin;
+
+        if (iout < g->irow0 || iout > g->irow1)
+                return;
+        iin = lround(yin);
+        jin = lround(xin);
+        if (iin >= 1 && iin <= g->nrows_in && jin >= 1 && jin <= g->ncols_in) {
+                g->image_out[(jout-1)+(iout-1)*g->ncols_out] = g->image[(jin-1)+(iin-1)*g->ncols_in];
+        }
+}
+
+/* true if p is on the image and within tolerance of the straight line from a to b at t */
+static int
+remap_close (RemapGrid *g, const RemapPoint *p, const RemapPoint *a, const RemapPoint *b, double t)
+{
+        if (p->offscl)
+                return 0;
+        return fabs (a->x + t*(b->x - a->x) - p->x) <= g->tolerance &&
+               fabs (a->y + t*(b->y - a->y) - p->y) <= g->tolerance;
+}
+
+/*
+ * Fill output pixels j0..j1 x i0..i1 given the exact transform p00, p10,
+ * p01, p11 at the corners (j0,i0), (j1,i0), (j0,i1), (j1,i1)
+ */
+static void
+remap_cell (RemapGrid *g, int j0, int i0, int j1, int i1,
+            const RemapPoint *p00, const RemapPoint *p10,
+            const RemapPoint *p01, const RemapPoint *p11)
+{
+        RemapPoint top, bottom, left, right, centre, l, r;
+        int jm, im, split_j, split_i, ok, iout, jout;
+        double t, dx, dy, xin, yin;
+
+        if (j1 - j0 <= 1 && i1 - i0 <= 1) {
+                /* every pixel is a corner */
+                if (!p00->offscl) remap_copy (g, j0, i0, p00->x, p00->y);
+                if (!p10->offscl) remap_copy (g, j1, i0, p10->x, p10->y);
+                if (!p01->offscl) remap_copy (g, j0, i1, p01->x, p01->y);
+                if (!p11->offscl) remap_copy (g, j1, i1, p11->x, p11->y);
+                return;
+        }
+
+        jm = (j0 + j1) / 2;
+        im = (i0 + i1) / 2;
+        split_j = j1 - j0 > 1;
+        split_i = i1 - i0 > 1;
+        ok = !p00->offscl && !p10->offscl && !p01->offscl && !p11->offscl;
+        if (split_j) {
+                remap_exact (g, jm, i0, &top);
+                remap_exact (g, jm, i1, &bottom);
+                t = (double) (jm - j0) / (j1 - j0);
+                ok = ok && remap_close (g, &top, p00, p10, t) && remap_close (g, &bottom, p01, p11, t);
+        }
+        if (split_i) {
+                remap_exact (g, j0, im, &left);
+                remap_exact (g, j1, im, &right);
+                t = (double) (im - i0) / (i1 - i0);
+                ok = ok && remap_close (g, &left, p00, p01, t) && remap_close (g, &right, p10, p11, t);
+        }
+        if (split_j && split_i) {
+                remap_exact (g, jm, im, &centre);
+                /* the bilinear value at the centre, from the exact edge middles */
+                t = (double) (im - i0) / (i1 - i0);
+                l.x = p00->x + t*(p01->x - p00->x);
+                l.y = p00->y + t*(p01->y - p00->y);
+                r.x = p10->x + t*(p11->x - p10->x);
+                r.y = p10->y + t*(p11->y - p10->y);
+                l.offscl = r.offscl = 0;
+                ok = ok && remap_close (g, &centre, &l, &r, (double) (jm - j0) / (j1 - j0));
+        }
+
+        if (ok) {
+                for (iout = i0; iout <= i1; iout++) {
+                        t = (i1 > i0) ? (double) (iout - i0) / (i1 - i0) : 0;
+                        xin = p00->x + t*(p01->x - p00->x);
+                        yin = p00->y + t*(p01->y - p00->y);
+                        dx = (j1 > j0) ? (p10->x + t*(p11->x - p10->x) - xin) / (j1 - j0) : 0;
+                        dy = (j1 > j0) ? (p10->y + t*(p11->y - p10->y) - yin) / (j1 - j0) : 0;
+                        for (jout = j0; jout <= j1; jout++) {
+                                remap_copy (g, jout, iout, xin, yin);
+                                xin += dx;
+                                yin += dy;
+                        }
+                }
+                return;
+        }
+
+        if (split_j && split_i) {
+                remap_cell (g, j0, i0, jm, im, p00, &top, &left, &centre);
+                remap_cell (g, jm, i0, j1, im, &top, p10, &centre, &right);
+                remap_cell (g, j0, im, jm, i1, &left, &centre, p01, &bottom);
+                remap_cell (g, jm, im, j1, i1, &centre, &right, &bottom, p11);
+        } else if (split_j) {
+                remap_cell (g, j0, i0, jm, i1, p00, &top, p01, &bottom);
+                remap_cell (g, jm, i0, j1, i1, &top, p10, &bottom, p11);
+        } else {
+                remap_cell (g, j0, i0, j1, im, p00, p10, &left, &right);
+                remap_cell (g, j0, im, j1, i1, &left, &right, p01, p11);
+        }
+}
+
+/* remap output pixels jout1..jout2 x iout1..iout2 exactly, one at a time */
+static void
+remap_pixels (RemapGrid *g, int jout1, int iout1, int jout2, int iout2)
+{
+        RemapPoint p;
+        int iout, jout;
+
+        for (iout = iout1; iout <= iout2; iout++) {
+                for (jout = jout1; jout <= jout2; jout++) {
+                        remap_exact (g, jout, iout, &p);
+                        if (!p.offscl)
+                                remap_copy (g, jout, iout, p.x, p.y);
+                }
+        }
+}
+
+/* remap output pixels jout1..jout2 x iout1..iout2 a grid cell at a time */
+static void
+remap_grid (RemapGrid *g, int jout1, int iout1, int jout2, int iout2)
+{
+        RemapPoint *above, *below, *tmp;
+        int nx, ny, m, n, i0, i1, j0, j1;
+
+        nx = (jout2 - jout1 + REMAP_GRID_STEP - 1) / REMAP_GRID_STEP;
+        ny = (iout2 - iout1 + REMAP_GRID_STEP - 1) / REMAP_GRID_STEP;
+        if (nx < 1) nx = 1;
+        if (ny < 1) ny = 1;
+        above = (RemapPoint *) malloc ((nx + 1) * sizeof (RemapPoint));
+        below = (RemapPoint *) malloc ((nx + 1) * sizeof (RemapPoint));
+
+        /* grid lines every REMAP_GRID_STEP pixels, the last at the edge */
+        for (m = 0; m <= nx; m++)
+                remap_exact (g, MIN (jout1 + m*REMAP_GRID_STEP, jout2), iout1, &above[m]);
+        for (n = 0; n < ny; n++) {
+                i0 = iout1 + n*REMAP_GRID_STEP;
+                i1 = MIN (i0 + REMAP_GRID_STEP, iout2);
+                for (m = 0; m <= nx; m++)
+                        remap_exact (g, MIN (jout1 + m*REMAP_GRID_STEP, jout2), i1, &below[m]);
+                for (m = 0; m < nx; m++) {
+                        j0 = jout1 + m*REMAP_GRID_STEP;
+                        j1 = MIN (j0 + REMAP_GRID_STEP, jout2);
+                        remap_cell (g, j0, i0, j1, i1, &above[m], &above[m+1], &below[m], &below[m+1]);
+                }
+                tmp = above;
+                above = below;
+                below = tmp;
+        }
+        free (above);
+        free (below);
+}
+
+/* below this many output pixels a channel is remapped in one piece */
+#define REMAP_PARALLEL_MIN (1<<16)
+
+/* points along each side of the output checked by remap_classify */
+#define REMAP_CLASSIFY_POINTS 5
+/* the tolerance for remap_classify when the remap is to be exact */
+#define REMAP_EXACT_TOLERANCE 1e-6
+
+/* how a channel's pixels relate to the reference's */
+typedef enum {
+        REMAP_GENERAL = 0,      /* through the projections */
+        REMAP_SHIFT,            /* a whole number of pixels in x and y */
+        REMAP_AFFINE            /* a linear map and an offset */
+} RemapKind;
+
+/* one channel being remapped onto the reference image */
+typedef struct {
+        int channel;
+        RemapGrid g;            /* with this channel's copies of the WCS */
+        int jout1, iout1, jout2, iout2;
+        int band_rows;          /* output rows per piece, whole grid cells */
+        int nbands;
+        RemapKind kind;
+        /* input x = ax + axj*jout + axi*iout, and the same for y */
+        double ax, axj, axi, ay, ayj, ayi;
+        int shiftx, shifty;     /* for REMAP_SHIFT */
+} RemapJob;
+
+/* the pieces of all the channels being remapped */
+typedef struct {
+        RemapJob *job[MAX_CHANNELS];
+        int njobs;
+        int first_piece[MAX_CHANNELS + 1];
+} RemapWork;
+
+THREADS_MUTEX (remap_lock);
+
+/*
+ * A private copy of a WorldCoor for a remap job.  libwcs writes its
+ * results into the struct, so jobs and threads cannot share one; whatever
+ * it points to is set up already and only read, so it stays shared.
+ */
+static struct WorldCoor *
+wcs_clone (struct WorldCoor *wcs)
 {
+        struct WorldCoor *copy;
+
+        copy = (struct WorldCoor *) malloc (sizeof (struct WorldCoor));
+        if (copy == NULL) {
+                fitscut_message (0, "Unable to allocate memory for WCS copy\n");
+                do_exit (1);
+        }
+        memcpy (copy, wcs, sizeof (struct WorldCoor));
+        return copy;
+}
+
+/*
+ * See whether the input pixel of every output pixel of job is an affine
+ * function of the output pixel, to within the tolerance, and a whole
+ * pixel shift in particular.  The map is fitted through three corners of
+ * the output and checked on a grid of REMAP_CLASSIFY_POINTS a side.
+ */
+static RemapKind
+remap_classify (RemapJob *job, struct WorldCoor *wcs_in, struct WorldCoor *wcs_out)
+{
+        double x00, y00, x10, y10, x01, y01, xin, yin, tol, jout, iout, dx, dy;
+        int offscl, m, n, w, h;
+
+        w = job->jout2 - job->jout1;
+        h = job->iout2 - job->iout1;
+        if (w < 1 || h < 1)
+                return REMAP_GENERAL;
+        tol = job->g.tolerance > 0 ? job->g.tolerance : REMAP_EXACT_TOLERANCE;
+
+        pix2pix (wcs_out, job->jout1, job->iout1, wcs_in, &x00, &y00, &offscl);
+        if (offscl) return REMAP_GENERAL;
+        pix2pix (wcs_out, job->jout2, job->iout1, wcs_in, &x10, &y10, &offscl);
+        if (offscl) return REMAP_GENERAL;
+        pix2pix (wcs_out, job->jout1, job->iout2, wcs_in, &x01, &y01, &offscl);
+        if (offscl) return REMAP_GENERAL;
+
+        job->axj = (x10 - x00) / w;
+        job->ayj = (y10 - y00) / w;
+        job->axi = (x01 - x00) / h;
+        job->ayi = (y01 - y00) / h;
+        job->ax = x00 - job->axj * job->jout1 - job->axi * job->iout1;
+        job->ay = y00 - job->ayj * job->jout1 - job->ayi * job->iout1;
+
+        for (n = 0; n < REMAP_CLASSIFY_POINTS; n++) {
+                iout = job->iout1 + (double) h * n / (REMAP_CLASSIFY_POINTS - 1);
+                for (m = 0; m < REMAP_CLASSIFY_POINTS; m++) {
+                        jout = job->jout1 + (double) w * m / (REMAP_CLASSIFY_POINTS - 1);
+                        pix2pix (wcs_out, jout, iout, wcs_in, &xin, &yin, &offscl);
+                        if (offscl ||
+                            fabs (job->ax + job->axj * jout + job->axi * iout - xin) > tol ||
+                            fabs (job->ay + job->ayj * jout + job->ayi * iout - yin) > tol)
+                                return REMAP_GENERAL;
+                }
+        }
+
+        /* a shift if the map moves no pixel of the output further than tol from one */
+        job->shiftx = lround (x00 - job->jout1);
+        job->shifty = lround (y00 - job->iout1);
+        dx = fabs (x00 - job->jout1 - job->shiftx);
+        dy = fabs (y00 - job->iout1 - job->shifty);
+        if (dx + fabs (job->axj - 1) * w + fabs (job->axi) * h <= tol &&
+            dy + fabs (job->ayj) * w + fabs (job->ayi - 1) * h <= tol)
+                return REMAP_SHIFT;
+        return REMAP_AFFINE;
+}
+
+/* copy output rows irow0..irow1 of a whole pixel shift a row at a time */
+static void
+remap_shift_rows (RemapJob *job, int irow0, int irow1)
+{
+        RemapGrid *g = &job->g;
+        int iout, iin, jout1, jout2;
+
+        /* the columns that fall on the input */
+        jout1 = MAX (job->jout1, 1 - job->shiftx);
+        jout2 = MIN (job->jout2, g->ncols_in - job->shiftx);
+        if (jout1 > jout2)
+                return;
+        for (iout = irow0; iout <= irow1; iout++) {
+                iin = iout + job->shifty;
+                if (iin < 1 || iin > g->nrows_in)
+                        continue;
+                memcpy (&g->image_out[(jout1-1)+(iout-1)*g->ncols_out],
+                        &g->image[(jout1+job->shiftx-1)+(iin-1)*g->ncols_in],
+                        (jout2 - jout1 + 1) * sizeof (float));
+        }
+}
+
+/*
+ * Output rows irow0..irow1 of an affine map, the nearest input pixel of
+ * each.  A coordinate rounds as (int) (x + 0.5), which is lround for
+ * everything on the input.
+ */
+static void
+remap_affine_rows (RemapJob *job, int irow0, int irow1)
+{
+        RemapGrid *g = &job->g;
+        float *out;
+        double bx, by, xin, yin;
+        int iout, jout, iin, jin;
+#ifdef __SSE2__
+        __m128d vj, vx, vy;
+        const __m128d half = _mm_set1_pd (0.5);
+        const __m128d two = _mm_set1_pd (2.0);
+        const __m128d axj = _mm_set1_pd (job->axj);
+        const __m128d ayj = _mm_set1_pd (job->ayj);
+        int idx[4], idy[4], l;
+#endif
+
+        for (iout = irow0; iout <= irow1; iout++) {
+                bx = job->ax + job->axi * iout;
+                by = job->ay + job->ayi * iout;
+                out = g->image_out + (iout-1)*g->ncols_out - 1;
+                jout = job->jout1;
+#ifdef __SSE2__
+                /* indexes two at a time; too far off the input they come out negative */
+                vj = _mm_set_pd (jout + 1, jout);
+                for (; jout + 1 <= job->jout2; jout += 2) {
+                        vx = _mm_add_pd (_mm_add_pd (_mm_set1_pd (bx), _mm_mul_pd (axj, vj)), half);
+                        vy = _mm_add_pd (_mm_add_pd (_mm_set1_pd (by), _mm_mul_pd (ayj, vj)), half);
+                        _mm_storeu_si128 ((__m128i *) idx, _mm_cvttpd_epi32 (vx));
+                        _mm_storeu_si128 ((__m128i *) idy, _mm_cvttpd_epi32 (vy));
+                        for (l = 0; l < 2; l++) {
+                                if (idx[l] >= 1 && idx[l] <= g->ncols_in &&
+                                    idy[l] >= 1 && idy[l] <= g->nrows_in)
+                                        out[jout+l] = g->image[(idx[l]-1)+(idy[l]-1)*g->ncols_in];
+                        }
+                        vj = _mm_add_pd (vj, two);
+                }
+#endif
+                for (; jout <= job->jout2; jout++) {
+                        xin = bx + job->axj * jout + 0.5;
+                        yin = by + job->ayj * jout + 0.5;
+                        if (xin < 1 || xin >= g->ncols_in + 1 || yin < 1 || yin >= g->nrows_in + 1)
+                                continue;
+                        jin = (int) xin;
+                        iin = (int) yin;
+                        out[jout] = g->image[(jin-1)+(iin-1)*g->ncols_in];
+                }
+        }
+}
+
+/*
+ * Set up the remap of a channel: the coordinate systems, the part of the
+ * reference image it covers and the output array.  Returns NULL if the
+ * channel already matches the reference.
+ */
+static RemapJob *
+remap_prepare (FitsCutImage *Image, int channel)
+{
+        RemapJob *job;
         struct WorldCoor *wcs_in, *wcs_out;
-        int wpin, hpin;
         int offscl;
-        int iin, iout, jin, jout;
         int iout1, iout2, jout1, jout2;
+        int ncols_out, nrows_out, nrows, npieces;
+        long cells;             /* grid cells per band */
 
-        double xout, yout, xin, yin;
+        double xout, yout;
         double xmin, xmax, ymin, ymax;
         double x0, y0, x1, y1;
 
-        int ncols_in, nrows_in;
-        int ncols_out, nrows_out;
-
-        float *image_out, *image;
-
         wcs_out = Image->wcsref;
         wcs_in = Image->wcs[channel];
         if (wcs_equal(wcs_in, wcs_out)) {
             fitscut_message (3, "\t\tWCS for channel %d matches reference image\n", channel);
-            return(0);
+            return NULL;
         }
 
-        image = Image->data[channel];
-        ncols_in = Image->ncols[channel];
-        nrows_in = Image->nrows[channel];
-
         /* Allocate space for output image */
         ncols_out = Image->ncolsref;
         nrows_out = Image->nrowsref;
 
         fitscut_message (3, "\t\tCreating temp image [%d,%d]\n", ncols_out, nrows_out);
 
-        image_out = cutout_alloc(ncols_out, nrows_out, NAN);
+        job = (RemapJob *) calloc (1, sizeof (RemapJob));
+        if (job == NULL) {
+                fitscut_message (0, "Unable to allocate memory for remapping channel %d\n", channel);
+                do_exit (1);
+        }
+        job->channel = channel;
+        job->g.image = Image->data[channel];
+        job->g.ncols_in = Image->ncols[channel];
+        job->g.nrows_in = Image->nrows[channel];
+        job->g.image_out = cutout_alloc(ncols_out, nrows_out, NAN);
+        job->g.ncols_out = ncols_out;
+        job->g.tolerance = Image->align_tolerance;
 
         /* Set input WCS output coordinate system to output coordinate system */
         wcs_in->sysout = wcs_out->syswcs;
         strcpy (wcs_in->radecout, wcs_out->radecsys);
-        wpin = wcs_in->nxpix;
-        hpin = wcs_in->nypix;
 
         /* Set output WCS output coordinate system to input coordinate system */
         wcs_out->sysout = wcs_in->syswcs;
@@ -261,42 +618,169 @@ wcs_remap_channel (FitsCutImage *Image, int channel)
         fitscut_message (3, "REMAP: Output x: %d-%d, y: %d-%d\n",
                          jout1, jout2, iout1, iout2);
 
-        /* Loop through vertical pixels (output image lines) */
-        for (iout = iout1; iout <= iout2; iout++) {
-            yout = (double) iout;
-
-            /* Loop through horizontal pixels (output image columns) */
-            for (jout = jout1; jout <= jout2; jout++) {
-                xout = (double) jout;
-
-                /* Get image coordinates of this pixel in input image */
-                pix2pix(wcs_out, xout, yout, wcs_in, &xin, &yin, &offscl);
-
-                if (!offscl) {
-                    iin = lround(yin);
-                    jin = lround(xin);
-                    if (iin >= 1 && iin <= nrows_in && jin >= 1 && jin <= ncols_in) {
-                        /* Copy pixel from input to output */
-                        image_out[(jout-1)+(iout-1)*ncols_out] = image[(jin-1)+(iin-1)*ncols_in];
-                    }
-                }
-            }
+        job->jout1 = jout1;
+        job->iout1 = iout1;
+        job->jout2 = jout2;
+        job->iout2 = iout2;
+        if (iout1 > iout2 || jout1 > jout2)
+                return job;
+
+        /* the way back once here, so that anything libwcs sets up on first use is shared */
+        pix2pix(wcs_out, 0.5*(jout1+jout2), 0.5*(iout1+iout2), wcs_in, &xout, &yout, &offscl);
+        job->g.wcs_in = wcs_clone (wcs_in);
+        job->g.wcs_out = wcs_clone (wcs_out);
+
+        job->kind = remap_classify (job, wcs_in, wcs_out);
+        switch (job->kind) {
+        case REMAP_SHIFT:
+                fitscut_message (2, "\t\tchannel %d is the reference shifted by %d,%d pixels\n",
+                                 channel, job->shiftx, job->shifty);
+                break;
+        case REMAP_AFFINE:
+                fitscut_message (2, "\t\tchannel %d is an affine map of the reference\n", channel);
+                break;
+        default:
+                break;
         }
 
+        /* bands of output rows, in whole grid cells so they match one pass */
+        nrows = iout2 - iout1 + 1;
+        npieces = 1;
+        if ((long) nrows * (jout2 - jout1 + 1) >= REMAP_PARALLEL_MIN)
+                npieces = 4 * threads_get_count ();
+        job->nbands = threads_split ((nrows + REMAP_GRID_STEP - 1) / REMAP_GRID_STEP,
+                                     npieces, &cells);
+        job->band_rows = cells * REMAP_GRID_STEP;
+        return job;
+}
+
+/* remap one band of output rows of one channel */
+static void
+remap_task (void *arg, int piece)
+{
+        RemapWork *work = (RemapWork *) arg;
+        RemapJob *job;
+        RemapGrid g;
+        /* this thread's copies, on the stack so that nothing here can fail */
+        struct WorldCoor wcs_in, wcs_out;
+        int j, band, start, end;
+
+        for (j = 0; piece >= work->first_piece[j+1]; j++)
+                ;
+        job = work->job[j];
+        band = piece - work->first_piece[j];
+        start = job->iout1 + band * job->band_rows;
+        end = MIN (start + job->band_rows - 1, job->iout2);
+
+        if (job->kind == REMAP_SHIFT) {
+                remap_shift_rows (job, start, end);
+                return;
+        }
+        if (job->kind == REMAP_AFFINE) {
+                remap_affine_rows (job, start, end);
+                return;
+        }
+
+        g = job->g;
+        memcpy (&wcs_in, job->g.wcs_in, sizeof (struct WorldCoor));
+        memcpy (&wcs_out, job->g.wcs_out, sizeof (struct WorldCoor));
+        g.wcs_in = &wcs_in;
+        g.wcs_out = &wcs_out;
+        g.irow0 = start;
+        g.irow1 = end;
+        g.nexact = 0;
+        if (g.tolerance > 0)
+                /* the grid runs on to the first row of the next band, which is not written */
+                remap_grid (&g, job->jout1, start, job->jout2, MIN (end + 1, job->iout2));
+        else
+                remap_pixels (&g, job->jout1, start, job->jout2, end);
+
+        threads_lock (remap_lock);
+        job->g.nexact += g.nexact;
+        threads_unlock (remap_lock);
+}
+
+/* remap the bands of all the jobs, channels and rows at once */
+static void
+remap_run (RemapWork *work)
+{
+        int j;
+
+        work->first_piece[0] = 0;
+        for (j = 0; j < work->njobs; j++)
+                work->first_piece[j+1] = work->first_piece[j] + work->job[j]->nbands;
+        threads_parallel_for (work->first_piece[work->njobs], remap_task, work);
+}
+
+/* put the remapped channel in place of the original */
+static void
+remap_finish (FitsCutImage *Image, RemapJob *job)
+{
+        int channel = job->channel;
+
+        fitscut_message (3, "REMAP: %ld exact transforms for channel %d\n",
+                         job->g.nexact, channel);
+        free (job->g.wcs_in);
+        free (job->g.wcs_out);
+
         free (Image->data[channel]);
-        Image->data[channel] = (float *) image_out;
-        Image->ncols[channel] = ncols_out;
-        Image->nrows[channel] = nrows_out;
+        Image->data[channel] = job->g.image_out;
+        Image->ncols[channel] = Image->ncolsref;
+        Image->nrows[channel] = Image->nrowsref;
 
         /* update the wcs for this channel */
         Image->wcs[channel] = Image->wcsref;
         Image->output_zoom[channel] = Image->output_zoomref;
         Image->x0[channel] = Image->x0ref;
         Image->y0[channel] = Image->y0ref;
+        free (job);
+}
 
+int
+wcs_remap_channel (FitsCutImage *Image, int channel)
+{
+        RemapWork work;
+
+        work.job[0] = remap_prepare (Image, channel);
+        if (work.job[0] == NULL)
+                return (0);
+        work.njobs = 1;
+        remap_run (&work);
+        remap_finish (Image, work.job[0]);
         return (0);
 }
 
+/*
+ * Remap every channel onto the reference image.  The channels are set up
+ * one at a time, since that changes their WCS, then their rows are
+ * remapped by the worker threads all together.
+ */
+void
+wcs_align_ref (FitsCutImage *Image)
+{
+        RemapWork work;
+        int k, j;
+
+        if (Image->wcsref == NULL)
+                return;
+
+        if (nowcs (Image->wcsref))
+                return;
+
+        work.njobs = 0;
+        for (k = 0; k < Image->channels; k++) {
+            if (Image->data[k] != NULL) {
+                fitscut_message (2, "\t\tremapping channel %d\n", k);
+                work.job[work.njobs] = remap_prepare (Image, k);
+                if (work.job[work.njobs] != NULL)
+                    work.njobs++;
+            }
+        }
+        remap_run (&work);
+        for (j = 0; j < work.njobs; j++)
+                remap_finish (Image, work.job[j]);
+}
+
 /* modify image section for channel to match reference image using WCS */
 
 int
@@ -0,0 +1,232 @@
+/* -*- mode:C; indent-tabs-mode:nil; tab-width:8; c-basic-offset:8; -*-
+ *
+ * IRAF-style zscale display limits (--zscale)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * The cutout is cut into a grid of about nsample cells shaped like the
+ * image, and one valid pixel is taken from each: the middle one, or the
+ * next valid one along the middle row of the cell.  The sorted sample is
+ * fitted with a straight line, rejecting points more than ZSCALE_KREJ
+ * sigma off it (and their neighbours) for up to ZSCALE_MAX_ITER rounds.
+ * The limits are the median -/+ the slope over the sample, divided by
+ * the contrast, kept within the sample range; if too many points were
+ * rejected the sample range itself is used.  This follows the IRAF
+ * algorithm as astropy implements it.  Nothing here depends on the size
+ * of the cutout beyond the walk along a cell row to find a valid pixel.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <math.h>
+
+#ifdef  STDC_HEADERS
+#include <stdlib.h>
+#else   /* Not STDC_HEADERS */
+extern void exit ();
+extern char *malloc ();
+#endif  /* STDC_HEADERS */
+
+#include "fitscut.h"
+#include "zscale.h"
+
+#ifdef DMALLOC
+#include <dmalloc.h>
+#define DMALLOC_FUNC_CHECK 1
+#endif
+
+/* rejection threshold, in standard deviations of the residuals */
+#define ZSCALE_KREJ 2.5
+#define ZSCALE_MAX_ITER 5
+/* the fit is given up if more than this fraction is rejected */
+#define ZSCALE_MAX_REJECT 0.5
+#define ZSCALE_MIN_NPIX 5
+
+static int
+zscale_float_cmp (const void *a, const void *b)
+{
+        float x = *(const float *) a;
+        float y = *(const float *) b;
+
+        return (x > y) - (x < y);
+}
+
+/* one valid pixel from each cell of a grid over the image; returns how many */
+static long
+zscale_sample (float *arrayp, long ncols, long nrows, float bad_data_value,
+               int nsample, float *sample)
+{
+        long nx, ny, i, j, x, x0, x1, y, n = 0;
+        float *row, value;
+
+        nx = sqrt ((double) nsample * ncols / nrows) + 0.5;
+        if (nx < 1) nx = 1;
+        if (nx > ncols) nx = ncols;
+        ny = nsample / nx;
+        if (ny < 1) ny = 1;
+        if (ny > nrows) ny = nrows;
+
+        for (j = 0; j < ny; j++) {
+                y = ((2 * j + 1) * nrows) / (2 * ny);
+                row = arrayp + y * ncols;
+                for (i = 0; i < nx; i++) {
+                        x0 = (i * ncols) / nx;
+                        x1 = ((i + 1) * ncols) / nx;
+                        /* from the middle of the cell, wrapping round to its start */
+                        for (x = (x0 + x1) / 2; ; ) {
+                                value = row[x];
+                                if (finite (value) && value != bad_data_value) {
+                                        sample[n++] = value;
+                                        break;
+                                }
+                                if (++x == x1)
+                                        x = x0;
+                                if (x == (x0 + x1) / 2)
+                                        break;
+                        }
+                }
+        }
+        return n;
+}
+
+/* least squares line through the good points; FALSE if there are too few */
+static int
+zscale_fit (float *sample, unsigned char *bad, long npix, double *slope, double *intercept)
+{
+        double sx = 0, sy = 0, sxx = 0, sxy = 0, n = 0, d;
+        long i;
+
+        for (i = 0; i < npix; i++) {
+                if (bad[i])
+                        continue;
+                n += 1;
+                sx += i;
+                sy += sample[i];
+                sxx += (double) i * i;
+                sxy += i * (double) sample[i];
+        }
+        d = n * sxx - sx * sx;
+        if (n < 2 || d == 0)
+                return FALSE;
+        *slope = (n * sxy - sx * sy) / d;
+        *intercept = (sy - *slope * sx) / n;
+        return TRUE;
+}
+
+/*
+ * zscale limits z1, z2 of an ncols x nrows image, from about nsample of
+ * its valid pixels.  Returns the number of pixels sampled; with none,
+ * z1 and z2 are left alone.
+ */
+long
+zscale (float *arrayp, long ncols, long nrows, float bad_data_value,
+        int nsample, float contrast, double *z1, double *z2)
+{
+        float *sample;
+        unsigned char *bad, *grown;
+        double slope = 0, intercept = 0, median, flat, mean, var, threshold;
+        long npix, ngood, last_ngood, minpix, ngrow, i, j, lo, hi, center, nbad;
+        int iter, fitted = FALSE;
+
+        if (ncols <= 0 || nrows <= 0 || nsample <= 0)
+                return 0;
+        sample = (float *) malloc (sizeof (float) * nsample);
+        npix = zscale_sample (arrayp, ncols, nrows, bad_data_value, nsample, sample);
+        if (npix == 0) {
+                free (sample);
+                return 0;
+        }
+        qsort (sample, npix, sizeof (float), zscale_float_cmp);
+
+        bad = (unsigned char *) calloc (npix, 1);
+        grown = (unsigned char *) malloc (npix);
+        minpix = MAX (ZSCALE_MIN_NPIX, (long) (npix * ZSCALE_MAX_REJECT));
+        ngrow = MAX (1, (long) (npix * 0.01));
+        ngood = npix;
+        last_ngood = npix + 1;
+
+        for (iter = 0; iter < ZSCALE_MAX_ITER; iter++) {
+                if (ngood >= last_ngood || ngood < minpix)
+                        break;
+                if (!zscale_fit (sample, bad, npix, &slope, &intercept))
+                        break;
+                fitted = TRUE;
+
+                /* reject points too far from the line */
+                mean = var = 0;
+                for (i = 0; i < npix; i++) {
+                        if (!bad[i])
+                                mean += sample[i] - (intercept + slope * i);
+                }
+                mean /= ngood;
+                for (i = 0; i < npix; i++) {
+                        if (!bad[i]) {
+                                flat = sample[i] - (intercept + slope * i) - mean;
+                                var += flat * flat;
+                        }
+                }
+                threshold = ZSCALE_KREJ * sqrt (var / ngood);
+                for (i = 0; i < npix; i++) {
+                        flat = sample[i] - (intercept + slope * i);
+                        if (flat < -threshold || flat > threshold)
+                                bad[i] = 1;
+                }
+
+                /* and their neighbours, within ngrow points */
+                nbad = 0;
+                lo = -(ngrow / 2);
+                hi = (ngrow - 1) / 2;
+                for (j = 0; j <= hi && j < npix; j++)
+                        nbad += bad[j];
+                for (i = 0; i < npix; i++) {
+                        grown[i] = nbad > 0;
+                        /* slide the window [i+lo, i+hi] along by one */
+                        if (i + lo >= 0)
+                                nbad -= bad[i + lo];
+                        if (i + hi + 1 < npix)
+                                nbad += bad[i + hi + 1];
+                }
+                last_ngood = ngood;
+                ngood = 0;
+                for (i = 0; i < npix; i++) {
+                        bad[i] = grown[i];
+                        ngood += !bad[i];
+                }
+        }
+
+        *z1 = sample[0];
+        *z2 = sample[npix - 1];
+        if (fitted && ngood >= minpix) {
+                if (contrast > 0)
+                        slope /= contrast;
+                center = (npix - 1) / 2;
+                if (npix % 2)
+                        median = sample[npix / 2];
+                else
+                        median = 0.5 * (sample[npix / 2 - 1] + sample[npix / 2]);
+                *z1 = MAX (*z1, median - (center - 1) * slope);
+                *z2 = MIN (*z2, median + (npix - center) * slope);
+        }
+        fitscut_message (3, "\tzscale: %ld sampled, %ld kept, slope %g\n", npix, ngood, slope);
+
+        free (grown);
+        free (bad);
+        free (sample);
+        return npix;
+}